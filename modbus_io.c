@@ -23,207 +23,2778 @@ along with this plugin.  If not, see <http://www.gnu.org/licenses/>.
 
 #if MBIO_ENABLE
 
+#include <string.h>
+
 #include "modbus_io.h"
 #include "grbl/config.h"
 #include "grbl/hal.h"
 #include "grbl/gcode.h"
 #include "grbl/modbus.h"
 #include "grbl/protocol.h"
+#include "grbl/planner.h"
 #include "grbl/state_machine.h"
 #include "grbl/report.h"
+#include "grbl/nuts_bolts.h"
+#if MBIO_NOTIFY_ENABLE
+    #include "grbl/ioports.h"
+#endif
+#if SDCARD_ENABLE
+    #include "grbl/vfs.h"
+#endif
 #ifdef MBIO_DEBUG
     #include <stdio.h>
 #endif
 
+typedef struct {
+    char device_address;
+    uint8_t function;
+    uint16_t register_address;
+    uint16_t value;                 // value written or number of items to read
+    uint32_t tx_time;               // us, sent on the bus
+    uint8_t tx_length;              // without CRC
+    char adu[MODBUS_MAX_ADU_SIZE];
+} mbio_request_t;
+
+typedef struct {
+    char device_address;
+    uint8_t function;               // read function code of the table the point belongs to
+    uint16_t register_address;
+    uint16_t value;
+    uint32_t timestamp;             // ms, last update
+    bool written;                   // value is from a write acknowledgement, not read back yet
+} mbio_point_t;
+
+typedef struct {
+    bool active;
+    uint16_t lost;                  // records lost since the last one written
+    uint32_t next_keyframe;         // ms
+    uint32_t written;               // bytes written to the file
+    uint_fast16_t head;
+    uint_fast16_t tail;
+    uint8_t data[MBIO_LOG_BUFFER];
+#if SDCARD_ENABLE
+    vfs_file_t *file;
+    char filename[32];
+#endif
+} mbio_log_t;
+
+typedef enum {
+    MBIO_TraceTx = 0,
+    MBIO_TraceRx,
+    MBIO_TraceException,
+} mbio_trace_dir_t;
+
+typedef struct {
+    uint32_t timestamp;             // us
+    uint8_t dir;                    // mbio_trace_dir_t
+    uint8_t length;
+    char adu[MODBUS_MAX_ADU_SIZE];  // without CRC
+} mbio_trace_entry_t;
+
+typedef struct {
+    bool active;
+    uint_fast16_t head;
+    uint_fast16_t count;
+    uint32_t overwritten;
+    mbio_trace_entry_t data[MBIO_TRACE_SIZE];
+} mbio_trace_t;
+
+typedef struct {
+    char device_address;
+    uint8_t function;
+    uint32_t count;
+    uint32_t max;                   // us
+    uint64_t sum;                   // us
+    uint32_t buckets[MBIO_LATENCY_BUCKETS];
+} mbio_latency_t;
+
+typedef struct {
+    uint_fast8_t count;
+    uint32_t untracked;             // executions not recorded as all slots are taken
+    mbio_latency_t slots[MBIO_LATENCY_SLOTS];
+} mbio_latencies_t;
+
+typedef struct {
+    uint32_t seq;                   // sequence number, dropped samples are counted too
+    uint32_t timestamp;             // ms, midpoint between TX and RX
+    uint16_t value;
+    int32_t position[N_AXIS];       // steps, midpoint between TX and RX
+} mbio_sample_t;
+
+typedef struct {
+    bool active;
+    bool busy;                      // sample request is in flight
+    char device_address;
+    uint8_t function;
+    uint16_t register_address;
+    uint32_t interval;              // ms, 0 when sampling by distance
+    float distance;                 // mm, 0 when sampling by time
+    uint32_t next;                  // ms, when the next sample is due
+    uint32_t tx_time;
+    int32_t tx_position[N_AXIS];
+    float last_position[N_AXIS];    // mm, where the last sample was requested
+    uint32_t seq;
+    uint32_t errors;
+    uint32_t dropped;
+} mbio_sampler_t;
+
+typedef struct {
+    bool active;
+    bool busy;
+    char device_address;
+    uint8_t function;
+    uint16_t register_address;
+    float target;                   // load to keep, raw register value
+    uint32_t period;                // ms
+    uint32_t next;                  // ms, when the next read is due
+    bool filtered;                  // load holds a value
+    float load;                     // filtered
+    float override;                 // %, unrounded
+    uint_fast8_t apply;             // %, override to set from the foreground, 0 for none
+} mbio_adapt_t;
+
+typedef struct {
+    bool active;
+    bool busy;
+    char device_address;
+    uint8_t function;
+    uint16_t register_address;
+    float reference;                // raw register value without growth
+    float coefficient;              // mm per register unit
+    uint32_t next;                  // ms, when the next read is due
+    float target;                   // mm, compensation from the last read, 0 when stopped
+    float offset;                   // mm, compensation in the tool length offset
+    float expected;                 // mm, tool length offset of Z after the last compensation
+    tool_offset_mode_t mode;        // tool length offset mode seen last
+    bool cancelled;                 // G49 cancelled the offset, compensation waits for the next G43/G43.1
+    bool reset;                     // the next change of the offset is from the parser init of a reset
+} mbio_thermal_t;
+
+typedef struct {
+    bool enabled;                   // the aux input was claimed
+    volatile bool changed;          // set by the interrupt handler, cleared when the read is sent
+    bool busy;
+    uint8_t port;
+    uint32_t next_poll;             // ms, safety poll
+    uint32_t sent;                  // sequence number of the last read sent
+    uint32_t read;                  // sequence number of the last read completed
+    uint32_t done;                  // sequence number of the last read completed or failed
+} mbio_notify_t;
+
+typedef struct {
+    bool open;                      // a keyframe was sent and no end marker yet
+    uint_fast16_t lines;            // delta lines since the last keyframe
+    uint32_t throttled;             // times streaming was held back by a full output buffer
+    mbio_sample_t last;             // last streamed sample, base for the deltas
+    char line[192];
+} mbio_stream_t;
+
+typedef struct {
+    uint_fast8_t count;
+    mbio_point_t points[MBIO_IMAGE_SIZE];
+} mbio_image_t;
+
+// Features which put points on the scan list, a point is read as long as one of them uses it.
+typedef enum {
+    MBIO_ScanMcode = 1 << 0,        // M104
+    MBIO_ScanRule = 1 << 1,
+    MBIO_ScanLimit = 1 << 2,
+    MBIO_ScanCoolant = 1 << 3
+} mbio_scan_user_t;
+
+typedef struct {
+    char device_address;
+    uint8_t function;
+    uint16_t register_address;
+    uint8_t users;                  // mbio_scan_user_t flags
+} mbio_scan_point_t;
+
+typedef struct {
+    char device_address;
+    uint8_t function;
+    uint16_t register_address;      // first item read
+    uint16_t count;                 // number of items read, gaps included
+    uint_fast8_t points;            // number of scan points in the frame
+} mbio_frame_t;
+
+typedef struct {
+    uint_fast8_t count;
+    mbio_scan_point_t points[MBIO_SCAN_POINTS]; // sorted by device, function code and address
+    uint_fast8_t frames;
+    mbio_frame_t plan[MBIO_SCAN_POINTS];
+    uint32_t cost;                  // character times per scan
+    uint_fast8_t frame;             // next frame to read
+    bool busy;
+    bool restart;                   // the plan changed while a frame was in flight, start over when it completes
+    uint32_t next;                  // ms, start of the next scan
+    uint32_t scans;
+    uint32_t errors;
+} mbio_scan_t;
+
+typedef struct {
+    bool used;
+    bool dirty;                     // value is waiting to be written
+    char device_address;
+    uint8_t function;               // ModBus_WriteCoil or ModBus_WriteRegister
+    uint16_t register_address;
+    uint16_t value;                 // latest value
+    uint32_t period;                // ms, max delay of a write
+    uint32_t deadline;              // ms
+} mbio_deferred_t;
+
+typedef struct {
+    bool busy;
+    uint_fast8_t sending;           // point written
+    uint32_t written;
+    uint32_t coalesced;             // values replaced before they were written
+    uint32_t errors;
+    mbio_deferred_t points[MBIO_WRITE_BEHIND_POINTS];
+} mbio_write_behind_t;
+
+typedef enum {
+    Rule_End = 0,
+    Rule_Begin,
+    Rule_Equal,                     // conditions
+    Rule_NotEqual,
+    Rule_Below,
+    Rule_Above,
+    Rule_Rise,
+    Rule_Fall,
+    Rule_Write,                     // actions
+    Rule_Hold,
+    Rule_Start,
+    Rule_Alarm
+} mbio_rule_op_t;
+
+typedef struct {
+    uint_fast8_t count;
+    uint_fast16_t length;           // bytes of code used, Rule_End excluded
+    uint32_t errors;                // writes which did not fit into the write-behind queue
+    bool active[MBIO_RULE_COUNT];   // conditions are met, level rules fire again only after that ended
+    uint32_t fired[MBIO_RULE_COUNT];
+    uint8_t code[MBIO_RULE_CODE];
+} mbio_rules_t;
+
+typedef struct {
+    char device_address;
+    uint8_t function;
+    uint16_t register_address;
+    uint16_t low;                   // 0 for none
+    uint16_t high;                  // 65535 for none
+    uint16_t hysteresis;
+    uint8_t action;                 // Rule_Hold or Rule_Alarm
+    bool tripped;
+    uint32_t trips;
+} mbio_limit_t;
+
+typedef struct {
+    uint_fast8_t count;
+    mbio_limit_t limits[MBIO_LIMIT_COUNT];
+} mbio_limits_t;
+
+static mbio_request_t requests[MBIO_Contexts] = {0};
+static struct {
+    uint_fast8_t count;
+    mbio_response_t order[MBIO_Contexts]; // requests in the MODBUS driver queue, oldest first
+} pending = {0};
+static mbio_image_t image = {0};
+static mbio_log_t mbio_log = {0};
+static mbio_trace_t trace = {0};
+static mbio_latencies_t latency = {0};
+static mbio_sampler_t sampler = {0};
+static mbio_stream_t stream = {0};
+static mbio_adapt_t adapt = {0};
+static mbio_thermal_t thermal = {0};
+#if MBIO_COOLANT_ENABLE
+static struct {
+    coolant_state_t commanded;
+    coolant_set_state_ptr set_state;
+    coolant_get_state_ptr get_state;
+} coolant = {0};
+#endif
+static mbio_scan_t scan = {0};
+static mbio_write_behind_t write_behind = {0};
+static mbio_rules_t rules = {0};
+static mbio_limits_t limits = {0};
+static uint32_t readback_differs[8] = {0}; // bitmap of the device addresses which are not written through
+#if MBIO_NOTIFY_ENABLE
+static mbio_notify_t notify = {0};
+#endif
+static struct {
+    volatile uint_fast16_t head;
+    volatile uint_fast16_t tail;
+    mbio_sample_t data[MBIO_SAMPLE_BUFFER];
+} samples = {0};
+
 static user_mcode_ptrs_t user_mcode;
 static on_report_options_ptr on_report_options;
+static on_execute_realtime_ptr on_execute_realtime, on_execute_delay;
+static on_reset_ptr on_reset;
 static void mbio_rx_packet (modbus_message_t *msg);
 static void mbio_rx_exception (uint8_t code, void *context);
+static void mbio_scan_error (void);
+static void mbio_write_behind_error (void);
+static void mbio_rules_eval (mbio_point_t *point, uint16_t previous, bool known);
+static void mbio_limits_check (mbio_point_t *point);
+
 
 static const modbus_callbacks_t callbacks = {
     .on_rx_packet = mbio_rx_packet,
     .on_rx_exception = mbio_rx_exception
 };
 
-static void mbio_raise_alarm (void *data) {
-    system_raise_alarm(Status_ExpressionInvalidResult); // TODO implement own error code?
+static inline uint32_t mbio_micros(void) {
+    return hal.get_micros ? hal.get_micros() : hal.get_elapsed_ticks() * 1000;
 }
 
-bool mbio_failed(void) {
-    bool ok = true;
-
-    if (sys.cold_start) {
-        protocol_enqueue_foreground_task(mbio_raise_alarm, NULL);
-    }
-    else {
-        system_raise_alarm(Status_ExpressionInvalidResult); // TODO implement own error code?
-        protocol_enqueue_foreground_task(report_warning, "What's this?");
-    }
+static inline uint_fast16_t mbio_log_used(void) {
+    return (mbio_log.head - mbio_log.tail) & (MBIO_LOG_BUFFER - 1);
+}
 
-    return ok;
+static void mbio_log_put(uint8_t byte) {
+    mbio_log.data[mbio_log.head] = byte;
+    mbio_log.head = (mbio_log.head + 1) & (MBIO_LOG_BUFFER - 1);
 }
 
-static void mbio_rx_exception(uint8_t code, void *context) {
-    // Alarm needs to be raised directly to correctly handle an error during reset (the rt command queue is
-    // emptied on a warm reset). Exception is during cold start, where alarms need to be queued.
-    mbio_failed();
+static void mbio_log_write(mbio_log_record_t type, uint32_t timestamp, const uint8_t *payload, uint8_t length) {
+    mbio_log_put(length);
+    mbio_log_put(type);
+    mbio_log_put(timestamp & 0xFF);
+    mbio_log_put((timestamp >> 8) & 0xFF);
+    mbio_log_put((timestamp >> 16) & 0xFF);
+    mbio_log_put(timestamp >> 24);
+    while (length--) {
+        mbio_log_put(*payload++);
+    }
 }
 
-static void mbio_report_options(bool newopt) {
-    on_report_options(newopt);
+static void mbio_log_record(mbio_log_record_t type, const uint8_t *payload, uint8_t length) {
+    if (!mbio_log.active) {
+        return;
+    }
 
-    if (newopt) {
-        hal.stream.write(",MBIO");
+    uint_fast16_t free = MBIO_LOG_BUFFER - 1 - mbio_log_used();
+    uint32_t timestamp = hal.get_elapsed_ticks();
+
+    if (mbio_log.lost) {
+        if (free < (MBIO_LOG_HEADER + 2) * 2u + length) {
+            if (mbio_log.lost < UINT16_MAX) {
+                mbio_log.lost++;
+            }
+            return;
+        }
+
+        uint8_t lost[2] = { mbio_log.lost & 0xFF, mbio_log.lost >> 8 };
+        mbio_log.lost = 0;
+        mbio_log_write(MBIO_LogLost, timestamp, lost, sizeof(lost));
+        free -= MBIO_LOG_HEADER + sizeof(lost);
     }
-    else {
-        hal.stream.write("[PLUGIN:MODBUS IO v0.1]" ASCII_EOL);
+
+    if (free < MBIO_LOG_HEADER + (uint_fast16_t)length) {
+        if (mbio_log.lost < UINT16_MAX) {
+            mbio_log.lost++;
+        }
+        return;
     }
+
+    mbio_log_write(type, timestamp, payload, length);
 }
 
-void mbio_modbus_send_command(modbus_message_t _cmd, bool block) {
-#ifdef MBIO_DEBUG
-    char buf[30];
-    sprintf(buf, "MODBUS TX: %02X %02X %02X %02X %02X %02X", _cmd.adu[0], _cmd.adu[1], _cmd.adu[2], _cmd.adu[3], _cmd.adu[4], _cmd.adu[5]);
-    report_message(buf, Message_Plain);
-#endif
+static uint8_t *mbio_log_point(uint8_t *payload, mbio_point_t *point) {
+    *payload++ = point->device_address;
+    *payload++ = point->function;
+    *payload++ = point->register_address & 0xFF;
+    *payload++ = point->register_address >> 8;
+    *payload++ = point->value & 0xFF;
+    *payload++ = point->value >> 8;
 
-    modbus_send(&_cmd, &callbacks, true);
+    return payload;
 }
 
-void mbio_ModBus_ReadCoils(char device_address, uint16_t register_address, uint16_t value) {
-    modbus_message_t _cmd = {
-        .context = (void *)MBIO_Command,
-        .crc_check = true,
-        .adu[0] = device_address, // slave device address
-        .adu[1] = ModBus_ReadCoils, // function
-        .adu[2] = MODBUS_SET_MSB16(register_address), // register address
-        .adu[3] = MODBUS_SET_LSB16(register_address),
-        .adu[4] = MODBUS_SET_MSB16(value), // value
-        .adu[5] = MODBUS_SET_LSB16(value),
-        .tx_length = 8,
-        .rx_length = 6
-    };
-    mbio_modbus_send_command(_cmd, true);
+static void mbio_log_keyframe(void) {
+    uint8_t payload[6 * 16], *p = payload;
+
+    for (uint_fast8_t idx = 0; idx < image.count; idx++) {
+        p = mbio_log_point(p, &image.points[idx]);
+        if (p == payload + sizeof(payload) || idx == image.count - 1) {
+            mbio_log_record(MBIO_LogKeyframe, payload, p - payload);
+            p = payload;
+        }
+    }
+
+    mbio_log.next_keyframe = hal.get_elapsed_ticks() + MBIO_LOG_KEYFRAME;
 }
 
-void mbio_ModBus_WriteCoil(char device_address, uint16_t register_address, uint16_t value) {
-    modbus_message_t _cmd = {
-        .context = (void *)MBIO_Command,
-        .crc_check = true,
-        .adu[0] = device_address, // slave device address
-        .adu[1] = ModBus_WriteCoil, // function
-        .adu[2] = MODBUS_SET_MSB16(register_address), // register address
-        .adu[3] = MODBUS_SET_LSB16(register_address),
-        .adu[4] = MODBUS_SET_MSB16(value), // value
-        .adu[5] = MODBUS_SET_LSB16(value),
-        .tx_length = 8,
-        .rx_length = 8
+static void mbio_log_tx(mbio_response_t context, mbio_request_t *request) {
+    uint8_t payload[] = {
+        context,
+        request->device_address,
+        request->function,
+        request->register_address & 0xFF,
+        request->register_address >> 8,
+        request->value & 0xFF,
+        request->value >> 8
     };
-    mbio_modbus_send_command(_cmd, true);
+
+    mbio_log_record(MBIO_LogTx, payload, sizeof(payload));
 }
 
-void mbio_ModBus_ReadDiscreteInputs(char device_address, uint16_t register_address, uint16_t value) {
-    modbus_message_t _cmd = {
-        .context = (void *)MBIO_Command,
-        .crc_check = true,
-        .adu[0] = device_address, // slave device address
-        .adu[1] = ModBus_ReadDiscreteInputs, // function
-        .adu[2] = MODBUS_SET_MSB16(register_address), // register address
-        .adu[3] = MODBUS_SET_LSB16(register_address),
-        .adu[4] = MODBUS_SET_MSB16(value), // number of registers to read
-        .adu[5] = MODBUS_SET_LSB16(value),
-        .tx_length = 8,
-        .rx_length = 6
+static void mbio_log_rx(mbio_response_t context, mbio_request_t *request) {
+    uint32_t rtt = mbio_micros() - request->tx_time;
+    uint8_t payload[] = {
+        context,
+        request->device_address,
+        request->function,
+        rtt & 0xFF,
+        (rtt >> 8) & 0xFF,
+        (rtt >> 16) & 0xFF,
+        rtt >> 24
     };
-    mbio_modbus_send_command(_cmd, true);
+
+    mbio_log_record(MBIO_LogRx, payload, sizeof(payload));
 }
 
-void mbio_ModBus_ReadHoldingRegisters(char device_address, uint16_t register_address) {
-    modbus_message_t _cmd = {
-        .context = (void *)MBIO_Command,
-        .crc_check = true,
-        .adu[0] = device_address, // slave device address
-        .adu[1] = ModBus_ReadHoldingRegisters, // function
-        .adu[2] = MODBUS_SET_MSB16(register_address), // register address
-        .adu[3] = MODBUS_SET_LSB16(register_address),
-        .adu[4] = 0x00, // number of registers to read
-        .adu[5] = 0x01,
-        .tx_length = 8,
-        .rx_length = 7
+static void mbio_log_error(mbio_response_t context, uint8_t code) {
+    uint8_t payload[] = {
+        context,
+        context < MBIO_Contexts ? requests[context].device_address : 0,
+        context < MBIO_Contexts ? requests[context].function : 0,
+        code
     };
-    mbio_modbus_send_command(_cmd, true);
+
+    mbio_log_record(MBIO_LogError, payload, sizeof(payload));
 }
 
-void mbio_ModBus_ReadInputRegisters(char device_address, uint16_t register_address, uint16_t value) {
-    modbus_message_t _cmd = {
-        .context = (void *)MBIO_Command,
-        .crc_check = true,
-        .adu[0] = device_address, // slave device address
-        .adu[1] = ModBus_ReadInputRegisters, // function
-        .adu[2] = MODBUS_SET_MSB16(register_address), // register address
-        .adu[3] = MODBUS_SET_LSB16(register_address),
-        .adu[4] = MODBUS_SET_MSB16(value), // number of registers to read
-        .adu[5] = MODBUS_SET_LSB16(value),
-        .tx_length = 8,
-        .rx_length = 7
-    };
-    mbio_modbus_send_command(_cmd, true);
+static uint8_t mbio_mcode_function(parser_block_t *gc_block) {
+    return gc_block->user_mcode == UserMCode_Generic2 ? ModBus_ReadDiscreteInputs : (uint8_t)gc_block->values.e;
 }
 
-void mbio_ModBus_WriteRegister(char device_address, uint16_t register_address, uint16_t value) {
-    modbus_message_t _cmd = {
-        .context = (void *)MBIO_Command,
-        .crc_check = true,
-        .adu[0] = device_address, // slave device address
-        .adu[1] = ModBus_WriteRegister, // function
-        .adu[2] = MODBUS_SET_MSB16(register_address), // register address
-        .adu[3] = MODBUS_SET_LSB16(register_address),
-        .adu[4] = MODBUS_SET_MSB16(value), // number of registers to read
-        .adu[5] = MODBUS_SET_LSB16(value),
-        .tx_length = 8,
-        .rx_length = 8
+static void mbio_log_mcode(parser_block_t *gc_block, uint32_t duration, bool failed) {
+    uint8_t payload[] = {
+        gc_block->user_mcode & 0xFF,
+        gc_block->user_mcode >> 8,
+        (uint8_t)gc_block->values.d,
+        mbio_mcode_function(gc_block),
+        failed,
+        duration & 0xFF,
+        (duration >> 8) & 0xFF,
+        (duration >> 16) & 0xFF,
+        duration >> 24
     };
-    mbio_modbus_send_command(_cmd, true);
+
+    mbio_log_record(MBIO_LogMcode, payload, sizeof(payload));
 }
 
-int32_t mbio_Wait_ReadDiscreteInputs(char device_address, uint16_t register_address, int32_t value, float timeout) {
-    int32_t ret = -1;
-    uint_fast16_t delay = (uint_fast16_t)ceilf((1000.0f / MBIO_WAIT_STEP) * timeout) + 1;
+// Time from entry to completion of a M101/M102 execution, queueing and waiting included.
+static void mbio_latency_add(parser_block_t *gc_block, uint32_t duration) {
+    char device_address = (char)gc_block->values.d;
+    uint8_t function = mbio_mcode_function(gc_block);
+    uint32_t ms = duration / 1000;
+    mbio_latency_t *slot = NULL;
 
-    do {
-        mbio_ModBus_ReadDiscreteInputs(device_address, register_address, 1);
-        if (sys.var5399 == value) {
-            ret = value;
+    for (uint_fast8_t idx = 0; idx < latency.count; idx++) {
+        if (latency.slots[idx].device_address == device_address && latency.slots[idx].function == function) {
+            slot = &latency.slots[idx];
             break;
         }
-        
-        if (delay) {
-            protocol_execute_realtime();
-            hal.delay_ms(50, NULL);
-        } 
+    }
+
+    if (slot == NULL) {
+        if (latency.count == MBIO_LATENCY_SLOTS) {
+            latency.untracked++;
+            return;
+        }
+        slot = &latency.slots[latency.count++];
+        slot->device_address = device_address;
+        slot->function = function;
+    }
+
+    slot->count++;
+    slot->sum += duration;
+    if (duration > slot->max) {
+        slot->max = duration;
+    }
+    slot->buckets[ms == 0 ? 0 : (ms >= (1 << (MBIO_LATENCY_BUCKETS - 2)) ? MBIO_LATENCY_BUCKETS - 1 : 32 - __builtin_clz(ms))]++;
+}
+
+// Writes at most one chunk per call so the foreground is never stalled for long.
+static void mbio_log_flush(bool all) {
+#if SDCARD_ENABLE
+    if (mbio_log.file == NULL) {
+        return;
+    }
+
+    if (mbio_log.active && (int32_t)(hal.get_elapsed_ticks() - mbio_log.next_keyframe) >= 0) {
+        mbio_log_keyframe();
+    }
+
+    uint_fast16_t length = mbio_log_used();
+
+    if (length >= MBIO_LOG_CHUNK) {
+        length = MBIO_LOG_CHUNK;
+    }
+    else if (!all || length == 0) {
+        return;
+    }
+    else if (mbio_log.tail + length > MBIO_LOG_BUFFER) {
+        length = MBIO_LOG_BUFFER - mbio_log.tail;
+    }
+
+    mbio_log.written += vfs_write(&mbio_log.data[mbio_log.tail], 1, length, mbio_log.file);
+    mbio_log.tail = (mbio_log.tail + length) & (MBIO_LOG_BUFFER - 1);
+#endif
+}
+
+static mbio_point_t *mbio_image_find(char device_address, uint8_t function, uint16_t register_address) {
+    for (uint_fast8_t idx = 0; idx < image.count; idx++) {
+        if (image.points[idx].register_address == register_address
+            && image.points[idx].device_address == device_address
+            && image.points[idx].function == function) {
+
+            return &image.points[idx];
+        }
+    }
+
+    return NULL;
+}
+
+// Points are kept by the function code used for reading them, writes go to the same table.
+static uint8_t mbio_image_table(uint8_t function) {
+    switch (function) {
+        case ModBus_WriteCoil:
+            return ModBus_ReadCoils;
+
+        case ModBus_WriteRegister:
+            return ModBus_ReadHoldingRegisters;
+
+        default:
+            return function;
+    }
+}
+
+static inline bool mbio_readback_differs(char device_address) {
+    return !!(readback_differs[(uint8_t)device_address >> 5] & (1UL << ((uint8_t)device_address & 0x1F)));
+}
+
+// A device which reads back something else than what was written to it gets no more write-through,
+// its points written so far are read from the device again.
+static void mbio_readback_differs_set(char device_address) {
+    readback_differs[(uint8_t)device_address >> 5] |= 1UL << ((uint8_t)device_address & 0x1F);
+
+    for (uint_fast8_t idx = 0; idx < image.count; idx++) {
+        if (image.points[idx].device_address == device_address) {
+            image.points[idx].written = false;
+        }
+    }
+
+    protocol_enqueue_foreground_task(report_warning, "MODBUS I/O: readback differs from write, write-through disabled for the device");
+}
+
+static void mbio_image_update(char device_address, uint8_t function, uint16_t register_address, uint16_t value, bool written) {
+    bool changed = false, known = true;
+    uint16_t previous;
+    mbio_point_t *point;
+
+    function = mbio_image_table(function);
+
+    if ((point = mbio_image_find(device_address, function, register_address)) == NULL) {
+        if (image.count < MBIO_IMAGE_SIZE) {
+            point = &image.points[image.count++];
+        }
         else {
+            // replace the point which was not updated for the longest time
+            point = &image.points[0];
+            for (uint_fast8_t idx = 1; idx < image.count; idx++) {
+                if ((int32_t)(image.points[idx].timestamp - point->timestamp) < 0) {
+                    point = &image.points[idx];
+                }
+            }
+        }
+
+        point->device_address = device_address;
+        point->function = function;
+        point->register_address = register_address;
+        changed = true;
+        known = false;
+    }
+    else if (point->written && !written && point->value != value) {
+        mbio_readback_differs_set(device_address);
+    }
+
+    changed |= point->value != value;
+    previous = point->value;
+    point->value = value;
+    point->timestamp = hal.get_elapsed_ticks();
+    point->written = written;
+
+    if (changed) {
+        uint8_t payload[6];
+        mbio_log_point(payload, point);
+        mbio_log_record(MBIO_LogPoint, payload, sizeof(payload));
+
+        if (rules.count) {
+            mbio_rules_eval(point, previous, known);
+        }
+    }
+
+    if (limits.count) {
+        mbio_limits_check(point);
+    }
+}
+
+static void mbio_image_rx(modbus_message_t *msg, mbio_request_t *request) {
+    uint_fast16_t idx, count = (uint8_t)msg->adu[2];
+
+    // address, function code, byte count and CRC at least
+    if (msg->rx_length < 5) {
+        return;
+    }
+
+    // never read past the received data
+    if (count > (uint_fast16_t)(msg->rx_length - 5)) {
+        count = msg->rx_length - 5;
+    }
+
+    switch (msg->adu[1]) {
+        case ModBus_ReadCoils:
+        case ModBus_ReadDiscreteInputs:
+            if ((count *= 8) > request->value) {
+                count = request->value;
+            }
+            for (idx = 0; idx < count; idx++) {
+                mbio_image_update(request->device_address, request->function, request->register_address + idx, (msg->adu[3 + (idx >> 3)] >> (idx & 0x07)) & 0x01, false);
+            }
+            break;
+
+        case ModBus_ReadHoldingRegisters:
+        case ModBus_ReadInputRegisters:
+            for (idx = 0; idx < count / 2; idx++) {
+                mbio_image_update(request->device_address, request->function, request->register_address + idx, modbus_read_u16(&msg->adu[3 + idx * 2]), false);
+            }
+            break;
+
+        // The acknowledgement echoes address and value, the device has them now.
+        case ModBus_WriteCoil:
+        case ModBus_WriteRegister:
+            if (msg->rx_length >= 8 && !mbio_readback_differs(request->device_address)) {
+                uint16_t value = modbus_read_u16(&msg->adu[4]);
+
+                if (msg->adu[1] == ModBus_WriteCoil) {
+                    value = value == 0xFF00 ? 1 : 0;
+                }
+                mbio_image_update(request->device_address, request->function, modbus_read_u16(&msg->adu[2]), value, true);
+            }
             break;
+    }
+}
+
+// A point written through is known without asking the device again.
+static bool mbio_image_written(char device_address, uint8_t function, uint16_t register_address) {
+    mbio_point_t *point = mbio_image_find(device_address, function, register_address);
+
+    if (point && point->written) {
+        sys.var5399 = point->value;
+        return true;
+    }
+
+    return false;
+}
+
+static void mbio_trace(mbio_trace_dir_t dir, const char *data, uint8_t length) {
+    if (!trace.active) {
+        return;
+    }
+
+    mbio_trace_entry_t *entry = &trace.data[trace.head];
+
+    entry->timestamp = mbio_micros();
+    entry->dir = dir;
+    entry->length = length > MODBUS_MAX_ADU_SIZE ? MODBUS_MAX_ADU_SIZE : length;
+    memcpy(entry->adu, data, entry->length);
+
+    trace.head = (trace.head + 1) & (MBIO_TRACE_SIZE - 1);
+    if (trace.count < MBIO_TRACE_SIZE) {
+        trace.count++;
+    }
+    else {
+        trace.overwritten++;
+    }
+}
+
+// The driver sends the queued requests one at a time, so a request goes on the bus when the one before it
+// is completed. Requests of other plugins on the same bus are not seen, one queued behind them is stamped early.
+static void mbio_request_sent(mbio_response_t context) {
+    mbio_request_t *request = &requests[context];
+
+    request->tx_time = mbio_micros();
+    mbio_log_tx(context, request);
+    mbio_trace(MBIO_TraceTx, request->adu, request->tx_length);
+
+    if (context == MBIO_Sample) {
+        sampler.tx_time = hal.get_elapsed_ticks();
+        memcpy(sampler.tx_position, sys.position, sizeof(sampler.tx_position));
+    }
+}
+
+static bool mbio_pending_remove(mbio_response_t context) {
+    for (uint_fast8_t idx = 0; idx < pending.count; idx++) {
+        if (pending.order[idx] == context) {
+            memmove(&pending.order[idx], &pending.order[idx + 1], (pending.count - idx - 1) * sizeof(mbio_response_t));
+            pending.count--;
+            return true;
         }
-    } while(--delay && !sys.abort);
+    }
+
+    return false;
+}
+
+static void mbio_pending_add(mbio_response_t context) {
+    mbio_pending_remove(context);
+    pending.order[pending.count++] = context;
+
+    if (pending.count == 1) {
+        mbio_request_sent(context);
+    }
+}
+
+// Response, exception or timeout of a request, the next one queued is sent now.
+static void mbio_pending_done(mbio_response_t context) {
+    bool first = pending.count && pending.order[0] == context;
+
+    if (mbio_pending_remove(context) && first && pending.count) {
+        mbio_request_sent(pending.order[0]);
+    }
+}
+
+// $MBIOTRACE - dump captured frames, $MBIOTRACE=ON - clear and start capture, $MBIOTRACE=OFF - stop capture.
+// Frames are dumped oldest first as [MBT:<us>,<T|R|E>,<hex bytes without CRC>] followed by [MBTEND:<frames>,<overwritten>].
+static status_code_t mbio_cmd_trace(sys_state_t state, char *args) {
+    static const char hex[] = "0123456789ABCDEF";
+
+    if (args == NULL) {
+        char line[MODBUS_MAX_ADU_SIZE * 2 + 4];
+        uint_fast16_t idx = (trace.head - trace.count) & (MBIO_TRACE_SIZE - 1), count = trace.count;
+
+        while (count--) {
+            mbio_trace_entry_t *entry = &trace.data[idx];
+            char *s = line;
+
+            *s++ = ',';
+            *s++ = "TRE"[entry->dir];
+            *s++ = ',';
+            for (uint_fast8_t i = 0; i < entry->length; i++) {
+                *s++ = hex[(uint8_t)entry->adu[i] >> 4];
+                *s++ = hex[entry->adu[i] & 0x0F];
+            }
+            *s = '\0';
+
+            hal.stream.write("[MBT:");
+            hal.stream.write(uitoa(entry->timestamp));
+            hal.stream.write(line);
+            hal.stream.write("]" ASCII_EOL);
+
+            idx = (idx + 1) & (MBIO_TRACE_SIZE - 1);
+        }
+
+        hal.stream.write("[MBTEND:");
+        hal.stream.write(uitoa(trace.count));
+        hal.stream.write(",");
+        hal.stream.write(uitoa(trace.overwritten));
+        hal.stream.write("]" ASCII_EOL);
+    }
+    else if (!strcmp(args, "ON")) {
+        trace.head = trace.count = 0;
+        trace.overwritten = 0;
+        trace.active = true;
+    }
+    else if (!strcmp(args, "OFF")) {
+        trace.active = false;
+    }
+    else {
+        return Status_InvalidStatement;
+    }
+
+    return Status_OK;
+}
+
+// $MBIOLAT - report the M-code latency histograms as [MBIOLAT:<device>,<function>,<count>,<avg us>,<max us>,<bucket counts>]
+// followed by [MBIOLATEND:<untracked>], $MBIOLAT=RESET - clear them.
+static status_code_t mbio_cmd_latency(sys_state_t state, char *args) {
+    if (args) {
+        if (strcmp(args, "RESET")) {
+            return Status_InvalidStatement;
+        }
+        memset(&latency, 0, sizeof(latency));
+
+        return Status_OK;
+    }
+
+    for (uint_fast8_t idx = 0; idx < latency.count; idx++) {
+        mbio_latency_t *slot = &latency.slots[idx];
+
+        hal.stream.write("[MBIOLAT:");
+        hal.stream.write(uitoa((uint8_t)slot->device_address));
+        hal.stream.write(",");
+        hal.stream.write(uitoa(slot->function));
+        hal.stream.write(",");
+        hal.stream.write(uitoa(slot->count));
+        hal.stream.write(",");
+        hal.stream.write(uitoa((uint32_t)(slot->sum / slot->count)));
+        hal.stream.write(",");
+        hal.stream.write(uitoa(slot->max));
+        for (uint_fast8_t bucket = 0; bucket < MBIO_LATENCY_BUCKETS; bucket++) {
+            hal.stream.write(",");
+            hal.stream.write(uitoa(slot->buckets[bucket]));
+        }
+        hal.stream.write("]" ASCII_EOL);
+    }
+
+    hal.stream.write("[MBIOLATEND:");
+    hal.stream.write(uitoa(latency.untracked));
+    hal.stream.write("]" ASCII_EOL);
+
+    return Status_OK;
+}
+
+// $MBIOPLAN - report the reads of a scan as [MBIOPLAN:<device>,<function>,<first address>,<count>,<points>]
+// followed by [MBIOPLANEND:<frames>,<points>,<character times>,<scans>,<errors>].
+static status_code_t mbio_cmd_plan(sys_state_t state, char *args) {
+    if (args) {
+        return Status_InvalidStatement;
+    }
+
+    for (uint_fast8_t idx = 0; idx < scan.frames; idx++) {
+        mbio_frame_t *frame = &scan.plan[idx];
+
+        hal.stream.write("[MBIOPLAN:");
+        hal.stream.write(uitoa((uint8_t)frame->device_address));
+        hal.stream.write(",");
+        hal.stream.write(uitoa(frame->function));
+        hal.stream.write(",");
+        hal.stream.write(uitoa(frame->register_address + 1));
+        hal.stream.write(",");
+        hal.stream.write(uitoa(frame->count));
+        hal.stream.write(",");
+        hal.stream.write(uitoa(frame->points));
+        hal.stream.write("]" ASCII_EOL);
+    }
+
+    hal.stream.write("[MBIOPLANEND:");
+    hal.stream.write(uitoa(scan.frames));
+    hal.stream.write(",");
+    hal.stream.write(uitoa(scan.count));
+    hal.stream.write(",");
+    hal.stream.write(uitoa(scan.cost));
+    hal.stream.write(",");
+    hal.stream.write(uitoa(scan.scans));
+    hal.stream.write(",");
+    hal.stream.write(uitoa(scan.errors));
+    hal.stream.write("]" ASCII_EOL);
+
+    return Status_OK;
+}
+
+#if SDCARD_ENABLE
+
+static void mbio_log_stop(void) {
+    if (mbio_log.file) {
+        mbio_log.active = false;
+        while (mbio_log_used()) {
+            mbio_log_flush(true);
+        }
+        vfs_close(mbio_log.file);
+        mbio_log.file = NULL;
+    }
+}
+
+static status_code_t mbio_log_start(char *filename) {
+    static const uint8_t start[] = { 'M', 'B', 'I', 'O', MBIO_LOG_VERSION };
+
+    mbio_log_stop();
+
+    if (strlen(filename) >= sizeof(mbio_log.filename) || (mbio_log.file = vfs_open(filename, "a")) == NULL) {
+        return Status_SDFailedOpenFile;
+    }
+
+    strcpy(mbio_log.filename, filename);
+    mbio_log.head = mbio_log.tail = 0;
+    mbio_log.lost = 0;
+    mbio_log.written = 0;
+    mbio_log.active = true;
+
+    mbio_log_record(MBIO_LogStart, start, sizeof(start));
+    mbio_log_keyframe();
+
+    return Status_OK;
+}
+
+// $MBIOLOG - report logging status, $MBIOLOG=<filename> - start logging, $MBIOLOG=OFF - stop logging.
+static status_code_t mbio_cmd_log(sys_state_t state, char *args) {
+    status_code_t status = Status_OK;
+
+    if (args == NULL) {
+        hal.stream.write("[MBIOLOG:");
+        if (mbio_log.file) {
+            hal.stream.write(mbio_log.filename);
+            hal.stream.write(",");
+            hal.stream.write(uitoa(mbio_log.written + mbio_log_used()));
+            hal.stream.write(",");
+            hal.stream.write(uitoa(mbio_log.lost));
+        }
+        else {
+            hal.stream.write("OFF");
+        }
+        hal.stream.write("]" ASCII_EOL);
+    }
+    else if (!strcmp(args, "OFF")) {
+        mbio_log_stop();
+    }
+    else {
+        status = mbio_log_start(args);
+    }
+
+    return status;
+}
+
+#endif
+
+#if MBIO_BENCH || MBIO_PROFILE
+
+// The DWT cycle counter of the Cortex-M3/M4/M7, ns in the host builds of tests/, other targets fall back to us.
+#if defined(__ARM_ARCH_7EM__) || defined(__ARM_ARCH_7M__)
+    #define MBIO_DWT_CTRL   (*(volatile uint32_t *)0xE0001000)
+    #define MBIO_DWT_CYCCNT (*(volatile uint32_t *)0xE0001004)
+    #define MBIO_DEMCR      (*(volatile uint32_t *)0xE000EDFC)
+    #define MBIO_CYCLES_UNIT "cycles"
+
+    static inline void mbio_cycles_init(void) {
+        MBIO_DEMCR |= (1 << 24); // TRCENA
+        MBIO_DWT_CTRL |= 1;      // CYCCNTENA
+    }
+
+    static inline uint32_t mbio_cycles(void) {
+        return MBIO_DWT_CYCCNT;
+    }
+#elif defined(MBIO_HOST)
+    #include <time.h>
+
+    #define MBIO_CYCLES_UNIT "ns"
+
+    static inline void mbio_cycles_init(void) {
+    }
+
+    static inline uint32_t mbio_cycles(void) {
+        struct timespec now;
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+
+        return (uint32_t)((uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec);
+    }
+#else
+    #define MBIO_CYCLES_UNIT "us"
+
+    static inline void mbio_cycles_init(void) {
+    }
+
+    static inline uint32_t mbio_cycles(void) {
+        return hal.get_micros ? hal.get_micros() : hal.get_elapsed_ticks() * 1000;
+    }
+#endif
+
+#endif
+
+#if MBIO_BENCH
+static bool bench_dry_run = false; // do not send anything while benchmarking
+#endif
+
+#if MBIO_PROFILE
+
+typedef enum {
+    MBIO_ProbeEncode = 0,
+    MBIO_ProbeSend,
+    MBIO_ProbeRx,
+    MBIO_ProbeWait,
+    MBIO_ProbeExecute,
+    MBIO_ProbePoll,
+    MBIO_ProbeRules,
+    MBIO_Probes
+} mbio_probe_id_t;
+
+typedef struct {
+    uint32_t count;
+    uint32_t min;
+    uint32_t max;
+    uint64_t sum;
+    uint32_t stack;                 // bytes, high-water mark below the entry point
+} mbio_probe_t;
+
+static const char *const probe_names[MBIO_Probes] = { "encode", "send", "rx", "wait", "execute", "poll", "rules" };
+static mbio_probe_t probes[MBIO_Probes] = {0};
+
+static void mbio_probe_add(mbio_probe_id_t id, uint32_t start) {
+    uint32_t cycles = mbio_cycles() - start;
+    mbio_probe_t *probe = &probes[id];
+
+    if (probe->count++ == 0 || cycles < probe->min) {
+        probe->min = cycles;
+    }
+    if (cycles > probe->max) {
+        probe->max = cycles;
+    }
+    probe->sum += cycles;
+}
+
+#define MBIO_PROBE_START(name) uint32_t name = mbio_cycles()
+#define MBIO_PROBE_END(id, name) mbio_probe_add(id, name)
+
+#if MBIO_PROFILE_STACK
+
+#define MBIO_STACK_PATTERN 0xA5A5A5A5
+#define MBIO_STACK_MARGIN 16 // words kept clear of the frame of mbio_stack_paint()
+
+static bool stack_painted = false;
+
+// Paints the free stack below the caller, nested entry points are not measured as they would wipe the outer mark.
+static __attribute__((noinline)) uint32_t *mbio_stack_paint(void) {
+    if (stack_painted) {
+        return NULL;
+    }
+
+    uint32_t *top = (uint32_t *)__builtin_frame_address(0) - MBIO_STACK_MARGIN, *p = top;
+
+    for (uint_fast16_t words = MBIO_PROFILE_STACK / 4; words; words--) {
+        *--p = MBIO_STACK_PATTERN;
+    }
+    stack_painted = true;
+
+    return top;
+}
+
+static __attribute__((noinline)) void mbio_stack_check(mbio_probe_id_t id, uint32_t *top) {
+    if (top) {
+        uint32_t *p = top - MBIO_PROFILE_STACK / 4, used;
+
+        while (p < top && *p == MBIO_STACK_PATTERN) {
+            p++;
+        }
+
+        // the margin is counted as used, so the mark errs on the safe side
+        if ((used = (top - p + MBIO_STACK_MARGIN) * 4) > probes[id].stack) {
+            probes[id].stack = used;
+        }
+        stack_painted = false;
+    }
+}
+
+#define MBIO_ENTRY_START(name) uint32_t *name##_top = mbio_stack_paint(); MBIO_PROBE_START(name)
+#define MBIO_ENTRY_END(id, name) MBIO_PROBE_END(id, name); mbio_stack_check(id, name##_top)
+
+#else
+
+#define MBIO_ENTRY_START(name) MBIO_PROBE_START(name)
+#define MBIO_ENTRY_END(id, name) MBIO_PROBE_END(id, name)
+
+#endif
+
+#else
+
+#define MBIO_PROBE_START(name)
+#define MBIO_PROBE_END(id, name)
+#define MBIO_ENTRY_START(name)
+#define MBIO_ENTRY_END(id, name)
+
+#endif
+
+static void mbio_raise_alarm (void *data) {
+    system_raise_alarm(Status_ExpressionInvalidResult); // TODO implement own error code?
+}
+
+bool mbio_failed(void) {
+    bool ok = true;
+
+    if (sys.cold_start) {
+        protocol_enqueue_foreground_task(mbio_raise_alarm, NULL);
+    }
+    else {
+        system_raise_alarm(Status_ExpressionInvalidResult); // TODO implement own error code?
+        protocol_enqueue_foreground_task(report_warning, "What's this?");
+    }
+
+    return ok;
+}
+
+static void mbio_rx_exception(uint8_t code, void *context) {
+    mbio_log_error((mbio_response_t)context, code);
+    mbio_trace(MBIO_TraceException, (char *)&code, 1);
+    mbio_pending_done((mbio_response_t)context);
+
+    // A lost sample is not worth stopping the machine for, just count it.
+    if ((mbio_response_t)context == MBIO_Sample) {
+        sampler.busy = false;
+        sampler.errors++;
+        return;
+    }
+
+    // The override stays as it is until the next read, the thermal compensation too.
+    if ((mbio_response_t)context == MBIO_Adapt) {
+        adapt.busy = false;
+        return;
+    }
+
+    if ((mbio_response_t)context == MBIO_Thermal) {
+        thermal.busy = false;
+        return;
+    }
+
+#if MBIO_NOTIFY_ENABLE
+    // Same for a change read, retry on the next poll.
+    if ((mbio_response_t)context == MBIO_Notify) {
+        notify.busy = false;
+        notify.changed = true;
+        notify.done = notify.sent;
+        return;
+    }
+#endif
+
+    // And for a scan read, the next scan reads it again.
+    if ((mbio_response_t)context == MBIO_Scan) {
+        mbio_scan_error();
+        return;
+    }
+
+    // Deferred writes are for outputs which are not critical.
+    if ((mbio_response_t)context == MBIO_WriteBehind) {
+        mbio_write_behind_error();
+        return;
+    }
+
+    // Alarm needs to be raised directly to correctly handle an error during reset (the rt command queue is
+    // emptied on a warm reset). Exception is during cold start, where alarms need to be queued.
+    mbio_failed();
+}
+
+static void mbio_report_options(bool newopt) {
+    on_report_options(newopt);
+
+    if (newopt) {
+        hal.stream.write(",MBIO");
+    }
+    else {
+        hal.stream.write("[PLUGIN:MODBUS IO v0.1]" ASCII_EOL);
+    }
+}
+
+void mbio_modbus_send_command(modbus_message_t _cmd, bool block) {
+    mbio_response_t context = (mbio_response_t)_cmd.context;
+    mbio_request_t *request = &requests[context];
+
+    request->device_address = _cmd.adu[0];
+    request->function = _cmd.adu[1];
+    request->register_address = ((uint8_t)_cmd.adu[2] << 8) | (uint8_t)_cmd.adu[3];
+    request->value = ((uint8_t)_cmd.adu[4] << 8) | (uint8_t)_cmd.adu[5];
+    request->tx_length = _cmd.tx_length - 2 > MODBUS_MAX_ADU_SIZE ? MODBUS_MAX_ADU_SIZE : _cmd.tx_length - 2;
+    memcpy(request->adu, _cmd.adu, request->tx_length);
+
+#if MBIO_BENCH
+    if (bench_dry_run) {
+        return;
+    }
+#endif
+
+    // Logged and traced when it is sent.
+    mbio_pending_add(context);
+
+#ifdef MBIO_DEBUG
+    char buf[30];
+    sprintf(buf, "MODBUS TX: %02X %02X %02X %02X %02X %02X", _cmd.adu[0], _cmd.adu[1], _cmd.adu[2], _cmd.adu[3], _cmd.adu[4], _cmd.adu[5]);
+    report_message(buf, Message_Plain);
+#endif
+
+    MBIO_PROBE_START(probe);
+    if (!modbus_send(&_cmd, &callbacks, block)) {
+        mbio_pending_done(context); // not queued, or the callbacks were called already
+    }
+    MBIO_PROBE_END(MBIO_ProbeSend, probe);
+}
+
+static void mbio_encode_request(modbus_message_t *cmd, mbio_response_t context, char device_address, uint8_t function, uint16_t register_address, uint16_t value, uint8_t rx_length) {
+    MBIO_PROBE_START(probe);
+
+    cmd->context = (void *)context;
+    cmd->crc_check = true;
+    cmd->adu[0] = device_address; // slave device address
+    cmd->adu[1] = function; // function
+    cmd->adu[2] = MODBUS_SET_MSB16(register_address); // register address
+    cmd->adu[3] = MODBUS_SET_LSB16(register_address);
+    cmd->adu[4] = MODBUS_SET_MSB16(value); // value or number of items to read
+    cmd->adu[5] = MODBUS_SET_LSB16(value);
+    cmd->tx_length = 8;
+    cmd->rx_length = rx_length;
+
+    MBIO_PROBE_END(MBIO_ProbeEncode, probe);
+}
+
+void mbio_ModBus_ReadCoils(char device_address, uint16_t register_address, uint16_t value) {
+    modbus_message_t _cmd;
+    mbio_encode_request(&_cmd, MBIO_Command, device_address, ModBus_ReadCoils, register_address, value, 6);
+    mbio_modbus_send_command(_cmd, true);
+}
+
+void mbio_ModBus_WriteCoil(char device_address, uint16_t register_address, uint16_t value) {
+    modbus_message_t _cmd;
+    mbio_encode_request(&_cmd, MBIO_Command, device_address, ModBus_WriteCoil, register_address, value, 8);
+    mbio_modbus_send_command(_cmd, true);
+}
+
+void mbio_ModBus_ReadDiscreteInputs(char device_address, uint16_t register_address, uint16_t value) {
+    modbus_message_t _cmd;
+    mbio_encode_request(&_cmd, MBIO_Command, device_address, ModBus_ReadDiscreteInputs, register_address, value, 6);
+    mbio_modbus_send_command(_cmd, true);
+}
+
+void mbio_ModBus_ReadHoldingRegisters(char device_address, uint16_t register_address) {
+    modbus_message_t _cmd;
+    mbio_encode_request(&_cmd, MBIO_Command, device_address, ModBus_ReadHoldingRegisters, register_address, 1, 7);
+    mbio_modbus_send_command(_cmd, true);
+}
+
+void mbio_ModBus_ReadInputRegisters(char device_address, uint16_t register_address, uint16_t value) {
+    modbus_message_t _cmd;
+    mbio_encode_request(&_cmd, MBIO_Command, device_address, ModBus_ReadInputRegisters, register_address, value, 7);
+    mbio_modbus_send_command(_cmd, true);
+}
+
+void mbio_ModBus_WriteRegister(char device_address, uint16_t register_address, uint16_t value) {
+    modbus_message_t _cmd;
+    mbio_encode_request(&_cmd, MBIO_Command, device_address, ModBus_WriteRegister, register_address, value, 8);
+    mbio_modbus_send_command(_cmd, true);
+}
+
+#if MBIO_NOTIFY_ENABLE
+
+// Inputs read on change notifications are waited for in the I/O image, no need to poll the bus.
+// The image may hold a value from before the block started, only a read sent after that counts. A read
+// in flight may have sampled the inputs earlier, so it does not. The timeout applies once that read
+// completed or failed, so R0 or an R shorter than the round trip still checks the inputs once.
+static int32_t mbio_notify_wait(char device_address, uint16_t register_address, int32_t value, float timeout) {
+    uint32_t timeout_at = hal.get_elapsed_ticks() + (uint32_t)(timeout * 1000.0f), fresh = notify.sent + 1;
+    mbio_point_t *point;
+
+    notify.changed = true; // read now, not on the next change or safety poll
+
+    while ((point = mbio_image_find(device_address, ModBus_ReadDiscreteInputs, register_address))) {
+        if ((int32_t)(notify.read - fresh) >= 0 && (int32_t)point->value == value) {
+            return sys.var5399 = value;
+        }
+
+        if (((int32_t)(notify.done - fresh) >= 0 && (int32_t)(hal.get_elapsed_ticks() - timeout_at) >= 0) || sys.abort) {
+            return -1;
+        }
+
+        protocol_execute_realtime(); // runs the change reads
+    }
+
+    return -2; // not in the image (yet), poll the bus
+}
+
+#endif
+
+int32_t mbio_Wait_ReadDiscreteInputs(char device_address, uint16_t register_address, int32_t value, float timeout) {
+    int32_t ret = -1;
+    uint_fast16_t delay = (uint_fast16_t)ceilf((1000.0f / MBIO_WAIT_STEP) * timeout) + 1;
+
+#if MBIO_NOTIFY_ENABLE
+    if (notify.enabled && device_address == MBIO_NOTIFY_DEVICE && register_address >= MBIO_NOTIFY_ADDRESS - 1 &&
+         register_address < MBIO_NOTIFY_ADDRESS - 1 + MBIO_NOTIFY_COUNT && (ret = mbio_notify_wait(device_address, register_address, value, timeout)) != -2) {
+        return ret;
+    }
+    ret = -1;
+#endif
+
+    do {
+        MBIO_PROBE_START(probe);
+
+        mbio_ModBus_ReadDiscreteInputs(device_address, register_address, 1);
+        if (sys.var5399 == value) {
+            ret = value;
+            MBIO_PROBE_END(MBIO_ProbeWait, probe);
+            break;
+        }
+        
+        if (delay) {
+            protocol_execute_realtime();
+            hal.delay_ms(50, NULL);
+        } 
+        else {
+            MBIO_PROBE_END(MBIO_ProbeWait, probe);
+            break;
+        }
+
+        MBIO_PROBE_END(MBIO_ProbeWait, probe);
+    } while(--delay && !sys.abort);
+
+#ifdef MBIO_DEBUG
+    char buf[40];
+    sprintf(buf, "MODBUS WAIT VAL: %d, expected %d, rt %.2f s", ret, value, delay * MBIO_WAIT_STEP / 1000.0f);
+    report_message(buf, Message_Plain);
+
+#endif
+
+    return ret;
+}
+
+static void mbio_sampler_request(void) {
+    modbus_message_t _cmd;
+
+    mbio_encode_request(&_cmd, MBIO_Sample, sampler.device_address, sampler.function, sampler.register_address, 1, 7);
+
+    sampler.busy = true;
+
+    mbio_modbus_send_command(_cmd, false); // TX time and position are taken when it is sent
+}
+
+#if MBIO_NOTIFY_ENABLE
+
+static void mbio_notify_irq(uint8_t port, bool state) {
+    notify.changed = true;
+}
+
+static void mbio_notify_request(void) {
+    modbus_message_t _cmd;
+
+    notify.changed = false; // a change during the transfer triggers another read
+    notify.busy = true;
+    notify.sent++;
+    notify.next_poll = hal.get_elapsed_ticks() + MBIO_NOTIFY_POLL;
+
+    mbio_encode_request(&_cmd, MBIO_Notify, MBIO_NOTIFY_DEVICE, ModBus_ReadDiscreteInputs, MBIO_NOTIFY_ADDRESS - 1, MBIO_NOTIFY_COUNT, 5 + (MBIO_NOTIFY_COUNT + 7) / 8);
+    mbio_modbus_send_command(_cmd, false);
+}
+
+static void mbio_notify_init(void) {
+    notify.port = MBIO_NOTIFY_PORT;
+
+    if (ioport_claim(Port_Digital, Port_Input, &notify.port, "MODBUS I/O change") &&
+         hal.port.register_interrupt_handler(notify.port, MBIO_NOTIFY_IRQ, mbio_notify_irq)) {
+        notify.enabled = notify.changed = true; // read the initial state
+    }
+    else {
+        protocol_enqueue_foreground_task(report_warning, "MODBUS I/O: change input not available!");
+    }
+}
+
+#endif
+
+// Max items per read: the protocol limits or what fits into a MODBUS message of the core, whichever is less.
+#define MBIO_READ_BITS ((MODBUS_MAX_ADU_SIZE - 5) * 8 < 2000 ? (MODBUS_MAX_ADU_SIZE - 5) * 8 : 2000)
+#define MBIO_READ_REGISTERS ((MODBUS_MAX_ADU_SIZE - 5) / 2 < 125 ? (MODBUS_MAX_ADU_SIZE - 5) / 2 : 125)
+
+static inline bool mbio_scan_bits(uint8_t function) {
+    return function == ModBus_ReadCoils || function == ModBus_ReadDiscreteInputs;
+}
+
+static inline uint_fast16_t mbio_scan_bytes(uint8_t function, uint_fast16_t count) {
+    return mbio_scan_bits(function) ? (count + 7) / 8 : count * 2;
+}
+
+static inline uint32_t mbio_scan_key(char device_address, uint8_t function, uint16_t register_address) {
+    return ((uint32_t)(uint8_t)device_address << 24) | ((uint32_t)function << 16) | register_address;
+}
+
+// Returns the index of the point or where it goes in the sorted list.
+static uint_fast8_t mbio_scan_find(char device_address, uint8_t function, uint16_t register_address, bool *found) {
+    uint32_t key = mbio_scan_key(device_address, function, register_address), other = 0;
+    uint_fast8_t idx = 0;
+
+    while (idx < scan.count && (other = mbio_scan_key(scan.points[idx].device_address, scan.points[idx].function, scan.points[idx].register_address)) < key) {
+        idx++;
+    }
+
+    *found = idx < scan.count && other == key;
+
+    return idx;
+}
+
+static bool mbio_scan_add(char device_address, uint8_t function, uint16_t register_address, mbio_scan_user_t user) {
+    bool found;
+    uint_fast8_t idx = mbio_scan_find(device_address, function, register_address, &found);
+
+    if (found) {
+        scan.points[idx].users |= user;
+        return true;
+    }
+
+    if (scan.count == MBIO_SCAN_POINTS) {
+        return false;
+    }
+
+    memmove(&scan.points[idx + 1], &scan.points[idx], (scan.count - idx) * sizeof(mbio_scan_point_t));
+    scan.points[idx].device_address = device_address;
+    scan.points[idx].function = function;
+    scan.points[idx].register_address = register_address;
+    scan.points[idx].users = user;
+    scan.count++;
+
+    return true;
+}
+
+// Splits the points into the reads with the lowest bus cost. Each read costs MBIO_FRAME_COST character times
+// plus its data, so a gap is read along when that is cheaper than another frame. Reads are split at the item limit.
+// cost[n] is the cheapest plan for the first n points, the last read of it starts at point start[n - 1].
+static void mbio_scan_plan(void) {
+    uint32_t cost[MBIO_SCAN_POINTS + 1];
+    uint_fast8_t start[MBIO_SCAN_POINTS], idx, first, group = 0;
+
+    // An idle scan starts right away, its next time is stale and can be more than 2^31 ms in the past.
+    if (scan.frames == 0) {
+        scan.next = hal.get_elapsed_ticks();
+    }
+
+    cost[0] = 0;
+
+    for (idx = 0; idx < scan.count; idx++) {
+        mbio_scan_point_t *last = &scan.points[idx];
+        uint_fast16_t limit = mbio_scan_bits(last->function) ? MBIO_READ_BITS : MBIO_READ_REGISTERS;
+
+        // a read covers one table of one device
+        if (idx && (last->device_address != last[-1].device_address || last->function != last[-1].function)) {
+            group = idx;
+        }
+
+        cost[idx + 1] = UINT32_MAX;
+        first = idx;
+
+        do {
+            uint_fast16_t count = last->register_address - scan.points[first].register_address + 1;
+
+            if (count > limit) {
+                break;
+            }
+
+            if (cost[first] + MBIO_FRAME_COST + mbio_scan_bytes(last->function, count) < cost[idx + 1]) {
+                cost[idx + 1] = cost[first] + MBIO_FRAME_COST + mbio_scan_bytes(last->function, count);
+                start[idx] = first;
+            }
+        } while (first-- > group);
+    }
+
+    scan.frames = 0;
+    for (idx = scan.count; idx; idx = start[idx - 1]) {
+        scan.frames++;
+    }
+
+    // walk back from the last point, the frames come out in reverse order
+    first = scan.frames;
+    for (idx = scan.count; idx; idx = start[idx - 1]) {
+        mbio_frame_t *frame = &scan.plan[--first];
+        mbio_scan_point_t *point = &scan.points[start[idx - 1]];
+
+        frame->device_address = point->device_address;
+        frame->function = point->function;
+        frame->register_address = point->register_address;
+        frame->count = scan.points[idx - 1].register_address - point->register_address + 1;
+        frame->points = idx - start[idx - 1];
+    }
+
+    scan.cost = cost[scan.count];
+    scan.frame = 0;
+    scan.restart = scan.busy;
+}
+
+static void mbio_scan_request(void) {
+    modbus_message_t _cmd;
+    mbio_frame_t *frame = &scan.plan[scan.frame];
+
+    if (scan.frame == 0) {
+        scan.next = hal.get_elapsed_ticks() + MBIO_SCAN_INTERVAL;
+    }
+    scan.busy = true;
+
+    mbio_encode_request(&_cmd, MBIO_Scan, frame->device_address, frame->function, frame->register_address, frame->count, 5 + mbio_scan_bytes(frame->function, frame->count));
+    mbio_modbus_send_command(_cmd, false);
+}
+
+static void mbio_scan_next(void) {
+    scan.busy = false;
+
+    // the frame completed belongs to the previous plan, the new one starts at its first frame
+    if (scan.restart) {
+        scan.restart = false;
+        return;
+    }
+
+    if (++scan.frame >= scan.frames) {
+        scan.frame = 0;
+        scan.scans++;
+    }
+}
+
+// Only the scan points go to the I/O image, not the gaps read along.
+// The request sent is used for decoding as the plan may have changed in the meantime.
+static void mbio_scan_rx(modbus_message_t *msg) {
+    mbio_request_t *request = &requests[MBIO_Scan];
+    uint_fast16_t bytes = (uint8_t)msg->adu[2];
+    bool bits = mbio_scan_bits(request->function);
+
+    // never read past the received data
+    if (msg->rx_length < 5) {
+        bytes = 0;
+    }
+    else if (bytes > (uint_fast16_t)(msg->rx_length - 5)) {
+        bytes = msg->rx_length - 5;
+    }
+
+    for (uint_fast8_t idx = 0; idx < scan.count; idx++) {
+        mbio_scan_point_t *point = &scan.points[idx];
+        uint_fast16_t offset = point->register_address - request->register_address;
+
+        if (point->device_address != request->device_address || point->function != request->function ||
+             point->register_address < request->register_address || offset >= request->value) {
+            continue;
+        }
+
+        if (bits && (offset >> 3) < bytes) {
+            mbio_image_update(point->device_address, point->function, point->register_address, (msg->adu[3 + (offset >> 3)] >> (offset & 0x07)) & 0x01, false);
+        }
+        else if (!bits && offset * 2 + 1 < bytes) {
+            mbio_image_update(point->device_address, point->function, point->register_address, modbus_read_u16(&msg->adu[3 + offset * 2]), false);
+        }
+    }
+
+    mbio_scan_next();
+}
+
+static void mbio_scan_error(void) {
+    scan.errors++;
+    mbio_scan_next();
+}
+
+// Removes a feature from the points it uses, the points no other feature uses leave the scan list.
+static void mbio_scan_remove(mbio_scan_user_t user) {
+    uint_fast8_t count = 0;
+
+    for (uint_fast8_t idx = 0; idx < scan.count; idx++) {
+        if ((scan.points[idx].users &= ~user)) {
+            scan.points[count++] = scan.points[idx];
+        }
+    }
+
+    if (count != scan.count) {
+        scan.count = count;
+        mbio_scan_plan();
+    }
+}
+
+// Deferred writes keep only the latest value of a point, it is written no later than period ms after it changed first.
+static bool mbio_write_behind(char device_address, uint8_t function, uint16_t register_address, uint16_t value, uint32_t period) {
+    mbio_deferred_t *point = NULL;
+
+    for (uint_fast8_t idx = 0; idx < MBIO_WRITE_BEHIND_POINTS; idx++) {
+        mbio_deferred_t *slot = &write_behind.points[idx];
+
+        if (slot->used && slot->device_address == device_address && slot->function == function && slot->register_address == register_address) {
+            point = slot;
+            break;
+        }
+
+        if (point == NULL && !slot->dirty && !(write_behind.busy && write_behind.sending == idx)) {
+            point = slot;
+        }
+    }
+
+    if (point == NULL) {
+        return false; // all points are waiting to be written
+    }
+
+    if (!point->used || point->device_address != device_address || point->function != function || point->register_address != register_address) {
+        point->used = true;
+        point->device_address = device_address;
+        point->function = function;
+        point->register_address = register_address;
+        point->dirty = false;
+    }
+
+    if (point->dirty) {
+        write_behind.coalesced++;
+        if ((int32_t)(hal.get_elapsed_ticks() + period - point->deadline) < 0) {
+            point->deadline = hal.get_elapsed_ticks() + period;
+        }
+    }
+    else {
+        point->dirty = true;
+        point->deadline = hal.get_elapsed_ticks() + period;
+    }
+
+    point->value = value;
+    point->period = period;
+
+    return true;
+}
+
+// A direct write supersedes a deferred one of the same point, it must not be overwritten by the older value later.
+// A deferred write already on the bus is sent before the direct one, it is just not retried on failure.
+static void mbio_write_behind_drop(char device_address, uint8_t function, uint16_t register_address) {
+    for (uint_fast8_t idx = 0; idx < MBIO_WRITE_BEHIND_POINTS; idx++) {
+        mbio_deferred_t *slot = &write_behind.points[idx];
+
+        if (slot->used && slot->device_address == device_address && slot->function == function && slot->register_address == register_address) {
+            slot->used = slot->dirty = false;
+            break;
+        }
+    }
+}
+
+static void mbio_write_behind_request(void) {
+    modbus_message_t _cmd;
+    mbio_deferred_t *point = NULL;
+    uint32_t now = hal.get_elapsed_ticks();
+
+    for (uint_fast8_t idx = 0; idx < MBIO_WRITE_BEHIND_POINTS; idx++) {
+        mbio_deferred_t *slot = &write_behind.points[idx];
+
+        if (slot->dirty && (int32_t)(now - slot->deadline) >= 0 && (point == NULL || (int32_t)(slot->deadline - point->deadline) < 0)) {
+            point = slot;
+            write_behind.sending = idx;
+        }
+    }
+
+    if (point) {
+        point->dirty = false; // a new value while the write is on the bus is written after the next period
+        write_behind.busy = true;
+        write_behind.written++;
+
+        mbio_encode_request(&_cmd, MBIO_WriteBehind, point->device_address, point->function, point->register_address, point->value, 8);
+        mbio_modbus_send_command(_cmd, false);
+    }
+}
+
+// A failed write is retried after its period, unless there is a newer value waiting already.
+static void mbio_write_behind_error(void) {
+    mbio_deferred_t *point = &write_behind.points[write_behind.sending];
+
+    write_behind.busy = false;
+    write_behind.errors++;
+
+    if (point->used && !point->dirty) {
+        point->dirty = true;
+        point->deadline = hal.get_elapsed_ticks() + (point->period > MBIO_WRITE_RETRY ? point->period : MBIO_WRITE_RETRY);
+    }
+}
+
+static void mbio_sampler_rx(modbus_message_t *msg) {
+    uint_fast16_t next = (samples.head + 1) & (MBIO_SAMPLE_BUFFER - 1);
+    uint32_t rx_time = hal.get_elapsed_ticks();
+
+    sampler.busy = false;
+
+    if (next == samples.tail) {
+        sampler.seq++;
+        sampler.dropped++;
+        return;
+    }
+
+    // Tag the sample with the position halfway between request and response,
+    // the slave samples its input somewhere in between.
+    mbio_sample_t *sample = &samples.data[samples.head];
+    sample->seq = sampler.seq++;
+    sample->timestamp = sampler.tx_time + (rx_time - sampler.tx_time) / 2;
+    sample->value = modbus_read_u16(&msg->adu[3]);
+    for (uint_fast8_t idx = 0; idx < N_AXIS; idx++) {
+        sample->position[idx] = sampler.tx_position[idx] + (sys.position[idx] - sampler.tx_position[idx]) / 2;
+    }
+
+    samples.head = next;
+
+#ifdef MBIO_DEBUG
+    char buf[40];
+    sprintf(buf, "MODBUS SAMPLE: %lu %u", (unsigned long)sample->timestamp, sample->value);
+    report_message(buf, Message_Plain);
+#endif
+}
+
+static void mbio_sampler_start(char device_address, uint8_t function, uint16_t register_address, float interval, float distance) {
+    sampler.active = false;
+    samples.head = samples.tail = 0;
+
+    sampler.device_address = device_address;
+    sampler.function = function;
+    sampler.register_address = register_address;
+    sampler.interval = (uint32_t)ceilf(interval * 1000.0f);
+    sampler.distance = distance;
+    sampler.seq = sampler.errors = sampler.dropped = 0;
+    sampler.next = hal.get_elapsed_ticks();
+    system_convert_array_steps_to_mpos(sampler.last_position, sys.position);
+
+    stream.open = false;
+    sampler.active = true;
+}
+
+static void mbio_sampler_stop(void) {
+    sampler.active = false;
+}
+
+static void mbio_adapt_start(char device_address, uint8_t function, uint16_t register_address, float target, float period) {
+    adapt.device_address = device_address;
+    adapt.function = function;
+    adapt.register_address = register_address;
+    adapt.target = target;
+    adapt.period = (uint32_t)ceilf(period * 1000.0f);
+    adapt.next = hal.get_elapsed_ticks();
+    adapt.filtered = false;
+    adapt.override = (float)sys.override.feed_rate;
+    adapt.active = true;
+}
+
+static void mbio_adapt_stop(void) {
+    if (adapt.active) {
+        adapt.active = false;
+        plan_feed_override(DEFAULT_FEED_OVERRIDE, sys.override.rapid_rate);
+    }
+}
+
+static void mbio_adapt_request(void) {
+    modbus_message_t _cmd;
+
+    // a fixed rate, the bus not keeping up delays the next read instead of bunching them
+    adapt.next += adapt.period;
+    if ((int32_t)(hal.get_elapsed_ticks() - adapt.next) >= 0) {
+        adapt.next = hal.get_elapsed_ticks() + adapt.period;
+    }
+    adapt.busy = true;
+
+    mbio_encode_request(&_cmd, MBIO_Adapt, adapt.device_address, adapt.function, adapt.register_address, 1, 7);
+    mbio_modbus_send_command(_cmd, false);
+}
+
+// The load is low pass filtered, the override changes by MBIO_ADAPT_GAIN times the relative load error
+// each read. Below MBIO_ADAPT_IDLE of the target the tool is not cutting, the programmed feed is used then
+// so the next cut is not entered at the max override.
+static void mbio_adapt_rx(modbus_message_t *msg) {
+    float load = (float)modbus_read_u16(&msg->adu[3]), override;
+
+    adapt.busy = false;
+    adapt.load = adapt.filtered ? adapt.load + (load - adapt.load) * MBIO_ADAPT_FILTER : load;
+    adapt.filtered = true;
+
+    if (!adapt.active || !(state_get() & STATE_CYCLE)) {
+        return;
+    }
+
+    if (adapt.load < adapt.target * MBIO_ADAPT_IDLE) {
+        override = (float)DEFAULT_FEED_OVERRIDE;
+    }
+    else {
+        override = adapt.override + adapt.override * MBIO_ADAPT_GAIN * (adapt.target - adapt.load) / adapt.target;
+    }
+
+    adapt.override = override < (float)MBIO_ADAPT_MIN ? (float)MBIO_ADAPT_MIN : (override > (float)MBIO_ADAPT_MAX ? (float)MBIO_ADAPT_MAX : override);
+
+    // set from the realtime loop, not from the MODBUS callback
+    adapt.apply = (uint_fast8_t)lroundf(adapt.override);
+}
+
+static void mbio_adapt_apply(void) {
+    if (adapt.active && (state_get() & STATE_CYCLE) && adapt.apply != sys.override.feed_rate) {
+        plan_feed_override(adapt.apply, sys.override.rapid_rate);
+    }
+    adapt.apply = 0;
+}
+
+static void mbio_thermal_start(char device_address, uint8_t function, uint16_t register_address, float coefficient, float reference) {
+    thermal.device_address = device_address;
+    thermal.function = function;
+    thermal.register_address = register_address;
+    thermal.coefficient = coefficient;
+    thermal.reference = reference;
+    thermal.next = hal.get_elapsed_ticks();
+    thermal.active = true;
+}
+
+// Moves the tool length offset of Z in the parser state by the change of the compensation. It is called from
+// the realtime loop, also while the parser waits for room in the planner during a job, so every block parsed
+// after that has it; moves already planned keep their offset. The offset mode is not touched, a G43 H offset
+// stays one. When the offset was set by G43/G43.1/G49 or a reset meanwhile, that is the new base the
+// compensation is added to, except after G49: the program cancelled the offset, it is added again after the
+// next G43/G43.1.
+static void mbio_thermal_apply(sys_state_t state) {
+    float offset = gc_state.tool_length_offset[Z_AXIS];
+
+    if (fabsf(offset - thermal.expected) > MBIO_THERMAL_STEP / 2.0f || (gc_state.modal.tool_offset_mode == ToolLengthOffset_Cancel && thermal.mode != ToolLengthOffset_Cancel)) {
+        thermal.offset = 0.0f;
+        thermal.expected = offset;
+        thermal.cancelled = gc_state.modal.tool_offset_mode == ToolLengthOffset_Cancel && !thermal.reset;
+        thermal.reset = false;
+    }
+    else if (state & STATE_CYCLE) {
+        thermal.reset = false; // the parser was initialized after the reset
+    }
+
+    thermal.mode = gc_state.modal.tool_offset_mode;
+
+    if (thermal.cancelled) {
+        return;
+    }
+
+    if (fabsf(thermal.target - thermal.offset) < MBIO_THERMAL_STEP && !(thermal.target == 0.0f && thermal.offset != 0.0f)) {
+        return;
+    }
+
+    offset += thermal.target - thermal.offset;
+    gc_state.tool_length_offset[Z_AXIS] = offset;
+    system_flag_wco_change();
+
+    thermal.offset = thermal.target;
+    thermal.expected = offset;
+}
+
+static void mbio_thermal_stop(void) {
+    if (thermal.active) {
+        thermal.active = false;
+        thermal.target = 0.0f; // removed from the offset on the next poll
+    }
+}
+
+static void mbio_thermal_request(void) {
+    modbus_message_t _cmd;
+
+    thermal.next = hal.get_elapsed_ticks() + MBIO_THERMAL_PERIOD;
+    thermal.busy = true;
+
+    mbio_encode_request(&_cmd, MBIO_Thermal, thermal.device_address, thermal.function, thermal.register_address, 1, 7);
+    mbio_modbus_send_command(_cmd, false);
+}
+
+// Linear growth model, clamped to +-MBIO_THERMAL_MAX so a broken sensor cannot crash the tool.
+static void mbio_thermal_rx(modbus_message_t *msg) {
+    float offset = ((float)modbus_read_u16(&msg->adu[3]) - thermal.reference) * thermal.coefficient;
+
+    thermal.busy = false;
+
+    if (thermal.active) {
+        thermal.target = offset > MBIO_THERMAL_MAX ? MBIO_THERMAL_MAX : (offset < -MBIO_THERMAL_MAX ? -MBIO_THERMAL_MAX : offset);
+    }
+}
+
+#if MBIO_COOLANT_ENABLE
+
+// Coolant changes go to the write-behind queue with no delay, they do not wait for the bus.
+static void mbio_coolant_write(coolant_state_t mode, bool all) {
+    bool queued = true;
+
+    if (all || mode.flood != coolant.commanded.flood) {
+        queued &= mbio_write_behind(MBIO_COOLANT_DEVICE, ModBus_WriteCoil, MBIO_COOLANT_FLOOD - 1, mode.flood ? 0xFF00 : 0, 0);
+    }
+
+#if MBIO_COOLANT_MIST
+    if (all || mode.mist != coolant.commanded.mist) {
+        queued &= mbio_write_behind(MBIO_COOLANT_DEVICE, ModBus_WriteCoil, MBIO_COOLANT_MIST - 1, mode.mist ? 0xFF00 : 0, 0);
+    }
+#endif
+
+    coolant.commanded = mode;
+
+    if (!queued) {
+        protocol_enqueue_foreground_task(report_warning, "MODBUS I/O: coolant write not queued!");
+    }
+}
+
+static void mbio_coolant_set_state(coolant_state_t mode) {
+    if (coolant.set_state) {
+        coolant.set_state(mode);
+    }
+
+    mbio_coolant_write(mode, false);
+}
+
+// The coils are in the scan list and written through, the state comes from the I/O image without a transfer.
+static coolant_state_t mbio_coolant_get_state(void) {
+    coolant_state_t state = coolant.get_state ? coolant.get_state() : (coolant_state_t){0};
+    mbio_point_t *point;
+
+    if ((point = mbio_image_find(MBIO_COOLANT_DEVICE, ModBus_ReadCoils, MBIO_COOLANT_FLOOD - 1)) && point->value) {
+        state.flood = On;
+    }
+
+#if MBIO_COOLANT_MIST
+    if ((point = mbio_image_find(MBIO_COOLANT_DEVICE, ModBus_ReadCoils, MBIO_COOLANT_MIST - 1)) && point->value) {
+        state.mist = On;
+    }
+#endif
+
+    return state;
+}
+
+static void mbio_coolant_init(void) {
+    coolant.set_state = hal.coolant.set_state;
+    coolant.get_state = hal.coolant.get_state;
+    hal.coolant.set_state = mbio_coolant_set_state;
+    hal.coolant.get_state = mbio_coolant_get_state;
+
+    hal.coolant_cap.flood = On;
+    mbio_scan_add(MBIO_COOLANT_DEVICE, ModBus_ReadCoils, MBIO_COOLANT_FLOOD - 1, MBIO_ScanCoolant);
+#if MBIO_COOLANT_MIST
+    hal.coolant_cap.mist = On;
+    mbio_scan_add(MBIO_COOLANT_DEVICE, ModBus_ReadCoils, MBIO_COOLANT_MIST - 1, MBIO_ScanCoolant);
+#endif
+    mbio_scan_plan();
+
+    mbio_coolant_write((coolant_state_t){0}, true); // the coils are in an unknown state after power up
+}
+
+#endif
+
+static bool mbio_sampler_due(void) {
+    if (sampler.interval) {
+        uint32_t now = hal.get_elapsed_ticks();
+
+        if ((int32_t)(now - sampler.next) < 0) {
+            return false;
+        }
+
+        // Do not try to catch up when the bus could not keep up with the requested rate.
+        sampler.next += sampler.interval;
+        if ((int32_t)(now - sampler.next) >= 0) {
+            sampler.next = now + sampler.interval;
+        }
+
+        return true;
+    }
+
+    float position[N_AXIS], distance = 0.0f;
+
+    system_convert_array_steps_to_mpos(position, sys.position);
+    for (uint_fast8_t idx = 0; idx < N_AXIS; idx++) {
+        distance += (position[idx] - sampler.last_position[idx]) * (position[idx] - sampler.last_position[idx]);
+    }
+
+    if (distance < sampler.distance * sampler.distance) {
+        return false;
+    }
+
+    memcpy(sampler.last_position, position, sizeof(position));
+
+    return true;
+}
+
+static char *mbio_append(char *s, const char *value) {
+    while ((*s = *value++)) {
+        s++;
+    }
+
+    return s;
+}
+
+static char *mbio_append_int(char *s, int32_t value) {
+    if (value < 0) {
+        *s++ = '-';
+    }
+
+    return mbio_append(s, uitoa(value < 0 ? -(uint32_t)value : (uint32_t)value));
+}
+
+// Samples are streamed as push messages the senders already ignore, a binary format would corrupt their protocol.
+// A keyframe carries absolute values:  [MBK:<seq>,<dropped>,<errors>,<ms>,<value>,<steps axis 0>,..]
+// followed by lines of deltas to the previous sample: [MBD:<seq>|<ms>,<value>,<steps axis 0>,..|..]
+// A gap in the sequence numbers always starts a new keyframe. [MBE:<seq>,<dropped>,<errors>] ends the stream.
+static void mbio_stream_samples(void) {
+    if (samples.tail == samples.head) {
+        if (stream.open && !sampler.active) {
+            char *s = stream.line;
+            s = mbio_append(mbio_append(s, "[MBE:"), uitoa(sampler.seq));
+            s = mbio_append(mbio_append(s, ","), uitoa(sampler.dropped));
+            s = mbio_append(mbio_append(s, ","), uitoa(sampler.errors));
+            mbio_append(s, "]" ASCII_EOL);
+            hal.stream.write(stream.line);
+            stream.open = false;
+        }
+        return;
+    }
+
+    if (hal.stream.get_tx_buffer_count && hal.stream.get_tx_buffer_count() > MBIO_STREAM_TX_LIMIT) {
+        stream.throttled++;
+        return;
+    }
+
+    char *s = stream.line;
+    mbio_sample_t *sample = &samples.data[samples.tail];
+
+    if (!stream.open || stream.lines >= MBIO_STREAM_KEYFRAME || sample->seq != stream.last.seq + 1) {
+        s = mbio_append(mbio_append(s, "[MBK:"), uitoa(sample->seq));
+        s = mbio_append(mbio_append(s, ","), uitoa(sampler.dropped));
+        s = mbio_append(mbio_append(s, ","), uitoa(sampler.errors));
+        s = mbio_append(mbio_append(s, ","), uitoa(sample->timestamp));
+        s = mbio_append(mbio_append(s, ","), uitoa(sample->value));
+        for (uint_fast8_t idx = 0; idx < N_AXIS; idx++) {
+            s = mbio_append_int(mbio_append(s, ","), sample->position[idx]);
+        }
+
+        stream.last = *sample;
+        stream.lines = 0;
+        stream.open = true;
+        samples.tail = (samples.tail + 1) & (MBIO_SAMPLE_BUFFER - 1);
+    }
+    else {
+        uint_fast8_t count = 0;
+        s = mbio_append(mbio_append(s, "[MBD:"), uitoa(sample->seq));
+
+        // each sample needs at most 12 characters per field, leave room for the terminator
+        while (samples.tail != samples.head && count++ < MBIO_STREAM_BATCH
+                && (size_t)(s - stream.line) + 12 * (N_AXIS + 2) + 4 < sizeof(stream.line)) {
+
+            sample = &samples.data[samples.tail];
+            if (sample->seq != stream.last.seq + 1) {
+                break;
+            }
+
+            s = mbio_append_int(mbio_append(s, "|"), (int32_t)(sample->timestamp - stream.last.timestamp));
+            s = mbio_append_int(mbio_append(s, ","), (int32_t)sample->value - (int32_t)stream.last.value);
+            for (uint_fast8_t idx = 0; idx < N_AXIS; idx++) {
+                s = mbio_append_int(mbio_append(s, ","), sample->position[idx] - stream.last.position[idx]);
+            }
+
+            stream.last = *sample;
+            samples.tail = (samples.tail + 1) & (MBIO_SAMPLE_BUFFER - 1);
+        }
+
+        stream.lines++;
+    }
+
+    mbio_append(s, "]" ASCII_EOL);
+    hal.stream.write(stream.line);
+}
+
+// Rules are compiled to a table of bytecode, each rule is:
+//   Rule_Begin <length>                                         - length of the rule in bytes, header included
+//   <condition> <device> <function> <address u16> <value u16>   - one or more, all have to be met
+//   Rule_Write <device> <function> <address u16> <value u16>    - or a single byte core event
+// Addresses and values are big endian like on the bus. The table ends with Rule_End.
+#define MBIO_RULE_OPERANDS 6
+#define MBIO_RULE_LENGTH (2 + 5 * (1 + MBIO_RULE_OPERANDS)) // up to 4 conditions and a write
+
+static inline uint16_t mbio_rule_u16(const uint8_t *code) {
+    return (code[0] << 8) | code[1];
+}
+
+static void mbio_rule_action(const uint8_t *pc) {
+    switch (*pc) {
+        case Rule_Write:
+            // no blocking from here, the write goes to the head of the write-behind queue
+            if (!mbio_write_behind(pc[1], pc[2], mbio_rule_u16(&pc[3]), mbio_rule_u16(&pc[5]), 0)) {
+                rules.errors++;
+            }
+            break;
+
+        case Rule_Hold:
+            system_set_exec_state_flag(EXEC_FEED_HOLD);
+            break;
+
+        case Rule_Start:
+            system_set_exec_state_flag(EXEC_CYCLE_START);
+            break;
+
+        case Rule_Alarm:
+            system_raise_alarm(Alarm_AbortCycle);
+            break;
+    }
+}
+
+// Called on every change of the I/O image. A rule fires when its conditions become met, a rule with an edge
+// when the point changes that way and the other conditions are met. Evaluation stops at the first condition not met.
+static void mbio_rules_eval(mbio_point_t *point, uint16_t previous, bool known) {
+    const uint8_t *pc = rules.code;
+
+#if MBIO_BENCH
+    if (bench_dry_run) {
+        return;
+    }
+#endif
+
+    MBIO_PROBE_START(probe);
+
+    for (uint_fast8_t rule = 0; *pc == Rule_Begin; rule++) {
+        const uint8_t *next = pc + pc[1];
+        bool met = true, edge = false;
+
+        for (pc += 2; met && *pc >= Rule_Equal && *pc <= Rule_Fall; pc += 1 + MBIO_RULE_OPERANDS) {
+            uint16_t register_address = mbio_rule_u16(&pc[3]), value = mbio_rule_u16(&pc[5]);
+            bool self = (char)pc[1] == point->device_address && pc[2] == point->function && register_address == point->register_address;
+            mbio_point_t *operand = self ? point : mbio_image_find((char)pc[1], pc[2], register_address);
+
+            if (operand == NULL) {
+                met = false;
+                continue;
+            }
+
+            switch (*pc) {
+                case Rule_Equal:
+                    met = operand->value == value;
+                    break;
+
+                case Rule_NotEqual:
+                    met = operand->value != value;
+                    break;
+
+                case Rule_Below:
+                    met = operand->value < value;
+                    break;
+
+                case Rule_Above:
+                    met = operand->value > value;
+                    break;
+
+                case Rule_Rise:
+                    edge = true;
+                    met = self && known && !previous && operand->value;
+                    break;
+
+                case Rule_Fall:
+                    edge = true;
+                    met = self && known && previous && !operand->value;
+                    break;
+            }
+        }
+
+        if (met && (edge || !rules.active[rule])) {
+            rules.fired[rule]++;
+            mbio_rule_action(pc);
+        }
+
+        rules.active[rule] = met && !edge;
+        pc = next;
+    }
+
+    MBIO_PROBE_END(MBIO_ProbeRules, probe);
+}
+
+static const char *mbio_rule_number(const char *s, uint32_t *value) {
+    const char *start = s;
+
+    *value = 0;
+    while (*s >= '0' && *s <= '9' && *value <= 65535) {
+        *value = *value * 10 + (*s++ - '0');
+    }
+
+    return s == start || *value > 65535 ? NULL : s;
+}
+
+// D<device>E<function>P<address>, the address is 1 based like the P word.
+static const char *mbio_rule_point(const char *s, uint8_t *code, bool write) {
+    uint32_t device, function, address;
+
+    if (*s != 'D' || (s = mbio_rule_number(s + 1, &device)) == NULL || device > 247 ||
+         *s != 'E' || (s = mbio_rule_number(s + 1, &function)) == NULL ||
+          *s != 'P' || (s = mbio_rule_number(s + 1, &address)) == NULL || address < 1 || address > 9999) {
+        return NULL;
+    }
+
+    if (write ? (function != ModBus_WriteCoil && function != ModBus_WriteRegister) : (function < ModBus_ReadCoils || function > ModBus_ReadInputRegisters)) {
+        return NULL;
+    }
+
+    code[0] = (uint8_t)device;
+    code[1] = (uint8_t)function;
+    code[2] = MODBUS_SET_MSB16(address - 1);
+    code[3] = MODBUS_SET_LSB16(address - 1);
+
+    return s;
+}
+
+// <condition>[&<condition>..]:<action> where a condition is D<n>E<1..4>P<n> followed by =<value>, !=<value>,
+// <<value>, ><value>, R (rising edge) or F (falling edge) and the action is D<n>E<5,6>P<n>Q<value>, HOLD, START or ALARM.
+// The condition points are added to the scan list.
+static status_code_t mbio_rule_compile(const char *source) {
+    static const struct {
+        const char *name;
+        mbio_rule_op_t op;
+    } events[] = { { "HOLD", Rule_Hold }, { "START", Rule_Start }, { "ALARM", Rule_Alarm } };
+
+    char text[80], *d = text;
+    const char *s;
+    uint8_t code[MBIO_RULE_LENGTH], *pc = &code[2];
+    uint32_t value;
+
+    // spaces are allowed anywhere
+    for (s = source; *s && d < &text[sizeof(text) - 1]; s++) {
+        if (*s != ' ') {
+            *d++ = *s;
+        }
+    }
+    *d = '\0';
+
+    if (*s) {
+        return Status_InvalidStatement; // too long
+    }
+    s = text;
+
+    do {
+        if (pc + 1 + MBIO_RULE_OPERANDS > &code[sizeof(code)] || (s = mbio_rule_point(s, pc + 1, false)) == NULL) {
+            return Status_InvalidStatement;
+        }
+
+        value = 0;
+        switch (*s++) {
+            case '=':
+                *pc = Rule_Equal;
+                s = mbio_rule_number(s, &value);
+                break;
+
+            case '!':
+                *pc = Rule_NotEqual;
+                s = *s == '=' ? mbio_rule_number(s + 1, &value) : NULL;
+                break;
+
+            case '<':
+                *pc = Rule_Below;
+                s = mbio_rule_number(s, &value);
+                break;
+
+            case '>':
+                *pc = Rule_Above;
+                s = mbio_rule_number(s, &value);
+                break;
+
+            case 'R':
+                *pc = Rule_Rise;
+                break;
+
+            case 'F':
+                *pc = Rule_Fall;
+                break;
+
+            default:
+                s = NULL;
+                break;
+        }
+
+        if (s == NULL) {
+            return Status_InvalidStatement;
+        }
+
+        pc[5] = MODBUS_SET_MSB16(value);
+        pc[6] = MODBUS_SET_LSB16(value);
+        pc += 1 + MBIO_RULE_OPERANDS;
+    } while (*s++ == '&');
+
+    if (s[-1] != ':') {
+        return Status_InvalidStatement;
+    }
+
+    if (*s == 'D') {
+        if (pc + 1 + MBIO_RULE_OPERANDS > &code[sizeof(code)] || (s = mbio_rule_point(s, pc + 1, true)) == NULL ||
+             *s != 'Q' || (s = mbio_rule_number(s + 1, &value)) == NULL || *s) {
+            return Status_InvalidStatement;
+        }
+
+        if (pc[2] == ModBus_WriteCoil) {
+            value = value ? 0xFF00 : 0;
+        }
+
+        *pc = Rule_Write;
+        pc[5] = MODBUS_SET_MSB16(value);
+        pc[6] = MODBUS_SET_LSB16(value);
+        pc += 1 + MBIO_RULE_OPERANDS;
+    }
+    else {
+        uint_fast8_t idx = sizeof(events) / sizeof(events[0]);
+
+        while (idx && strcmp(s, events[idx - 1].name)) {
+            idx--;
+        }
+
+        if (idx == 0 || pc + 1 > &code[sizeof(code)]) {
+            return Status_InvalidStatement;
+        }
+
+        *pc++ = events[idx - 1].op;
+    }
+
+    code[0] = Rule_Begin;
+    code[1] = (uint8_t)(pc - code);
+
+    // keep room for Rule_End
+    if (rules.count == MBIO_RULE_COUNT || rules.length + code[1] >= sizeof(rules.code)) {
+        return Status_InvalidStatement;
+    }
+
+    // the condition points are read by the scan list, there has to be room for them
+    uint_fast8_t missing = 0;
+    bool found;
+
+    for (pc = &code[2]; *pc >= Rule_Equal && *pc <= Rule_Fall; pc += 1 + MBIO_RULE_OPERANDS) {
+        mbio_scan_find(pc[1], pc[2], mbio_rule_u16(&pc[3]), &found);
+        missing += !found;
+    }
+
+    if (scan.count + missing > MBIO_SCAN_POINTS) {
+        return Status_GcodeValueOutOfRange;
+    }
+
+    for (pc = &code[2]; *pc >= Rule_Equal && *pc <= Rule_Fall; pc += 1 + MBIO_RULE_OPERANDS) {
+        mbio_scan_add(pc[1], pc[2], mbio_rule_u16(&pc[3]), MBIO_ScanRule);
+    }
+    mbio_scan_plan();
+
+    memcpy(&rules.code[rules.length], code, code[1]);
+    rules.length += code[1];
+    rules.code[rules.length] = Rule_End;
+    rules.active[rules.count] = false;
+    rules.fired[rules.count++] = 0;
+
+    return Status_OK;
+}
+
+static char *mbio_rule_point_text(char *s, const uint8_t *pc) {
+    s = mbio_append(mbio_append(s, "D"), uitoa(pc[1]));
+    s = mbio_append(mbio_append(s, "E"), uitoa(pc[2]));
+
+    return mbio_append(mbio_append(s, "P"), uitoa(mbio_rule_u16(&pc[3]) + 1));
+}
+
+// Turns a compiled rule back into its source.
+static void mbio_rule_text(char *s, const uint8_t *pc) {
+    static const char *const compare[] = { "=", "!=", "<", ">", "R", "F" };
+
+    for (pc += 2; *pc >= Rule_Equal && *pc <= Rule_Fall; pc += 1 + MBIO_RULE_OPERANDS) {
+        s = mbio_append(mbio_rule_point_text(s, pc), compare[*pc - Rule_Equal]);
+        if (*pc < Rule_Rise) {
+            s = mbio_append(s, uitoa(mbio_rule_u16(&pc[5])));
+        }
+        *s++ = pc[1 + MBIO_RULE_OPERANDS] >= Rule_Equal && pc[1 + MBIO_RULE_OPERANDS] <= Rule_Fall ? '&' : ':';
+    }
+
+    switch (*pc) {
+        case Rule_Write:
+            s = mbio_append(mbio_rule_point_text(s, pc), "Q");
+            mbio_append(s, uitoa(pc[2] == ModBus_WriteCoil ? !!mbio_rule_u16(&pc[5]) : mbio_rule_u16(&pc[5])));
+            break;
+
+        case Rule_Hold:
+            mbio_append(s, "HOLD");
+            break;
+
+        case Rule_Start:
+            mbio_append(s, "START");
+            break;
+
+        default:
+            mbio_append(s, "ALARM");
+            break;
+    }
+}
+
+// $MBIORULE=<rule> - add a rule, $MBIORULE=CLEAR - remove all and their scan points, $MBIORULE - list them as [MBIORULE:<n>,<fired>,<rule>].
+static status_code_t mbio_cmd_rule(sys_state_t state, char *args) {
+    if (args) {
+        if (!strcmp(args, "CLEAR")) {
+            rules.count = rules.length = 0;
+            rules.code[0] = Rule_End;
+            rules.errors = 0;
+            mbio_scan_remove(MBIO_ScanRule);
+
+            return Status_OK;
+        }
+
+        return mbio_rule_compile(args);
+    }
+
+    const uint8_t *pc = rules.code;
+
+    for (uint_fast8_t rule = 0; *pc == Rule_Begin; rule++, pc += pc[1]) {
+        char line[100], *s = line;
+
+        s = mbio_append(s, uitoa(rule + 1));
+        s = mbio_append(mbio_append(s, ","), uitoa(rules.fired[rule]));
+        mbio_rule_text(mbio_append(s, ","), pc);
+
+        hal.stream.write("[MBIORULE:");
+        hal.stream.write(line);
+        hal.stream.write("]" ASCII_EOL);
+    }
+
+    hal.stream.write("[MBIORULEEND:");
+    hal.stream.write(uitoa(rules.count));
+    hal.stream.write(",");
+    hal.stream.write(uitoa(rules.length));
+    hal.stream.write(",");
+    hal.stream.write(uitoa(rules.errors));
+    hal.stream.write("]" ASCII_EOL);
+
+    return Status_OK;
+}
+
+// Checked on every read of a point, not only on changes, so a job resumed while the value is still
+// out of range is held again. The value has to be hysteresis inside the limits to end the fault.
+static void mbio_limits_check(mbio_point_t *point) {
+#if MBIO_BENCH
+    if (bench_dry_run) {
+        return;
+    }
+#endif
+
+    for (uint_fast8_t idx = 0; idx < limits.count; idx++) {
+        mbio_limit_t *limit = &limits.limits[idx];
+
+        if (limit->device_address != point->device_address || limit->function != point->function || limit->register_address != point->register_address) {
+            continue;
+        }
+
+        if (!limit->tripped) {
+            if (point->value < limit->low || point->value > limit->high) {
+                limit->tripped = true;
+                limit->trips++;
+                mbio_rule_action(&limit->action);
+                protocol_enqueue_foreground_task(report_warning, "MODBUS I/O: limit exceeded!");
+            }
+        }
+        else if ((uint32_t)point->value >= (uint32_t)limit->low + limit->hysteresis && (uint32_t)point->value + limit->hysteresis <= limit->high) {
+            limit->tripped = false;
+        }
+        else if (limit->action == Rule_Hold && (state_get() & STATE_CYCLE)) {
+            mbio_rule_action(&limit->action);
+        }
+    }
+}
+
+// D<device>E<1..4>P<address>[L<low>][H<high>][Y<hysteresis>]:HOLD|ALARM, the point is added to the scan list.
+static status_code_t mbio_limit_compile(const char *source) {
+    char text[48], *d = text;
+    const char *s;
+    uint8_t point[4];
+    uint32_t value;
+    mbio_limit_t limit = {0};
+
+    for (s = source; *s && d < &text[sizeof(text) - 1]; s++) {
+        if (*s != ' ') {
+            *d++ = *s;
+        }
+    }
+    *d = '\0';
+
+    if (*s || (s = mbio_rule_point(text, point, false)) == NULL) {
+        return Status_InvalidStatement;
+    }
+
+    limit.device_address = (char)point[0];
+    limit.function = point[1];
+    limit.register_address = mbio_rule_u16(&point[2]);
+    limit.high = 65535;
+
+    while (*s == 'L' || *s == 'H' || *s == 'Y') {
+        char word = *s;
+
+        if ((s = mbio_rule_number(s + 1, &value)) == NULL) {
+            return Status_InvalidStatement;
+        }
+
+        if (word == 'L') {
+            limit.low = (uint16_t)value;
+        }
+        else if (word == 'H') {
+            limit.high = (uint16_t)value;
+        }
+        else {
+            limit.hysteresis = (uint16_t)value;
+        }
+    }
+
+    if (!strcmp(s, ":HOLD")) {
+        limit.action = Rule_Hold;
+    }
+    else if (!strcmp(s, ":ALARM")) {
+        limit.action = Rule_Alarm;
+    }
+    else {
+        return Status_InvalidStatement;
+    }
+
+    if (limit.low > limit.high || (uint32_t)limit.low + 2 * limit.hysteresis > limit.high || limits.count == MBIO_LIMIT_COUNT) {
+        return Status_GcodeValueOutOfRange;
+    }
+
+    if (!mbio_scan_add(limit.device_address, limit.function, limit.register_address, MBIO_ScanLimit)) {
+        return Status_GcodeValueOutOfRange;
+    }
+    mbio_scan_plan();
+
+    limits.limits[limits.count++] = limit;
+
+    return Status_OK;
+}
+
+// $MBIOLIMIT=<limit> - add a limit, $MBIOLIMIT=CLEAR - remove all and their scan points,
+// $MBIOLIMIT - list them as [MBIOLIMIT:<device>,<function>,<address>,<low>,<high>,<hysteresis>,<action>,<tripped>,<trips>].
+static status_code_t mbio_cmd_limit(sys_state_t state, char *args) {
+    if (args) {
+        if (!strcmp(args, "CLEAR")) {
+            limits.count = 0;
+            mbio_scan_remove(MBIO_ScanLimit);
+
+            return Status_OK;
+        }
+
+        return mbio_limit_compile(args);
+    }
+
+    for (uint_fast8_t idx = 0; idx < limits.count; idx++) {
+        mbio_limit_t *limit = &limits.limits[idx];
+        char line[80], *s = line;
+
+        s = mbio_append(s, uitoa((uint8_t)limit->device_address));
+        s = mbio_append(mbio_append(s, ","), uitoa(limit->function));
+        s = mbio_append(mbio_append(s, ","), uitoa(limit->register_address + 1));
+        s = mbio_append(mbio_append(s, ","), uitoa(limit->low));
+        s = mbio_append(mbio_append(s, ","), uitoa(limit->high));
+        s = mbio_append(mbio_append(s, ","), uitoa(limit->hysteresis));
+        s = mbio_append(s, limit->action == Rule_Hold ? ",HOLD," : ",ALARM,");
+        s = mbio_append(s, uitoa(limit->tripped));
+        mbio_append(mbio_append(s, ","), uitoa(limit->trips));
+
+        hal.stream.write("[MBIOLIMIT:");
+        hal.stream.write(line);
+        hal.stream.write("]" ASCII_EOL);
+    }
+
+    return Status_OK;
+}
+
+static void mbio_poll(sys_state_t state) {
+    MBIO_ENTRY_START(probe);
+
+    if (sampler.active && !sampler.busy && mbio_sampler_due()) {
+        mbio_sampler_request();
+    }
+
+    if (adapt.apply) {
+        mbio_adapt_apply();
+    }
+
+    if (adapt.active && !adapt.busy && (int32_t)(hal.get_elapsed_ticks() - adapt.next) >= 0) {
+        mbio_adapt_request();
+    }
+
+    if (thermal.active && !thermal.busy && (int32_t)(hal.get_elapsed_ticks() - thermal.next) >= 0) {
+        mbio_thermal_request();
+    }
+
+    if (thermal.active || thermal.offset != 0.0f) {
+        mbio_thermal_apply(state);
+    }
+
+#if MBIO_NOTIFY_ENABLE
+    if (notify.enabled && !notify.busy && (notify.changed || (int32_t)(hal.get_elapsed_ticks() - notify.next_poll) >= 0)) {
+        mbio_notify_request();
+    }
+#endif
+
+    if (scan.frames && !scan.busy && (scan.frame || (int32_t)(hal.get_elapsed_ticks() - scan.next) >= 0)) {
+        mbio_scan_request();
+    }
+
+    if (!write_behind.busy) {
+        mbio_write_behind_request();
+    }
+
+    mbio_stream_samples();
+    mbio_log_flush(false);
+
+    MBIO_ENTRY_END(MBIO_ProbePoll, probe);
+}
+
+static void mbio_poll_realtime(sys_state_t state) {
+    on_execute_realtime(state);
+    mbio_poll(state);
+}
+
+static void mbio_poll_delay(sys_state_t state) {
+    on_execute_delay(state);
+    mbio_poll(state);
+}
+
+static void mbio_reset(void) {
+    // The MODBUS queue is flushed on reset, no response will arrive for a sample in flight.
+    pending.count = 0;
+    sampler.busy = false;
+    scan.busy = scan.restart = false;
+    scan.frame = 0;
+    thermal.busy = false;
+    thermal.reset = true;
+    // Adaptive feed is for the job which was running, the core restores the feed override.
+    adapt.active = adapt.busy = false;
+    adapt.apply = 0;
+    // Deferred writes are dropped, outputs should not change after a reset.
+    memset(&write_behind.points, 0, sizeof(write_behind.points));
+    write_behind.busy = false;
+#if MBIO_COOLANT_ENABLE
+    // Except for coolant, the core switched it off before.
+    mbio_coolant_write(coolant.commanded, true);
+#endif
+#if MBIO_NOTIFY_ENABLE
+    notify.busy = false;
+    notify.changed = true;
+    notify.done = notify.sent;
+#endif
+
+    on_reset();
+}
+
+
+// The M-codes besides M101-M104 are configurable and are left to another plugin handling them.
+// mbio_check() asks the chained plugins once per block, validate and execute use what it found.
+static struct {
+    bool adapt;
+    bool thermal;
+} claimed = {0};
+
+static bool mbio_own_mcode(user_mcode_t mcode) {
+    return (mcode == (user_mcode_t)MBIO_MCODE_ADAPT && claimed.adapt) || (mcode == (user_mcode_t)MBIO_MCODE_THERMAL && claimed.thermal);
+}
+
+// Check if M-code is handled here.
+// parameters: mcode - M-code to check for (some are predefined in user_mcode_t in grbl/gcode.h), use a cast if not.
+// returns:    mcode if handled, UserMCode_Ignore otherwise (UserMCode_Ignore is defined in grbl/gcode.h).
+static user_mcode_t mbio_check(user_mcode_t mcode) {
+    if (mcode == UserMCode_Generic1 || mcode == UserMCode_Generic2 || mcode == UserMCode_Generic3 || mcode == UserMCode_Generic4) {
+        return mcode;
+    }
+
+    user_mcode_t handled = user_mcode.check ? user_mcode.check(mcode) : UserMCode_Ignore;
+
+    if (mcode == (user_mcode_t)MBIO_MCODE_ADAPT) {
+        claimed.adapt = handled == UserMCode_Ignore;
+    }
+    else if (mcode == (user_mcode_t)MBIO_MCODE_THERMAL) {
+        claimed.thermal = handled == UserMCode_Ignore;
+    }
+
+    return mbio_own_mcode(mcode) ? mcode : handled;
+}
+
+// M100 [D{0..247} P{1..9999} [E{3,4}] Q{1..65535} [R{0.01..10.0}]], the M-code is MBIO_MCODE_ADAPT
+static status_code_t mbio_validate_adapt(parser_block_t *gc_block) {
+    status_code_t state = Status_GcodeValueWordMissing;
+
+    // no parameters: stop adapting the feed
+    if (!gc_block->words.d && !gc_block->words.e && !gc_block->words.p && !gc_block->words.q && !gc_block->words.r) {
+        gc_block->values.q = 0.0f;
+        return Status_OK;
+    }
+
+    // device address D[0..247]: required
+    if (!gc_block->words.d || !isintf(gc_block->values.d)) {
+        state = Status_BadNumberFormat;
+    }
+
+    // register address P[1..9999]: required
+    if (!gc_block->words.p || !isintf(gc_block->values.p)) {
+        state = Status_BadNumberFormat;
+    }
+
+    // function code E[3,4]: optional, input register by default
+    if (gc_block->words.e && !isintf(gc_block->values.e)) {
+        state = Status_BadNumberFormat;
+    }
+
+    // target load Q[1..65535]: required
+    if (!gc_block->words.q || isnanf(gc_block->values.q)) {
+        state = Status_BadNumberFormat;
+    }
+
+    // read period R[0.01..10.0] in seconds: optional
+    if (gc_block->words.r && isnanf(gc_block->values.r)) {
+        state = Status_BadNumberFormat;
+    }
+
+    if (state != Status_BadNumberFormat) {
+        if (!gc_block->words.e) {
+            gc_block->values.e = (float)ModBus_ReadInputRegisters;
+        }
+
+        if (!gc_block->words.r) {
+            gc_block->values.r = MBIO_ADAPT_PERIOD / 1000.0f;
+        }
+
+        if (gc_block->values.d < 0.0f || gc_block->values.d > 247.0f
+            ||
+            (gc_block->values.e != (float)ModBus_ReadInputRegisters && gc_block->values.e != (float)ModBus_ReadHoldingRegisters)
+            ||
+            gc_block->values.p < 1.0f || gc_block->values.p > 9999.0f
+            ||
+            gc_block->values.q < 1.0f || gc_block->values.q > 65535.0f
+            ||
+            gc_block->values.r < 0.01f || gc_block->values.r > 10.0f) {
+
+            state = Status_GcodeValueOutOfRange;
+        }
+        else {
+            state = Status_OK;
+        }
+
+        gc_block->words.d = gc_block->words.e = gc_block->words.p = gc_block->words.q = gc_block->words.r = Off; // Claim parameters.
+    }
+
+    return state;
+}
+
+// M170 [D{0..247} P{1..9999} [E{3,4}] Q{-1.0..1.0} R{0..65535}], the M-code is MBIO_MCODE_THERMAL
+static status_code_t mbio_validate_thermal(parser_block_t *gc_block) {
+    status_code_t state = Status_GcodeValueWordMissing;
+
+    // no parameters: stop compensating
+    if (!gc_block->words.d && !gc_block->words.e && !gc_block->words.p && !gc_block->words.q && !gc_block->words.r) {
+        gc_block->values.q = 0.0f;
+        return Status_OK;
+    }
+
+    // device address D[0..247]: required
+    if (!gc_block->words.d || !isintf(gc_block->values.d)) {
+        state = Status_BadNumberFormat;
+    }
+
+    // register address P[1..9999]: required
+    if (!gc_block->words.p || !isintf(gc_block->values.p)) {
+        state = Status_BadNumberFormat;
+    }
+
+    // function code E[3,4]: optional, input register by default
+    if (gc_block->words.e && !isintf(gc_block->values.e)) {
+        state = Status_BadNumberFormat;
+    }
+
+    // growth Q[-1.0..1.0] in mm per register unit: required
+    if (!gc_block->words.q || isnanf(gc_block->values.q)) {
+        state = Status_BadNumberFormat;
+    }
 
-#ifdef MBIO_DEBUG
-    char buf[40];
-    sprintf(buf, "MODBUS WAIT VAL: %d, expected %d, rt %.2f s", ret, value, delay * MBIO_WAIT_STEP / 1000.0f);
-    report_message(buf, Message_Plain);
+    // reference R[0..65535], the register value without growth: required
+    if (!gc_block->words.r || isnanf(gc_block->values.r)) {
+        state = Status_BadNumberFormat;
+    }
 
-#endif
+    if (state != Status_BadNumberFormat) {
+        if (!gc_block->words.e) {
+            gc_block->values.e = (float)ModBus_ReadInputRegisters;
+        }
 
-    return ret;
-}
+        if (gc_block->values.d < 0.0f || gc_block->values.d > 247.0f
+            ||
+            (gc_block->values.e != (float)ModBus_ReadInputRegisters && gc_block->values.e != (float)ModBus_ReadHoldingRegisters)
+            ||
+            gc_block->values.p < 1.0f || gc_block->values.p > 9999.0f
+            ||
+            gc_block->values.q == 0.0f || gc_block->values.q < -1.0f || gc_block->values.q > 1.0f
+            ||
+            gc_block->values.r < 0.0f || gc_block->values.r > 65535.0f) {
+
+            state = Status_GcodeValueOutOfRange;
+        }
+        else {
+            state = Status_OK;
+        }
 
+        gc_block->words.d = gc_block->words.e = gc_block->words.p = gc_block->words.q = gc_block->words.r = Off; // Claim parameters.
+    }
 
-// Check if M-code is handled here.
-// parameters: mcode - M-code to check for (some are predefined in user_mcode_t in grbl/gcode.h), use a cast if not.
-// returns:    mcode if handled, UserMCode_Ignore otherwise (UserMCode_Ignore is defined in grbl/gcode.h).
-static user_mcode_t mbio_check(user_mcode_t mcode) {
-    return mcode == UserMCode_Generic1 || mcode == UserMCode_Generic2
-                     ? mcode
-                     : (user_mcode.check ? user_mcode.check(mcode) : UserMCode_Ignore);
+    return state;
 }
 
 // Validate M-code parameters
@@ -235,7 +2806,7 @@ static status_code_t mbio_validate(parser_block_t *gc_block, parameter_words_t *
 
     switch (gc_block->user_mcode) {
 
-        // M101 D{0..247} E{1,2,3,4,5,6} P{1..9999} [Q{0..65535}]
+        // M101 D{0..247} E{1,2,3,4,5,6} P{1..9999} [Q{0..65535}] [R{0.001..60.0}]
         case UserMCode_Generic1:
             // device address D[0..247]: required
             if (!gc_block->words.d || !isintf(gc_block->values.d)) { // Check if D parameter value is supplied.
@@ -258,6 +2829,11 @@ static status_code_t mbio_validate(parser_block_t *gc_block, parameter_words_t *
                 state = Status_BadNumberFormat;
             }
 
+            // write-behind deadline R[0.001 .. 60.0] in seconds: optional, writes (5,6) only
+            if (gc_block->words.r && isnanf(gc_block->values.r)) {
+                state = Status_BadNumberFormat;
+            }
+
             // value
             if (state != Status_BadNumberFormat) { // Are required parameters provided?
                 // briefly check ranges
@@ -269,7 +2845,10 @@ static status_code_t mbio_validate(parser_block_t *gc_block, parameter_words_t *
                     ||
                     gc_block->values.p < 1.0f || gc_block->values.p > 9999.0f
                     ||
-                    gc_block->values.q < 0.0f || gc_block->values.q > 65535.0f) {
+                    gc_block->values.q < 0.0f || gc_block->values.q > 65535.0f
+                    ||
+                    (gc_block->words.r && ((gc_block->values.e != (float)ModBus_WriteCoil && gc_block->values.e != (float)ModBus_WriteRegister)
+                        || gc_block->values.r < 0.001f || gc_block->values.r > 60.0f))) {
                 	
                     state = Status_GcodeValueOutOfRange;                    
                 }
@@ -288,7 +2867,11 @@ static status_code_t mbio_validate(parser_block_t *gc_block, parameter_words_t *
                 	state = Status_OK;
                 }
                     
-                gc_block->words.d = gc_block->words.e = gc_block->words.p = gc_block->words.q = Off; // Claim parameters.
+                if (!gc_block->words.r) {
+                    gc_block->values.r = 0.0f;
+                }
+
+                gc_block->words.d = gc_block->words.e = gc_block->words.p = gc_block->words.q = gc_block->words.r = Off; // Claim parameters.
                 //gc_block->user_mcode_sync = true;                           // Optional: execute command synchronized
             }
             break;
@@ -336,8 +2919,128 @@ static status_code_t mbio_validate(parser_block_t *gc_block, parameter_words_t *
             }
             break;            
 
+        // M103 [D{0..247} P{1..9999} [E{3,4}] R{0.001..60.0}|Q{0.001..1000.0}]
+        case UserMCode_Generic3:
+            // no parameters: stop sampling
+            if (!gc_block->words.d && !gc_block->words.e && !gc_block->words.p && !gc_block->words.q && !gc_block->words.r) {
+                gc_block->values.q = gc_block->values.r = 0.0f;
+                state = Status_OK;
+                break;
+            }
+
+            // device address D[0..247]: required
+            if (!gc_block->words.d || !isintf(gc_block->values.d)) {
+                state = Status_BadNumberFormat;
+            }
+
+            // register address P[1..9999]: required
+            if (!gc_block->words.p || !isintf(gc_block->values.p)) {
+                state = Status_BadNumberFormat;
+            }
+
+            // function code E[3,4]: optional, input register by default
+            if (gc_block->words.e && !isintf(gc_block->values.e)) {
+                state = Status_BadNumberFormat;
+            }
+
+            // interval R[0.001..60.0] in seconds or distance Q[0.001..1000.0] in mm: one of them is required
+            if (state != Status_BadNumberFormat && gc_block->words.r != gc_block->words.q) {
+                if (!gc_block->words.e) {
+                    gc_block->values.e = (float)ModBus_ReadInputRegisters;
+                }
+
+                if (gc_block->words.r) {
+                    gc_block->values.q = 0.0f;
+                }
+                else {
+                    gc_block->values.r = 0.0f;
+                }
+
+                if (gc_block->values.d < 0.0f || gc_block->values.d > 247.0f
+                    ||
+                    (gc_block->values.e != (float)ModBus_ReadInputRegisters && gc_block->values.e != (float)ModBus_ReadHoldingRegisters)
+                    ||
+                    gc_block->values.p < 1.0f || gc_block->values.p > 9999.0f
+                    ||
+                    (gc_block->words.r && (gc_block->values.r < 0.001f || gc_block->values.r > 60.0f))
+                    ||
+                    (gc_block->words.q && (gc_block->values.q < 0.001f || gc_block->values.q > 1000.0f))) {
+
+                    state = Status_GcodeValueOutOfRange;
+                }
+                else {
+                    state = Status_OK;
+                }
+
+                gc_block->words.d = gc_block->words.e = gc_block->words.p = gc_block->words.q = gc_block->words.r = Off; // Claim parameters.
+            }
+            break;
+
+        // M104 [D{0..247} E{1,2,3,4} P{1..9999} [Q{1..MBIO_SCAN_POINTS}]]
+        case UserMCode_Generic4:
+            // no parameters: clear the scan list
+            if (!gc_block->words.d && !gc_block->words.e && !gc_block->words.p && !gc_block->words.q) {
+                gc_block->values.q = 0.0f;
+                state = Status_OK;
+                break;
+            }
+
+            // device address D[0..247]: required
+            if (!gc_block->words.d || !isintf(gc_block->values.d)) {
+                state = Status_BadNumberFormat;
+            }
+
+            // function code E[1,2,3,4]: required
+            if (!gc_block->words.e || !isintf(gc_block->values.e)) {
+                state = Status_BadNumberFormat;
+            }
+
+            // first address P[1..9999]: required
+            if (!gc_block->words.p || !isintf(gc_block->values.p)) {
+                state = Status_BadNumberFormat;
+            }
+
+            // number of points Q: optional, one by default
+            if (gc_block->words.q && !isintf(gc_block->values.q)) {
+                state = Status_BadNumberFormat;
+            }
+
+            if (state != Status_BadNumberFormat) {
+                if (!gc_block->words.q) {
+                    gc_block->values.q = 1.0f;
+                }
+
+                if (gc_block->values.d < 0.0f || gc_block->values.d > 247.0f
+                    ||
+                    gc_block->values.e < (float)ModBus_ReadCoils || gc_block->values.e > (float)ModBus_ReadInputRegisters
+                    ||
+                    gc_block->values.p < 1.0f || gc_block->values.p > 9999.0f
+                    ||
+                    gc_block->values.q < 1.0f || gc_block->values.q > (float)MBIO_SCAN_POINTS || gc_block->values.p + gc_block->values.q > 10000.0f) {
+
+                    state = Status_GcodeValueOutOfRange;
+                }
+                else {
+                    state = Status_OK;
+                }
+
+                gc_block->words.d = gc_block->words.e = gc_block->words.p = gc_block->words.q = Off; // Claim parameters.
+            }
+            break;
+
         default:
-            state = Status_Unhandled;
+            if (!mbio_own_mcode(gc_block->user_mcode)) {
+                state = Status_Unhandled;
+            }
+            else if (gc_block->user_mcode == (user_mcode_t)MBIO_MCODE_ADAPT) {
+                state = mbio_validate_adapt(gc_block);
+            }
+            else if (gc_block->user_mcode == (user_mcode_t)MBIO_MCODE_THERMAL) {
+                state = mbio_validate_thermal(gc_block);
+            }
+            else {
+                state = Status_Unhandled;
+            }
             break;
     }
 
@@ -351,10 +3054,13 @@ static status_code_t mbio_validate(parser_block_t *gc_block, parameter_words_t *
 //             gc_block - pointer to parser_block_t struct (defined in grbl/gcode.h).
 // returns:    -
 static void mbio_execute(sys_state_t state, parser_block_t *gc_block) {
-    bool handled = true;
+    bool handled = true, failed = false;
+    uint32_t started = mbio_micros();
     char device_address = (char)gc_block->values.d;
     uint16_t register_address = (uint16_t)gc_block->values.p - 1;
 
+    MBIO_ENTRY_START(probe);
+
     switch(gc_block->user_mcode) {
         case UserMCode_Generic1:
             uint16_t value = (uint16_t)gc_block->values.q;
@@ -364,7 +3070,9 @@ static void mbio_execute(sys_state_t state, parser_block_t *gc_block) {
 
             switch ((char)gc_block->values.e) {
                 case ModBus_ReadCoils: // 1
-                    mbio_ModBus_ReadCoils(device_address, register_address, value);
+                    if (value != 1 || !mbio_image_written(device_address, ModBus_ReadCoils, register_address)) {
+                        mbio_ModBus_ReadCoils(device_address, register_address, value);
+                    }
                     break;
 
                 case ModBus_ReadDiscreteInputs: // 2
@@ -376,31 +3084,93 @@ static void mbio_execute(sys_state_t state, parser_block_t *gc_block) {
                     break;
 
                 case ModBus_ReadHoldingRegisters: // 3
-                    mbio_ModBus_ReadHoldingRegisters(device_address, register_address);
+                    if (!mbio_image_written(device_address, ModBus_ReadHoldingRegisters, register_address)) {
+                        mbio_ModBus_ReadHoldingRegisters(device_address, register_address);
+                    }
                     break;
 
                 case ModBus_WriteCoil: // 5
-                    mbio_ModBus_WriteCoil(device_address, register_address, value);
+                    if (gc_block->values.r == 0.0f || !mbio_write_behind(device_address, ModBus_WriteCoil, register_address, value, (uint32_t)(gc_block->values.r * 1000.0f))) {
+                        mbio_write_behind_drop(device_address, ModBus_WriteCoil, register_address);
+                        mbio_ModBus_WriteCoil(device_address, register_address, value);
+                    }
                     break;
 
                 case ModBus_WriteRegister: // 6
-                    mbio_ModBus_WriteRegister(device_address, register_address, value);
+                    if (gc_block->values.r == 0.0f || !mbio_write_behind(device_address, ModBus_WriteRegister, register_address, value, (uint32_t)(gc_block->values.r * 1000.0f))) {
+                        mbio_write_behind_drop(device_address, ModBus_WriteRegister, register_address);
+                        mbio_ModBus_WriteRegister(device_address, register_address, value);
+                    }
                     break;
             }
             break;
 
         case UserMCode_Generic2: 
             int32_t ret = mbio_Wait_ReadDiscreteInputs(device_address, register_address, (int32_t)gc_block->values.q, gc_block->values.r);
-            if (ret < 0) {
+            if ((failed = ret < 0)) {
                 system_raise_alarm(Status_GCodeTimeout);
             }
             break;
 
+        case UserMCode_Generic3:
+            if (gc_block->values.r == 0.0f && gc_block->values.q == 0.0f) {
+                mbio_sampler_stop();
+            }
+            else {
+                mbio_sampler_start(device_address, (uint8_t)gc_block->values.e, register_address, gc_block->values.r, gc_block->values.q);
+            }
+            break;
+
+        case UserMCode_Generic4:
+            if (gc_block->values.q == 0.0f) {
+                mbio_scan_remove(MBIO_ScanMcode);
+                break;
+            }
+
+            for (uint16_t idx = 0; idx < (uint16_t)gc_block->values.q; idx++) {
+                if (!mbio_scan_add(device_address, (uint8_t)gc_block->values.e, register_address + idx, MBIO_ScanMcode)) {
+                    report_message("MODBUS I/O: scan list full", Message_Warning);
+                    break;
+                }
+            }
+            mbio_scan_plan();
+            break;
+
         default:
-            handled = false;
+            if (!mbio_own_mcode(gc_block->user_mcode)) {
+                handled = false;
+            }
+            else if (gc_block->user_mcode == (user_mcode_t)MBIO_MCODE_ADAPT) {
+                if (gc_block->values.q == 0.0f) {
+                    mbio_adapt_stop();
+                }
+                else {
+                    mbio_adapt_start(device_address, (uint8_t)gc_block->values.e, register_address, gc_block->values.q, gc_block->values.r);
+                }
+            }
+            else if (gc_block->user_mcode == (user_mcode_t)MBIO_MCODE_THERMAL) {
+                if (gc_block->values.q == 0.0f) {
+                    mbio_thermal_stop();
+                }
+                else {
+                    mbio_thermal_start(device_address, (uint8_t)gc_block->values.e, register_address, gc_block->values.q, gc_block->values.r);
+                }
+            }
             break;
     }
 
+    if (handled) {
+        uint32_t duration = mbio_micros() - started;
+
+        mbio_log_mcode(gc_block, duration, failed);
+        // only the M-codes doing a transfer, the others just set up background work
+        if (gc_block->user_mcode == UserMCode_Generic1 || gc_block->user_mcode == UserMCode_Generic2) {
+            mbio_latency_add(gc_block, duration);
+        }
+    }
+
+    MBIO_ENTRY_END(MBIO_ProbeExecute, probe);
+
     // If not handled by us and another handler present, call it.
     if (!handled && user_mcode.execute) {
         user_mcode.execute(state, gc_block);
@@ -408,8 +3178,48 @@ static void mbio_execute(sys_state_t state, parser_block_t *gc_block) {
 }
 
 static void mbio_rx_packet (modbus_message_t *msg) {
+    mbio_response_t context = (mbio_response_t)msg->context;
+
+    MBIO_ENTRY_START(probe);
+
+    mbio_trace(MBIO_TraceRx, msg->adu, msg->rx_length - 2);
+
     if (!(msg->adu[0] & 0x80)) {
-        switch((mbio_response_t)msg->context) {
+        if (context < MBIO_Contexts) {
+            mbio_log_rx(context, &requests[context]);
+            if (context != MBIO_Scan) {
+                mbio_image_rx(msg, &requests[context]);
+            }
+        }
+
+        switch(context) {
+            case MBIO_Sample:
+                mbio_sampler_rx(msg);
+                break;
+
+            case MBIO_Adapt:
+                mbio_adapt_rx(msg);
+                break;
+
+            case MBIO_Thermal:
+                mbio_thermal_rx(msg);
+                break;
+
+#if MBIO_NOTIFY_ENABLE
+            case MBIO_Notify:
+                notify.busy = false; // the inputs are in the I/O image now
+                notify.read = notify.done = notify.sent;
+                break;
+#endif
+
+            case MBIO_Scan:
+                mbio_scan_rx(msg);
+                break;
+
+            case MBIO_WriteBehind:
+                write_behind.busy = false; // written through to the I/O image
+                break;
+
             case MBIO_Command:
                 // rewrite in opposite way - use context to distinguish between commands and then check if the response corresponds to command sent!
 
@@ -475,11 +3285,297 @@ static void mbio_rx_packet (modbus_message_t *msg) {
         
     }
     else {
+        mbio_log_error(context, msg->adu[2]);
+
+        if (context == MBIO_Sample) {
+            sampler.busy = false;
+            sampler.errors++;
+        }
+#if MBIO_NOTIFY_ENABLE
+        if (context == MBIO_Notify) {
+            notify.busy = false;
+            notify.done = notify.sent;
+        }
+#endif
+        if (context == MBIO_Scan) {
+            mbio_scan_error();
+        }
+        if (context == MBIO_Adapt) {
+            adapt.busy = false;
+        }
+        if (context == MBIO_Thermal) {
+            thermal.busy = false;
+        }
+        if (context == MBIO_WriteBehind) {
+            mbio_write_behind_error();
+        }
         report_message("MODBUS ERROR", Message_Warning);
     }
+
+    mbio_pending_done(context);
+
+    MBIO_ENTRY_END(MBIO_ProbeRx, probe);
+}
+
+#if MBIO_BENCH
+
+typedef struct {
+    const char *name;
+    void (*setup)(void);
+    void (*call)(void);
+    uint32_t min;
+    uint32_t max;
+    uint64_t sum;
+} mbio_bench_t;
+
+static parser_block_t bench_block;
+static modbus_message_t bench_msg;
+static mbio_image_t bench_image;
+static mbio_latencies_t bench_latency;
+static mbio_request_t bench_requests[MBIO_Contexts];
+static uint32_t bench_readback_differs[8];
+
+static void mbio_bench_none(void) {
+}
+
+static void mbio_bench_setup_m101(void) {
+    memset(&bench_block, 0, sizeof(parser_block_t));
+    bench_block.user_mcode = UserMCode_Generic1;
+    bench_block.words.d = bench_block.words.e = bench_block.words.p = bench_block.words.q = On;
+    bench_block.values.d = 247.0f;
+    bench_block.values.e = (float)ModBus_WriteCoil;
+    bench_block.values.p = 1.0f;
+    bench_block.values.q = 1.0f;
+}
+
+static void mbio_bench_setup_m102(void) {
+    memset(&bench_block, 0, sizeof(parser_block_t));
+    bench_block.user_mcode = UserMCode_Generic2;
+    bench_block.words.d = bench_block.words.p = bench_block.words.q = bench_block.words.r = On;
+    bench_block.values.d = 247.0f;
+    bench_block.values.p = 2.0f;
+    bench_block.values.q = 1.0f;
+    bench_block.values.r = 10.0f;
+}
+
+static void mbio_bench_setup_m103(void) {
+    memset(&bench_block, 0, sizeof(parser_block_t));
+    bench_block.user_mcode = UserMCode_Generic3;
+    bench_block.words.d = bench_block.words.p = bench_block.words.r = On;
+    bench_block.values.d = 247.0f;
+    bench_block.values.p = 1.0f;
+    bench_block.values.r = 0.01f;
+}
+
+static void mbio_bench_setup_execute(void) {
+    mbio_bench_setup_m101();
+    mbio_validate(&bench_block, NULL);
+}
+
+static void mbio_bench_setup_rx_register(void) {
+    mbio_encode_request(&bench_msg, MBIO_Command, 247, ModBus_ReadHoldingRegisters, 0, 1, 7);
+    mbio_modbus_send_command(bench_msg, false);
+    bench_msg.adu[2] = 2;
+    bench_msg.adu[3] = 0x12;
+    bench_msg.adu[4] = 0x34;
+}
+
+static void mbio_bench_setup_rx_coils(void) {
+    mbio_encode_request(&bench_msg, MBIO_Command, 247, ModBus_ReadCoils, 0, 8, 6);
+    mbio_modbus_send_command(bench_msg, false);
+    bench_msg.adu[2] = 1;
+    bench_msg.adu[3] = 0xA5;
+}
+
+static void mbio_bench_validate(void) {
+    mbio_validate(&bench_block, NULL);
+}
+
+static void mbio_bench_execute(void) {
+    mbio_execute(STATE_IDLE, &bench_block);
+}
+
+static void mbio_bench_encode(void) {
+    mbio_encode_request(&bench_msg, MBIO_Command, 247, ModBus_WriteCoil, 0, 0xFF00, 8);
+}
+
+static void mbio_bench_rx(void) {
+    mbio_rx_packet(&bench_msg);
+}
+
+static mbio_bench_t benches[] = {
+    { "overhead", mbio_bench_none, mbio_bench_none },
+    { "validate_m101", mbio_bench_setup_m101, mbio_bench_validate },
+    { "validate_m102", mbio_bench_setup_m102, mbio_bench_validate },
+    { "validate_m103", mbio_bench_setup_m103, mbio_bench_validate },
+    { "encode", mbio_bench_none, mbio_bench_encode },
+    { "execute_m101", mbio_bench_setup_execute, mbio_bench_execute },
+    { "rx_register", mbio_bench_setup_rx_register, mbio_bench_rx },
+    { "rx_coils", mbio_bench_setup_rx_coils, mbio_bench_rx },
+};
+
+static void mbio_bench_run(mbio_bench_t *bench) {
+    bench->min = UINT32_MAX;
+    bench->max = 0;
+    bench->sum = 0;
+
+    for (uint_fast16_t i = 0; i < MBIO_BENCH_ITERATIONS; i++) {
+        bench->setup();
+
+        uint32_t start = mbio_cycles();
+        bench->call();
+        uint32_t cycles = mbio_cycles() - start;
+
+        bench->sum += cycles;
+        if (cycles < bench->min) {
+            bench->min = cycles;
+        }
+        if (cycles > bench->max) {
+            bench->max = cycles;
+        }
+    }
 }
 
+// $MBIOBENCH - run the microbenchmarks, $MBIOBENCH=<filename> - also append the results to a CSV file on the SD card.
+// Results are reported as [MBIOBENCH:<name>,<iterations>,<min>,<avg>,<max>,<unit>], overhead is the cost of the timing itself.
+static status_code_t mbio_cmd_bench(sys_state_t state, char *args) {
+    if (state != STATE_IDLE) {
+        return Status_IdleError;
+    }
+
+#if SDCARD_ENABLE
+    vfs_file_t *file = NULL;
+
+    if (args && (file = vfs_open(args, "a")) == NULL) {
+        return Status_SDFailedOpenFile;
+    }
+#endif
+
+    // the benchmarks feed the same code paths as real traffic, keep it out of the image, log and trace
+    int32_t var5399 = sys.var5399;
+    bool log_active = mbio_log.active, trace_active = trace.active;
+
+#if MBIO_PROFILE
+    mbio_probe_t bench_probes[MBIO_Probes];
+    memcpy(bench_probes, probes, sizeof(probes));
+#endif
+    memcpy(&bench_image, &image, sizeof(image));
+    memcpy(&bench_latency, &latency, sizeof(latency));
+    memcpy(bench_requests, requests, sizeof(requests));
+    memcpy(bench_readback_differs, readback_differs, sizeof(readback_differs));
+    mbio_log.active = trace.active = false;
+    bench_dry_run = true;
+
+    for (uint_fast8_t idx = 0; idx < sizeof(benches) / sizeof(mbio_bench_t); idx++) {
+        mbio_bench_run(&benches[idx]);
+    }
+
+    bench_dry_run = false;
+    mbio_log.active = log_active;
+    trace.active = trace_active;
+    memcpy(requests, bench_requests, sizeof(requests));
+    memcpy(readback_differs, bench_readback_differs, sizeof(readback_differs));
+    memcpy(&image, &bench_image, sizeof(image));
+    memcpy(&latency, &bench_latency, sizeof(latency));
+#if MBIO_PROFILE
+    memcpy(probes, bench_probes, sizeof(probes));
+#endif
+    sys.var5399 = var5399;
+
+    for (uint_fast8_t idx = 0; idx < sizeof(benches) / sizeof(mbio_bench_t); idx++) {
+        mbio_bench_t *bench = &benches[idx];
+        char line[80], *s = line;
+
+        s = mbio_append(s, bench->name);
+        s = mbio_append(mbio_append(s, ","), uitoa(MBIO_BENCH_ITERATIONS));
+        s = mbio_append(mbio_append(s, ","), uitoa(bench->min));
+        s = mbio_append(mbio_append(s, ","), uitoa((uint32_t)(bench->sum / MBIO_BENCH_ITERATIONS)));
+        s = mbio_append(mbio_append(s, ","), uitoa(bench->max));
+        s = mbio_append(mbio_append(s, ","), MBIO_CYCLES_UNIT);
+
+        hal.stream.write("[MBIOBENCH:");
+        hal.stream.write(line);
+        hal.stream.write("]" ASCII_EOL);
+
+#if SDCARD_ENABLE
+        if (file) {
+            mbio_append(s, "\n");
+            vfs_write(line, 1, strlen(line), file);
+        }
+#endif
+    }
+
+#if SDCARD_ENABLE
+    if (file) {
+        vfs_close(file);
+    }
+#endif
+
+    return Status_OK;
+}
+
+#endif
+
+#if MBIO_PROFILE
+
+// $MBIOPROF - report the probes as [MBIOPROF:<name>,<count>,<min>,<avg>,<max>,<unit>,<stack bytes>], $MBIOPROF=RESET - clear them.
+static status_code_t mbio_cmd_profile(sys_state_t state, char *args) {
+    if (args) {
+        if (strcmp(args, "RESET")) {
+            return Status_InvalidStatement;
+        }
+        memset(probes, 0, sizeof(probes));
+
+        return Status_OK;
+    }
+
+    for (uint_fast8_t idx = 0; idx < MBIO_Probes; idx++) {
+        mbio_probe_t *probe = &probes[idx];
+        char line[80], *s = line;
+
+        s = mbio_append(s, probe_names[idx]);
+        s = mbio_append(mbio_append(s, ","), uitoa(probe->count));
+        s = mbio_append(mbio_append(s, ","), uitoa(probe->min));
+        s = mbio_append(mbio_append(s, ","), uitoa(probe->count ? (uint32_t)(probe->sum / probe->count) : 0));
+        s = mbio_append(mbio_append(s, ","), uitoa(probe->max));
+        s = mbio_append(mbio_append(s, ","), MBIO_CYCLES_UNIT);
+        mbio_append(mbio_append(s, ","), uitoa(probe->stack));
+
+        hal.stream.write("[MBIOPROF:");
+        hal.stream.write(line);
+        hal.stream.write("]" ASCII_EOL);
+    }
+
+    return Status_OK;
+}
+
+#endif
 
+static const sys_command_t mbio_command_list[] = {
+#if MBIO_BENCH
+    {"MBIOBENCH", mbio_cmd_bench, {}, { .str = "$MBIOBENCH[=<filename>] - run MODBUS I/O microbenchmarks" } },
+#endif
+#if MBIO_PROFILE
+    {"MBIOPROF", mbio_cmd_profile, { .allow_blocking = On }, { .str = "$MBIOPROF[=RESET] - report MODBUS I/O hot path timing" } },
+#endif
+    {"MBIOPLAN", mbio_cmd_plan, { .allow_blocking = On }, { .str = "$MBIOPLAN - report the MODBUS I/O scan reads" } },
+    {"MBIORULE", mbio_cmd_rule, { .allow_blocking = On }, { .str = "$MBIORULE=<rule>|CLEAR - add MODBUS I/O interlock rule or remove all, $MBIORULE - list them" } },
+    {"MBIOLIMIT", mbio_cmd_limit, { .allow_blocking = On }, { .str = "$MBIOLIMIT=<limit>|CLEAR - add MODBUS I/O point limit or remove all, $MBIOLIMIT - list them" } },
+    {"MBIOLAT", mbio_cmd_latency, { .allow_blocking = On }, { .str = "$MBIOLAT[=RESET] - report MODBUS I/O M-code latency histograms" } },
+    {"MBIOTRACE", mbio_cmd_trace, { .allow_blocking = On }, { .str = "$MBIOTRACE=ON|OFF - capture MODBUS frames, $MBIOTRACE - dump them" } },
+#if SDCARD_ENABLE
+    {"MBIOLOG", mbio_cmd_log, { .allow_blocking = On }, { .str = "$MBIOLOG=<filename> - log MODBUS I/O to SD card, $MBIOLOG=OFF - stop" } },
+#endif
+};
+
+static sys_commands_t mbio_commands = {
+    .n_commands = sizeof(mbio_command_list) / sizeof(sys_command_t),
+    .commands = mbio_command_list
+};
+
+static sys_commands_t *mbio_get_commands(void) {
+    return &mbio_commands;
+}
 
 void mbio_init(void) {
 	hal.user_mcode.check = mbio_check;
@@ -488,6 +3584,58 @@ void mbio_init(void) {
 
 	on_report_options = grbl.on_report_options;
     grbl.on_report_options = mbio_report_options;
+
+    on_execute_realtime = grbl.on_execute_realtime;
+    grbl.on_execute_realtime = mbio_poll_realtime;
+
+    on_execute_delay = grbl.on_execute_delay;
+    grbl.on_execute_delay = mbio_poll_delay;
+
+    on_reset = grbl.on_reset;
+    grbl.on_reset = mbio_reset;
+
+    mbio_commands.on_get_commands = grbl.on_get_commands;
+    grbl.on_get_commands = mbio_get_commands;
+
+    static const uint8_t readback_devices[] = { MBIO_READBACK_DEVICES };
+
+    for (uint_fast8_t idx = 0; idx < sizeof(readback_devices); idx++) {
+        if (readback_devices[idx]) {
+            readback_differs[readback_devices[idx] >> 5] |= 1UL << (readback_devices[idx] & 0x1F);
+        }
+    }
+
+#ifdef MBIO_RULES
+    static const char *const default_rules[] = { MBIO_RULES };
+
+    for (uint_fast8_t idx = 0; idx < sizeof(default_rules) / sizeof(default_rules[0]); idx++) {
+        if (mbio_rule_compile(default_rules[idx]) != Status_OK) {
+            protocol_enqueue_foreground_task(report_warning, "MODBUS I/O: invalid rule in MBIO_RULES!");
+        }
+    }
+#endif
+
+#ifdef MBIO_LIMITS
+    static const char *const default_limits[] = { MBIO_LIMITS };
+
+    for (uint_fast8_t idx = 0; idx < sizeof(default_limits) / sizeof(default_limits[0]); idx++) {
+        if (mbio_limit_compile(default_limits[idx]) != Status_OK) {
+            protocol_enqueue_foreground_task(report_warning, "MODBUS I/O: invalid limit in MBIO_LIMITS!");
+        }
+    }
+#endif
+
+#if MBIO_NOTIFY_ENABLE
+    mbio_notify_init();
+#endif
+
+#if MBIO_COOLANT_ENABLE
+    mbio_coolant_init();
+#endif
+
+#if MBIO_BENCH || MBIO_PROFILE
+    mbio_cycles_init();
+#endif
 }
 
 #endif
\ No newline at end of file
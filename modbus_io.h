@@ -26,9 +26,233 @@ along with this plugin.  If not, see <http://www.gnu.org/licenses/>.
     #define MBIO_WAIT_STEP 50.0f
 #endif
 
+#ifndef MBIO_SAMPLE_BUFFER
+    #define MBIO_SAMPLE_BUFFER 256 // size of the sample ring buffer, must be a power of 2
+#endif
+
+#ifndef MBIO_STREAM_BATCH
+    #define MBIO_STREAM_BATCH 8 // max number of delta encoded samples per streamed line
+#endif
+
+#ifndef MBIO_STREAM_KEYFRAME
+    #define MBIO_STREAM_KEYFRAME 32 // number of delta lines between keyframes
+#endif
+
+#ifndef MBIO_STREAM_TX_LIMIT
+    #define MBIO_STREAM_TX_LIMIT 64 // no samples are streamed while more characters are waiting in the output buffer
+#endif
+
+#ifndef MBIO_IMAGE_SIZE
+    #define MBIO_IMAGE_SIZE 32 // number of points kept in the I/O image
+#endif
+
+#ifndef MBIO_LOG_CHUNK
+    #define MBIO_LOG_CHUNK 512 // log is written to the SD card in chunks of this size
+#endif
+
+#ifndef MBIO_LOG_BUFFER
+    #define MBIO_LOG_BUFFER (MBIO_LOG_CHUNK * 4) // must be a power of 2 multiple of MBIO_LOG_CHUNK
+#endif
+
+#ifndef MBIO_LOG_KEYFRAME
+    #define MBIO_LOG_KEYFRAME 5000 // ms between keyframes of the I/O image in the log
+#endif
+
+#ifndef MBIO_TRACE_SIZE
+    #define MBIO_TRACE_SIZE 128 // number of frames kept by the trace capture, must be a power of 2
+#endif
+
+#ifndef MBIO_LATENCY_SLOTS
+    #define MBIO_LATENCY_SLOTS 16 // number of device and function code combinations with a M-code latency histogram
+#endif
+
+#define MBIO_LATENCY_BUCKETS 16 // <1 ms, 1-2 ms, 2-4 ms ... >= 16.4 s
+
+#ifndef MBIO_READBACK_DEVICES
+    #define MBIO_READBACK_DEVICES 0 // comma separated addresses of devices whose readback differs from what was written, 0 for none
+#endif
+
+#ifndef MBIO_WRITE_BEHIND_POINTS
+    #define MBIO_WRITE_BEHIND_POINTS 16 // number of outputs with deferred writes, M101 with the R word
+#endif
+
+#ifndef MBIO_WRITE_RETRY
+    #define MBIO_WRITE_RETRY 100 // ms, min delay before a failed deferred write is tried again
+#endif
+
+#ifndef MBIO_RULE_COUNT
+    #define MBIO_RULE_COUNT 16 // max number of interlock rules
+#endif
+
+#ifndef MBIO_RULE_CODE
+    #define MBIO_RULE_CODE 256 // bytes of compiled rules
+#endif
+
+//#define MBIO_RULES "D2E2P3=0:HOLD", "D2E4P1<500:HOLD" // rules compiled at startup
+
+#ifndef MBIO_LIMIT_COUNT
+    #define MBIO_LIMIT_COUNT 8 // max number of points with high/low limits
+#endif
+
+//#define MBIO_LIMITS "D2E4P2H650Y20:HOLD" // limits set up at startup
+
+#ifndef MBIO_MCODE_ADAPT
+    #define MBIO_MCODE_ADAPT 100 // M-code of the adaptive feed, M100 is the generic M-code of the core not used by the plugin otherwise
+#endif
+
+#ifndef MBIO_ADAPT_MIN
+    #define MBIO_ADAPT_MIN 50 // %, lowest feed override set by M100
+#endif
+
+#ifndef MBIO_ADAPT_MAX
+    #define MBIO_ADAPT_MAX 150 // %, highest feed override set by M100
+#endif
+
+#ifndef MBIO_ADAPT_PERIOD
+    #define MBIO_ADAPT_PERIOD 100 // ms between spindle load reads when M100 has no R word
+#endif
+
+#ifndef MBIO_ADAPT_FILTER
+    #define MBIO_ADAPT_FILTER 0.3f // weight of a new load reading in the low pass filter, 1.0f for none
+#endif
+
+#ifndef MBIO_ADAPT_GAIN
+    #define MBIO_ADAPT_GAIN 0.5f // share of the relative load error corrected per read
+#endif
+
+#ifndef MBIO_ADAPT_IDLE
+    #define MBIO_ADAPT_IDLE 0.2f // share of the target load below which the tool is taken as not cutting
+#endif
+
+#ifndef MBIO_MCODE_THERMAL
+    #define MBIO_MCODE_THERMAL 170 // M-code of the thermal Z compensation, not assigned by the core
+#endif
+
+#ifndef MBIO_THERMAL_PERIOD
+    #define MBIO_THERMAL_PERIOD 1000 // ms between temperature reads of M170
+#endif
+
+#ifndef MBIO_THERMAL_STEP
+    #define MBIO_THERMAL_STEP 0.001f // mm, min change of the Z compensation applied
+#endif
+
+#ifndef MBIO_THERMAL_MAX
+    #define MBIO_THERMAL_MAX 0.5f // mm, max Z compensation
+#endif
+
+#ifndef MBIO_COOLANT_ENABLE
+    #define MBIO_COOLANT_ENABLE 0 // set to 1 to switch coolant (M7, M8, M9) with coils of a device
+#endif
+
+#if MBIO_COOLANT_ENABLE
+
+#ifndef MBIO_COOLANT_DEVICE
+    #define MBIO_COOLANT_DEVICE 1
+#endif
+
+#ifndef MBIO_COOLANT_FLOOD
+    #define MBIO_COOLANT_FLOOD 1 // coil for flood coolant (M8), 1 based like the P word
+#endif
+
+#ifndef MBIO_COOLANT_MIST
+    #define MBIO_COOLANT_MIST 0 // coil for mist coolant (M7), 0 for none
+#endif
+
+#endif
+
+#ifndef MBIO_SCAN_POINTS
+    #define MBIO_SCAN_POINTS 32 // max number of points read in the background, set up by M104, the rules, limits and coolant
+#endif
+
+#ifndef MBIO_SCAN_INTERVAL
+    #define MBIO_SCAN_INTERVAL 100 // ms between the starts of two scans
+#endif
+
+#ifndef MBIO_FRAME_COST
+    #define MBIO_FRAME_COST 24 // character times a read costs besides its data: request, response header and CRC, gaps and turnaround
+#endif
+
+#ifndef MBIO_BENCH
+    #define MBIO_BENCH 0 // set to 1 to add the $MBIOBENCH microbenchmark command
+#endif
+
+#ifndef MBIO_BENCH_ITERATIONS
+    #define MBIO_BENCH_ITERATIONS 1000
+#endif
+
+#ifndef MBIO_PROFILE
+    #define MBIO_PROFILE 0 // set to 1 to add hot path probes, reported by $MBIOPROF
+#endif
+
+#ifndef MBIO_PROFILE_STACK
+    #define MBIO_PROFILE_STACK 0 // bytes of stack painted below the entry points for the $MBIOPROF high-water marks, 0 for none
+#endif
+
+#ifndef MBIO_NOTIFY_ENABLE
+    #define MBIO_NOTIFY_ENABLE 0 // set to 1 to read the inputs of a device only when its change output fires
+#endif
+
+#if MBIO_NOTIFY_ENABLE
+
+#ifndef MBIO_NOTIFY_PORT
+    #define MBIO_NOTIFY_PORT 0 // aux input the change output of the IO board is wired to
+#endif
+
+#ifndef MBIO_NOTIFY_IRQ
+    #define MBIO_NOTIFY_IRQ IRQ_Mode_Change // IRQ_Mode_Falling or IRQ_Mode_Rising for pulse outputs
+#endif
+
+#ifndef MBIO_NOTIFY_DEVICE
+    #define MBIO_NOTIFY_DEVICE 1
+#endif
+
+#ifndef MBIO_NOTIFY_ADDRESS
+    #define MBIO_NOTIFY_ADDRESS 1 // first discrete input read, 1 based like the P word
+#endif
+
+#ifndef MBIO_NOTIFY_COUNT
+    #define MBIO_NOTIFY_COUNT 8 // number of discrete inputs read, max 40
+#endif
+
+#ifndef MBIO_NOTIFY_POLL
+    #define MBIO_NOTIFY_POLL 1000 // ms, safety poll in case a change is missed
+#endif
+
+#if MBIO_NOTIFY_COUNT > 40
+    #error "MBIO_NOTIFY_COUNT: the response would not fit in a MODBUS message of the core"
+#endif
+
+#endif
+
 typedef enum {
     MBIO_Idle = 0,
     MBIO_Command,
+    MBIO_Sample,
+    MBIO_Notify,
+    MBIO_Scan,
+    MBIO_WriteBehind,
+    MBIO_Adapt,
+    MBIO_Thermal,
+    MBIO_Contexts // number of contexts, keep last
 } mbio_response_t;
 
+// Binary log format, all values are little endian. Each record is:
+//   uint8_t length     - payload length
+//   uint8_t type       - mbio_log_record_t
+//   uint32_t timestamp - ms
+//   uint8_t payload[length]
+#define MBIO_LOG_VERSION 1
+#define MBIO_LOG_HEADER 6
+
+typedef enum {
+    MBIO_LogStart = 0,      // 'M' 'B' 'I' 'O' version - first record of each logging session
+    MBIO_LogKeyframe = 1,   // { device, function, address u16, value u16 } for some of the points in the image
+    MBIO_LogPoint = 2,      // { device, function, address u16, value u16 } for a changed point
+    MBIO_LogTx = 3,         // { context, device, function, address u16, value u16 }
+    MBIO_LogRx = 4,         // { context, device, function, round trip time us u32 }
+    MBIO_LogError = 5,      // { context, device, function, exception code }
+    MBIO_LogLost = 6,       // { count u16 } records lost because the buffer was full
+    MBIO_LogMcode = 7,      // { mcode u16, device, function, failed, execution time us u32 } logged when execution ends
+} mbio_log_record_t;
+
 #endif
\ No newline at end of file
@@ -0,0 +1,208 @@
+/*
+
+core.c - host stand-in of the grblHAL core functions used by the MODBUS I/O plugin
+
+The HAL and core functions are simple fakes driven by the variables declared in core.h. Nothing
+is sent, modbus_send() records the message and the tests feed the responses to the plugin callbacks.
+Blocking messages are answered by core_slave when a test sets it, like the driver does before it returns.
+A host tool can put a simulated driver behind modbus_send() with core_send instead.
+
+*/
+
+#include <stdio.h>
+
+#include "core.h"
+#include "grbl/vfs.h"
+
+hal_t hal;
+grbl_t grbl;
+system_t sys;
+parser_state_t gc_state;
+
+uint32_t core_ms, core_us, core_sent_count, core_wco_changes;
+sys_state_t core_state;
+uint16_t core_tx_count;
+uint32_t core_exec_flags;
+alarm_code_t core_alarm;
+bool core_send_ok;
+modbus_message_t core_sent;
+bool (*core_slave)(modbus_message_t *msg);
+bool (*core_send)(modbus_message_t *msg, const modbus_callbacks_t *callbacks, bool block);
+void (*core_realtime)(void);
+char core_output[CORE_OUTPUT_SIZE];
+size_t core_output_length, core_file_length;
+uint8_t core_file[CORE_FILE_SIZE];
+
+struct vfs_file {
+    bool open;
+};
+
+static struct vfs_file file;
+
+static uint32_t core_get_elapsed_ticks(void) {
+    return core_ms;
+}
+
+static uint32_t core_get_micros(void) {
+    return core_us;
+}
+
+static void core_stream_write(const char *s) {
+    size_t length = strlen(s);
+
+    if (core_output_length + length < sizeof(core_output)) {
+        memcpy(&core_output[core_output_length], s, length + 1);
+        core_output_length += length;
+    }
+}
+
+static uint16_t core_get_tx_buffer_count(void) {
+    return core_tx_count;
+}
+
+void core_init(void) {
+    memset(&hal, 0, sizeof(hal));
+    memset(&grbl, 0, sizeof(grbl));
+    memset(&sys, 0, sizeof(sys));
+    memset(&gc_state, 0, sizeof(gc_state));
+
+    hal.get_elapsed_ticks = core_get_elapsed_ticks;
+    hal.get_micros = core_get_micros;
+    hal.stream.write = core_stream_write;
+    hal.stream.get_tx_buffer_count = core_get_tx_buffer_count;
+    sys.override.feed_rate = sys.override.rapid_rate = DEFAULT_FEED_OVERRIDE;
+
+    core_ms = core_us = core_sent_count = core_wco_changes = 0;
+    core_state = STATE_IDLE;
+    core_tx_count = 0;
+    core_exec_flags = 0;
+    core_alarm = Alarm_None;
+    core_send_ok = true;
+    core_slave = NULL;
+    core_send = NULL;
+    core_realtime = NULL;
+    core_output_length = core_file_length = 0;
+    core_output[0] = '\0';
+    file.open = false;
+}
+
+bool modbus_send(modbus_message_t *msg, const modbus_callbacks_t *callbacks, bool block) {
+    core_sent = *msg;
+    core_sent_count++;
+
+    if (core_send) {
+        return core_send(msg, callbacks, block);
+    }
+
+    if (block && core_send_ok && core_slave) {
+        bool ok = core_slave(msg);
+
+        if (ok) {
+            callbacks->on_rx_packet(msg);
+        }
+        else {
+            callbacks->on_rx_exception(0, msg->context);
+        }
+
+        return ok;
+    }
+
+    return core_send_ok;
+}
+
+uint16_t modbus_read_u16(uint8_t *p) {
+    return (uint16_t)((p[0] << 8) | p[1]);
+}
+
+bool modbus_isup(void) {
+    return true;
+}
+
+bool modbus_isbusy(void) {
+    return false;
+}
+
+vfs_file_t *vfs_open(const char *filename, const char *mode) {
+    file.open = true;
+    core_file_length = 0;
+
+    return &file;
+}
+
+size_t vfs_write(const void *buffer, size_t size, size_t count, vfs_file_t *f) {
+    size_t length = size * count;
+
+    if (core_file_length + length > sizeof(core_file)) {
+        length = sizeof(core_file) - core_file_length;
+    }
+    memcpy(&core_file[core_file_length], buffer, length);
+    core_file_length += length;
+
+    return length;
+}
+
+void vfs_close(vfs_file_t *f) {
+    f->open = false;
+}
+
+bool protocol_enqueue_foreground_task(foreground_task_ptr fn, void *data) {
+    return true;
+}
+
+bool protocol_execute_realtime(void) {
+    if (core_realtime) {
+        core_realtime();
+    }
+
+    return true;
+}
+
+sys_state_t state_get(void) {
+    return core_state;
+}
+
+void system_raise_alarm(alarm_code_t alarm) {
+    core_alarm = alarm;
+}
+
+void system_set_exec_state_flag(uint32_t flag) {
+    core_exec_flags |= flag;
+}
+
+void system_flag_wco_change(void) {
+    core_wco_changes++;
+}
+
+void system_convert_array_steps_to_mpos(float *position, int32_t *steps) {
+    for (uint_fast8_t idx = 0; idx < N_AXIS; idx++) {
+        position[idx] = steps[idx] / 100.0f;
+    }
+}
+
+status_code_t report_message(const char *msg, message_type_t type) {
+    return Status_OK;
+}
+
+void report_warning(void *message) {
+}
+
+void plan_feed_override(uint_fast8_t feed_override, uint_fast8_t rapid_override) {
+    sys.override.feed_rate = feed_override;
+    sys.override.rapid_rate = rapid_override;
+}
+
+bool ioport_claim(io_port_type_t type, io_port_direction_t dir, uint8_t *port, const char *description) {
+    return false;
+}
+
+char *uitoa(uint32_t n) {
+    static char buf[12];
+
+    snprintf(buf, sizeof(buf), "%u", (unsigned)n);
+
+    return buf;
+}
+
+bool isintf(float value) {
+    return value == truncf(value);
+}
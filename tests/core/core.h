@@ -0,0 +1,37 @@
+/*
+
+core.h - state of the host stand-in of the grblHAL core, set and checked by the tests
+
+*/
+
+#ifndef _CORE_H_
+#define _CORE_H_
+
+#include "grbl/hal.h"
+#include "grbl/modbus.h"
+
+#define CORE_OUTPUT_SIZE 4096
+#define CORE_FILE_SIZE 8192
+
+extern uint32_t core_ms;                    // hal.get_elapsed_ticks()
+extern uint32_t core_us;                    // hal.get_micros()
+extern sys_state_t core_state;              // state_get()
+extern uint16_t core_tx_count;              // hal.stream.get_tx_buffer_count()
+extern uint32_t core_exec_flags;            // flags set by system_set_exec_state_flag()
+extern alarm_code_t core_alarm;             // last alarm raised
+extern uint32_t core_wco_changes;           // calls of system_flag_wco_change()
+extern bool core_send_ok;                   // return value of modbus_send()
+extern bool (*core_slave)(modbus_message_t *msg); // answers blocking messages in place when set, false for a timeout
+extern bool (*core_send)(modbus_message_t *msg, const modbus_callbacks_t *callbacks, bool block); // replaces modbus_send() when set, a simulated driver
+extern void (*core_realtime)(void);         // run by protocol_execute_realtime() when set, the realtime loop of a test
+extern modbus_message_t core_sent;          // last message passed to modbus_send()
+extern uint32_t core_sent_count;
+extern char core_output[CORE_OUTPUT_SIZE];  // hal.stream.write() output, truncated when full
+extern size_t core_output_length;
+extern uint8_t core_file[CORE_FILE_SIZE];   // data written to the file opened last
+extern size_t core_file_length;
+
+// Resets the stand-in and the HAL function pointers, the plugin state is not touched.
+void core_init (void);
+
+#endif
@@ -0,0 +1,31 @@
+/*
+
+driver.h - host stand-in for the grblHAL driver configuration, for the tests and benchmarks
+
+Only what modbus_io.c uses on the host is defined, see grbl/hal.h.
+
+*/
+
+#ifndef _DRIVER_H_
+#define _DRIVER_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <math.h>
+
+#define N_AXIS 3
+#define X_AXIS 0
+#define Y_AXIS 1
+#define Z_AXIS 2
+
+#ifndef MBIO_ENABLE
+#define MBIO_ENABLE 1
+#endif
+
+#ifndef SDCARD_ENABLE
+#define SDCARD_ENABLE 1
+#endif
+
+#endif
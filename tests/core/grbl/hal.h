@@ -0,0 +1,250 @@
+/*
+
+hal.h - host stand-in for the grblHAL core API used by the MODBUS I/O plugin
+
+Builds modbus_io.c on the host for the unit tests and benchmarks in tests/. Only the declarations
+the plugin uses are here, with the names, types and values of the core. The other core headers
+the plugin includes only include this one. The functions are implemented by core.c.
+
+*/
+
+#ifndef _HAL_H_
+#define _HAL_H_
+
+#include "../driver.h"
+
+#define ASCII_EOL "\r\n"
+
+#define Off 0
+#define On 1
+
+typedef uint_fast16_t sys_state_t;
+
+#define STATE_IDLE          0
+#define STATE_ALARM         (1 << 0)
+#define STATE_ESTOP         (1 << 1)
+#define STATE_CYCLE         (1 << 3)
+#define STATE_HOLD          (1 << 4)
+#define STATE_TOOL_CHANGE   (1 << 12)
+
+#define EXEC_CYCLE_START    (1 << 1)
+#define EXEC_FEED_HOLD      (1 << 3)
+
+#define DEFAULT_FEED_OVERRIDE   100
+#define MIN_FEED_RATE_OVERRIDE  10
+#define MAX_FEED_RATE_OVERRIDE  200
+
+typedef enum {
+    Status_OK = 0,
+    Status_BadNumberFormat = 2,
+    Status_InvalidStatement = 3,
+    Status_IdleError = 8,
+    Status_GcodeUnsupportedCommand = 20,
+    Status_GcodeValueWordMissing = 28,
+    Status_GcodeValueOutOfRange = 29,
+    Status_GcodeUnusedWords = 36,
+    Status_GCodeTimeout = 57,
+    Status_SDFailedOpenFile = 61,
+    Status_ExpressionInvalidResult = 70,
+    Status_Unhandled = 84
+} status_code_t;
+
+typedef enum {
+    Alarm_None = 0,
+    Alarm_AbortCycle = 3
+} alarm_code_t;
+
+typedef enum {
+    UserMCode_Ignore = 0,
+    UserMCode_Generic0 = 100,
+    UserMCode_Generic1 = 101,
+    UserMCode_Generic2 = 102,
+    UserMCode_Generic3 = 103,
+    UserMCode_Generic4 = 104,
+    OpenPNP_GetADCReading = 105,
+    Fan_On = 106,
+    Fan_Off = 107
+} user_mcode_t;
+
+typedef enum {
+    Message_Plain = 0,
+    Message_Info,
+    Message_Warning
+} message_type_t;
+
+typedef struct {
+    float d, e, f, h, p, q, r, s, l, o, t;
+    float ijk[3];
+    float xyz[N_AXIS];
+} gc_values_t;
+
+typedef struct {
+    uint32_t d :1, e :1, f :1, h :1, p :1, q :1, r :1, s :1, l :1, o :1, t :1, x :1, y :1, z :1;
+} parameter_words_t;
+
+typedef struct {
+    user_mcode_t user_mcode;
+    bool user_mcode_sync;
+    gc_values_t values;
+    parameter_words_t words;
+} parser_block_t;
+
+typedef enum {
+    ToolLengthOffset_Cancel = 0,
+    ToolLengthOffset_Enable = 1,
+    ToolLengthOffset_EnableDynamic = 2,
+    ToolLengthOffset_ApplyAdditional = 3
+} tool_offset_mode_t;
+
+typedef struct {
+    tool_offset_mode_t tool_offset_mode;
+} gc_modal_t;
+
+typedef struct {
+    gc_modal_t modal;
+    float tool_length_offset[N_AXIS];
+} parser_state_t;
+
+typedef user_mcode_t (*user_mcode_check_ptr)(user_mcode_t mcode);
+typedef status_code_t (*user_mcode_validate_ptr)(parser_block_t *gc_block, parameter_words_t *deprecated);
+typedef void (*user_mcode_execute_ptr)(sys_state_t state, parser_block_t *gc_block);
+
+typedef struct {
+    user_mcode_check_ptr check;
+    user_mcode_validate_ptr validate;
+    user_mcode_execute_ptr execute;
+} user_mcode_ptrs_t;
+
+typedef void (*stream_write_ptr)(const char *s);
+
+typedef union {
+    uint8_t value;
+    struct {
+        uint8_t flood :1,
+                mist  :1;
+    };
+} coolant_state_t;
+
+typedef coolant_state_t coolant_ptrs_cap_t;
+
+typedef void (*coolant_set_state_ptr)(coolant_state_t mode);
+typedef coolant_state_t (*coolant_get_state_ptr)(void);
+
+typedef enum {
+    IRQ_Mode_None = 0,
+    IRQ_Mode_Rising = 1,
+    IRQ_Mode_Falling = 2,
+    IRQ_Mode_Change = 3
+} pin_irq_mode_t;
+
+typedef enum {
+    Port_Analog = 0,
+    Port_Digital
+} io_port_type_t;
+
+typedef enum {
+    Port_Input = 0,
+    Port_Output
+} io_port_direction_t;
+
+typedef void (*ioport_interrupt_callback_ptr)(uint8_t port, bool state);
+
+typedef struct {
+    user_mcode_ptrs_t user_mcode;
+    struct {
+        stream_write_ptr write;
+        uint16_t (*get_tx_buffer_count)(void);
+    } stream;
+    struct {
+        coolant_set_state_ptr set_state;
+        coolant_get_state_ptr get_state;
+    } coolant;
+    coolant_ptrs_cap_t coolant_cap;
+    struct {
+        bool (*register_interrupt_handler)(uint8_t port, pin_irq_mode_t irq_mode, ioport_interrupt_callback_ptr interrupt_callback);
+    } port;
+    bool (*delay_ms)(uint32_t ms, void (*callback)(void));
+    uint32_t (*get_elapsed_ticks)(void);
+    uint32_t (*get_micros)(void);
+} hal_t;
+
+typedef void (*on_report_options_ptr)(bool newopt);
+typedef void (*on_execute_realtime_ptr)(sys_state_t state);
+typedef void (*on_reset_ptr)(void);
+
+typedef status_code_t (*sys_command_ptr)(sys_state_t state, char *args);
+
+typedef union {
+    uint8_t flags;
+    struct {
+        uint8_t noargs         :1,
+                allow_blocking :1,
+                help_fn        :1;
+    };
+} sys_command_flags_t;
+
+typedef union {
+    const char *str;
+    const char *(*fn)(const char *command);
+} sys_command_help_t;
+
+typedef struct {
+    const char *command;
+    sys_command_ptr execute;
+    sys_command_flags_t flags;
+    sys_command_help_t help;
+} sys_command_t;
+
+typedef struct sys_commands_str {
+    const uint8_t n_commands;
+    const sys_command_t *commands;
+    struct sys_commands_str *(*on_get_commands)(void);
+} sys_commands_t;
+
+typedef sys_commands_t *(*on_get_commands_ptr)(void);
+
+typedef struct {
+    on_report_options_ptr on_report_options;
+    on_execute_realtime_ptr on_execute_realtime;
+    on_execute_realtime_ptr on_execute_delay;
+    on_reset_ptr on_reset;
+    on_get_commands_ptr on_get_commands;
+} grbl_t;
+
+typedef struct {
+    uint8_t feed_rate;
+    uint8_t rapid_rate;
+} overrides_t;
+
+typedef struct {
+    bool abort;
+    bool cold_start;
+    int32_t var5399;
+    int32_t position[N_AXIS];
+    overrides_t override;
+} system_t;
+
+typedef void (*foreground_task_ptr)(void *data);
+
+extern hal_t hal;
+extern grbl_t grbl;
+extern system_t sys;
+extern parser_state_t gc_state;
+
+bool protocol_enqueue_foreground_task (foreground_task_ptr fn, void *data);
+bool protocol_execute_realtime (void);
+sys_state_t state_get (void);
+void system_raise_alarm (alarm_code_t alarm);
+void system_set_exec_state_flag (uint32_t flag);
+void system_flag_wco_change (void);
+void system_convert_array_steps_to_mpos (float *position, int32_t *steps);
+status_code_t report_message (const char *msg, message_type_t type);
+void report_warning (void *message);
+void plan_feed_override (uint_fast8_t feed_override, uint_fast8_t rapid_override);
+bool ioport_claim (io_port_type_t type, io_port_direction_t dir, uint8_t *port, const char *description);
+char *uitoa (uint32_t n);
+bool isintf (float value);
+
+#define isnanf(x) isnan(x)
+
+#endif
@@ -0,0 +1,48 @@
+/*
+
+modbus.h - host stand-in for the grblHAL MODBUS driver API, messages sent are recorded by core.c
+
+*/
+
+#ifndef _MODBUS_H_
+#define _MODBUS_H_
+
+#include "hal.h"
+
+#define MODBUS_MAX_ADU_SIZE 10
+
+#define MODBUS_SET_MSB16(x) ((x) >> 8)
+#define MODBUS_SET_LSB16(x) ((x) & 0xFF)
+
+typedef enum {
+    ModBus_ReadCoils = 1,
+    ModBus_ReadDiscreteInputs = 2,
+    ModBus_ReadHoldingRegisters = 3,
+    ModBus_ReadInputRegisters = 4,
+    ModBus_WriteCoil = 5,
+    ModBus_WriteRegister = 6,
+    ModBus_ReadExceptionStatus = 7,
+    ModBus_Diagnostics = 8,
+    ModBus_WriteCoils = 15,
+    ModBus_WriteRegisters = 16
+} modbus_function_t;
+
+typedef struct {
+    void *context;
+    uint8_t tx_length;
+    uint8_t rx_length;
+    bool crc_check;
+    char adu[MODBUS_MAX_ADU_SIZE];
+} modbus_message_t;
+
+typedef struct {
+    void (*on_rx_packet)(modbus_message_t *msg);
+    void (*on_rx_exception)(uint8_t code, void *context);
+} modbus_callbacks_t;
+
+bool modbus_send (modbus_message_t *msg, const modbus_callbacks_t *callbacks, bool block);
+uint16_t modbus_read_u16 (uint8_t *p);
+bool modbus_isup (void);
+bool modbus_isbusy (void);
+
+#endif
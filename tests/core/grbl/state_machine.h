@@ -0,0 +1,2 @@
+// host stand-in, all of the core API used by the plugin is in hal.h
+#include "hal.h"
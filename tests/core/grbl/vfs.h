@@ -0,0 +1,18 @@
+/*
+
+vfs.h - host stand-in for the grblHAL file system API, files are kept in memory by core.c
+
+*/
+
+#ifndef _VFS_H_
+#define _VFS_H_
+
+#include "hal.h"
+
+typedef struct vfs_file vfs_file_t;
+
+vfs_file_t *vfs_open (const char *filename, const char *mode);
+size_t vfs_write (const void *buffer, size_t size, size_t count, vfs_file_t *file);
+void vfs_close (vfs_file_t *file);
+
+#endif
@@ -0,0 +1,165 @@
+/*
+
+mbio_adapt_test.c - host unit tests of the adaptive feed override
+
+Copyright (c) 2024 Richard Toth
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+Usage: mbio_adapt_test
+
+Checks the claim of M100 against a chained plugin, the override control loop with its limits and
+that the override is only set while a job runs.
+
+*/
+
+#include "mbio_test.h"
+
+static unsigned chain_checks, chain_validates, chain_executes;
+
+static user_mcode_t chain_ignore(user_mcode_t mcode) {
+    chain_checks++;
+
+    return UserMCode_Ignore;
+}
+
+static user_mcode_t chain_claim(user_mcode_t mcode) {
+    chain_checks++;
+
+    return mcode;
+}
+
+static status_code_t chain_validate(parser_block_t *gc_block, parameter_words_t *deprecated) {
+    chain_validates++;
+
+    return Status_OK;
+}
+
+static void chain_execute(sys_state_t state, parser_block_t *gc_block) {
+    chain_executes++;
+}
+
+static void adapt_block(parser_block_t *block) {
+    memset(block, 0, sizeof(parser_block_t));
+    block->user_mcode = (user_mcode_t)MBIO_MCODE_ADAPT;
+    block->words.d = block->words.p = block->words.q = On;
+    block->values.d = 2.0f;
+    block->values.p = 1.0f;
+    block->values.q = 500.0f;
+}
+
+// Feeds a spindle load read to the plugin.
+static void adapt_load(uint16_t load) {
+    modbus_message_t msg = { .context = (void *)MBIO_Adapt, .adu = { 2, ModBus_ReadInputRegisters, 2, load >> 8, load & 0xFF }, .rx_length = 7 };
+
+    mbio_rx_packet(&msg);
+}
+
+static void test_adapt_claim(void) {
+    parser_block_t block;
+
+    // the chained check is asked once per block, validate and execute reuse the answer
+    setup();
+    chain_checks = chain_validates = chain_executes = 0;
+    user_mcode.check = chain_ignore;
+    user_mcode.validate = chain_validate;
+    user_mcode.execute = chain_execute;
+    CHECK(mbio_check(UserMCode_Generic1) == UserMCode_Generic1 && chain_checks == 0);
+    CHECK(mbio_check((user_mcode_t)MBIO_MCODE_ADAPT) == (user_mcode_t)MBIO_MCODE_ADAPT && chain_checks == 1);
+    adapt_block(&block);
+    CHECK(mbio_validate(&block, NULL) == Status_OK && !block.words.d && !block.words.q);
+    CHECK(block.values.e == (float)ModBus_ReadInputRegisters && block.values.r == MBIO_ADAPT_PERIOD / 1000.0f);
+    mbio_execute(STATE_IDLE, &block);
+    CHECK(chain_checks == 1 && chain_validates == 0 && chain_executes == 0);
+    CHECK(adapt.active && adapt.device_address == 2 && adapt.register_address == 0 && adapt.target == 500.0f && adapt.period == MBIO_ADAPT_PERIOD);
+
+    // a plugin earlier in the chain keeps the M-code
+    setup();
+    chain_checks = chain_validates = chain_executes = 0;
+    user_mcode.check = chain_claim;
+    user_mcode.validate = chain_validate;
+    user_mcode.execute = chain_execute;
+    CHECK(mbio_check((user_mcode_t)MBIO_MCODE_ADAPT) == (user_mcode_t)MBIO_MCODE_ADAPT && chain_checks == 1);
+    adapt_block(&block);
+    CHECK(mbio_validate(&block, NULL) == Status_OK && block.words.d);
+    mbio_execute(STATE_IDLE, &block);
+    CHECK(chain_checks == 1 && chain_validates == 1 && chain_executes == 1 && !adapt.active);
+
+    // without a chained plugin
+    setup();
+    CHECK(mbio_check((user_mcode_t)MBIO_MCODE_ADAPT) == (user_mcode_t)MBIO_MCODE_ADAPT);
+    adapt_block(&block);
+    block.values.e = (float)ModBus_ReadCoils;
+    block.words.e = On;
+    CHECK(mbio_validate(&block, NULL) == Status_GcodeValueOutOfRange);
+    adapt_block(&block);
+    block.words.d = block.words.p = block.words.q = Off;
+    CHECK(mbio_validate(&block, NULL) == Status_OK && block.values.q == 0.0f);
+}
+
+static void test_adapt_control(void) {
+    setup();
+    core_state = STATE_CYCLE;
+    mbio_adapt_start(2, ModBus_ReadInputRegisters, 0, 500.0f, 0.1f);
+    mbio_poll(core_state);
+    CHECK(adapt.busy && core_sent_count == 1 && core_sent.adu[0] == 2 && core_sent.adu[1] == ModBus_ReadInputRegisters);
+
+    // half the target load raises the override by half the gain, it is set from the poll and not from the callback
+    adapt_load(250);
+    CHECK(adapt.apply == 125 && sys.override.feed_rate == DEFAULT_FEED_OVERRIDE);
+    mbio_poll(core_state);
+    CHECK(adapt.apply == 0 && sys.override.feed_rate == 125);
+
+    // the next read is due a period after the last one
+    CHECK(core_sent_count == 1);
+    core_ms += 100;
+    mbio_poll(core_state);
+    CHECK(core_sent_count == 2);
+
+    // limited to MBIO_ADAPT_MAX, back to 100% once the filtered load shows the tool is not cutting
+    adapt_load(250);
+    CHECK(adapt.apply == MBIO_ADAPT_MAX);
+    adapt_load(0);
+    adapt_load(0);
+    CHECK(adapt.apply == MBIO_ADAPT_MAX);
+    adapt_load(0);
+    CHECK(adapt.apply == DEFAULT_FEED_OVERRIDE);
+
+    // and to MBIO_ADAPT_MIN
+    adapt.filtered = false;
+    adapt_load(5000);
+    CHECK(adapt.apply == MBIO_ADAPT_MIN);
+
+    // only while a job runs
+    mbio_poll(core_state);
+    CHECK(sys.override.feed_rate == MBIO_ADAPT_MIN);
+    core_state = STATE_IDLE;
+    adapt_load(250);
+    CHECK(adapt.apply == 0);
+    adapt.apply = 125;
+    mbio_poll(core_state);
+    CHECK(adapt.apply == 0 && sys.override.feed_rate == MBIO_ADAPT_MIN);
+
+    mbio_adapt_stop();
+    CHECK(!adapt.active && sys.override.feed_rate == DEFAULT_FEED_OVERRIDE);
+}
+
+int main(void) {
+    static const mbio_test_t tests[] = {
+        { "adapt_claim", test_adapt_claim },
+        { "adapt_control", test_adapt_control },
+    };
+
+    return mbio_test_run(tests, sizeof(tests) / sizeof(tests[0]));
+}
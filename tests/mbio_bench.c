@@ -0,0 +1,73 @@
+/*
+
+mbio_bench.c - host build of the MODBUS I/O plugin microbenchmarks
+
+Copyright (c) 2024 Richard Toth
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+Usage: mbio_bench [rounds]
+
+Runs $MBIOBENCH on the host the given number of times (5) and prints the [MBIOBENCH:...] lines in ns,
+mbio_perfcmp keeps the best round. The reference benchmark is a fixed CRC workload independent of the
+plugin, mbio_perfcmp -r scales the results with it to compare runs on hosts of different speed.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "core.h"
+#include "modbus_io.c"
+
+static volatile uint16_t reference_crc;
+
+static void bench_reference(void) {
+    static uint8_t data[64];
+    uint16_t crc = 0xFFFF;
+
+    for (uint_fast8_t idx = 0; idx < sizeof(data); idx++) {
+        crc ^= data[idx] = (uint8_t)idx;
+        for (uint_fast8_t bit = 0; bit < 8; bit++) {
+            crc = crc & 1 ? (crc >> 1) ^ 0xA001 : crc >> 1;
+        }
+    }
+
+    reference_crc = crc;
+}
+
+static void stream_write(const char *s) {
+    fputs(s, stdout);
+}
+
+int main(int argc, char **argv) {
+    long rounds = argc > 1 ? strtol(argv[1], NULL, 10) : 5;
+    mbio_bench_t reference = { "reference", mbio_bench_none, bench_reference };
+
+    core_init();
+    mbio_init();
+    hal.stream.write = stream_write;
+
+    for (long round = 0; round < rounds; round++) {
+        mbio_bench_run(&reference);
+        printf("[MBIOBENCH:%s,%u,%u,%u,%u,%s]\n", reference.name, MBIO_BENCH_ITERATIONS, (unsigned)reference.min,
+                (unsigned)(reference.sum / MBIO_BENCH_ITERATIONS), (unsigned)reference.max, MBIO_CYCLES_UNIT);
+
+        if (mbio_cmd_bench(STATE_IDLE, NULL) != Status_OK) {
+            return EXIT_FAILURE;
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,139 @@
+/*
+
+mbio_coolant_test.c - host unit tests of the coolant outputs on MODBUS coils
+
+Copyright (c) 2024 Richard Toth
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+Usage: mbio_coolant_test
+
+Built with MBIO_COOLANT_ENABLE and a mist coil. Checks that the driver outputs keep working, that the
+coils are written from the write-behind queue without waiting for the bus, that the state comes from
+the I/O image and that the coils are written again after a reset.
+
+*/
+
+#define MBIO_COOLANT_ENABLE 1
+#define MBIO_COOLANT_DEVICE 4
+#define MBIO_COOLANT_FLOOD 2
+#define MBIO_COOLANT_MIST 3
+
+#include "mbio_test.h"
+
+static coolant_state_t driver_state;
+static unsigned driver_calls;
+
+static void driver_set_state(coolant_state_t mode) {
+    driver_state = mode;
+    driver_calls++;
+}
+
+static coolant_state_t driver_get_state(void) {
+    return driver_state;
+}
+
+static void noop_reset(void) {
+}
+
+// Sends the waiting coil writes and acknowledges them.
+static void coolant_flush(void) {
+    for (mbio_poll(STATE_IDLE); write_behind.busy; mbio_poll(STATE_IDLE)) {
+        modbus_message_t msg = { .context = (void *)MBIO_WriteBehind, .rx_length = 8 };
+
+        memcpy(msg.adu, core_sent.adu, 6);
+        mbio_rx_packet(&msg);
+    }
+}
+
+static void coolant_setup(void) {
+    setup();
+    driver_state.value = 0;
+    driver_calls = 0;
+    hal.coolant.set_state = driver_set_state;
+    hal.coolant.get_state = driver_get_state;
+    on_reset = noop_reset;
+    mbio_coolant_init();
+}
+
+static void test_coolant_init(void) {
+    coolant_setup();
+    CHECK(hal.coolant.set_state == mbio_coolant_set_state && hal.coolant.get_state == mbio_coolant_get_state);
+    CHECK(hal.coolant_cap.flood && hal.coolant_cap.mist);
+
+    // the coils are read by the scan list and switched off at startup, without waiting for the bus
+    CHECK(scan.count == 2 && scan.points[0].users == MBIO_ScanCoolant && scan.points[0].register_address == 1 && scan.points[1].register_address == 2);
+    CHECK(core_sent_count == 0);
+    mbio_poll(STATE_IDLE);
+    CHECK(write_behind.busy && core_sent.adu[0] == 4 && core_sent.adu[1] == ModBus_WriteCoil && core_sent.adu[4] == 0);
+
+    // M104 without parameters keeps them
+    mbio_scan_remove(MBIO_ScanMcode);
+    CHECK(scan.count == 2);
+}
+
+static void test_coolant_set_state(void) {
+    coolant_setup();
+    coolant_flush();
+    uint32_t sent = core_sent_count;
+
+    // M8: the driver output and the flood coil, the mist coil is not written again
+    hal.coolant.set_state((coolant_state_t){ .flood = On });
+    CHECK(driver_calls == 1 && driver_state.flood && !driver_state.mist);
+    coolant_flush();
+    CHECK(core_sent_count == sent + 1 && core_sent.adu[3] == 1 && (uint8_t)core_sent.adu[4] == 0xFF);
+
+    // the state is the one of the driver or the coils, the coils from the I/O image written through
+    CHECK(hal.coolant.get_state().flood && !hal.coolant.get_state().mist && core_sent_count == sent + 1);
+    driver_state.value = 0;
+    CHECK(hal.coolant.get_state().flood);
+
+    // M7 and M9
+    hal.coolant.set_state((coolant_state_t){ .flood = On, .mist = On });
+    coolant_flush();
+    CHECK(core_sent_count == sent + 2 && core_sent.adu[3] == 2 && hal.coolant.get_state().mist);
+    hal.coolant.set_state((coolant_state_t){ 0 });
+    coolant_flush();
+    CHECK(core_sent_count == sent + 4 && hal.coolant.get_state().value == 0);
+
+    // a coil switched by something else shows once the scan, sent on the first poll, reads it
+    modbus_message_t msg = { .context = (void *)MBIO_Scan, .adu = { 4, ModBus_ReadCoils, 1, 0x02 }, .rx_length = 6 };
+
+    CHECK(scan.busy && requests[MBIO_Scan].device_address == 4 && requests[MBIO_Scan].function == ModBus_ReadCoils && requests[MBIO_Scan].value == 2);
+    mbio_rx_packet(&msg);
+    CHECK(!hal.coolant.get_state().flood && hal.coolant.get_state().mist);
+}
+
+static void test_coolant_reset(void) {
+    coolant_setup();
+    coolant_flush();
+
+    // the core switched the driver outputs off before the reset, the coils get the last state set
+    hal.coolant.set_state((coolant_state_t){ .flood = On });
+    CHECK(write_behind.points[0].dirty || write_behind.points[1].dirty);
+    mbio_reset();
+    uint32_t sent = core_sent_count;
+    coolant_flush();
+    CHECK(core_sent_count == sent + 2 && mbio_image_find(4, ModBus_ReadCoils, 1)->value == 1 && mbio_image_find(4, ModBus_ReadCoils, 2)->value == 0);
+}
+
+int main(void) {
+    static const mbio_test_t tests[] = {
+        { "coolant_init", test_coolant_init },
+        { "coolant_set_state", test_coolant_set_state },
+        { "coolant_reset", test_coolant_reset },
+    };
+
+    return mbio_test_run(tests, sizeof(tests) / sizeof(tests[0]));
+}
@@ -0,0 +1,210 @@
+/*
+
+mbio_image_test.c - host unit tests of the write-through to the I/O image
+
+Copyright (c) 2024 Richard Toth
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+Usage: mbio_image_test
+
+Checks that acknowledged writes go to the I/O image and answer M101 reads without a transfer, and
+that a device reading back something else than written loses the write-through.
+
+*/
+
+#include "mbio_test.h"
+
+#define SLAVE_DEVICES 4
+#define SLAVE_POINTS 16
+
+static struct {
+    uint16_t registers[SLAVE_DEVICES][SLAVE_POINTS];
+    bool coils[SLAVE_DEVICES][SLAVE_POINTS];
+    uint16_t offset[SLAVE_DEVICES];  // added to the registers written, a device scaling its values
+} slave;
+
+// Answers M101 like a device, a write is acknowledged by echoing the request.
+static bool slave_answer(modbus_message_t *msg) {
+    uint8_t device = msg->adu[0], function = msg->adu[1];
+    uint16_t address = modbus_read_u16((uint8_t *)&msg->adu[2]), value = modbus_read_u16((uint8_t *)&msg->adu[4]);
+
+    switch (function) {
+        case ModBus_ReadCoils:
+            msg->adu[2] = 1;
+            msg->adu[3] = 0;
+            for (uint_fast16_t idx = 0; idx < value && idx < 8; idx++) {
+                msg->adu[3] |= slave.coils[device][address + idx] << idx;
+            }
+            msg->rx_length = 6;
+            break;
+
+        case ModBus_ReadHoldingRegisters:
+            msg->adu[2] = 2;
+            msg->adu[3] = MODBUS_SET_MSB16(slave.registers[device][address]);
+            msg->adu[4] = MODBUS_SET_LSB16(slave.registers[device][address]);
+            msg->rx_length = 7;
+            break;
+
+        case ModBus_WriteCoil:
+            slave.coils[device][address] = value == 0xFF00;
+            msg->rx_length = 8;
+            break;
+
+        case ModBus_WriteRegister:
+            slave.registers[device][address] = value + slave.offset[device];
+            msg->rx_length = 8;
+            break;
+
+        default:
+            return false;
+    }
+
+    return true;
+}
+
+// Runs M101 D<device> E<function> P<address> [Q<value>] like the core does.
+static void m101(uint8_t device, uint8_t function, uint16_t address, int32_t value) {
+    parser_block_t block = { .user_mcode = UserMCode_Generic1 };
+
+    block.words.d = block.words.e = block.words.p = On;
+    block.words.q = value >= 0;
+    block.values.d = (float)device;
+    block.values.e = (float)function;
+    block.values.p = (float)address;
+    block.values.q = value >= 0 ? (float)value : 0.0f;
+    CHECK(mbio_validate(&block, NULL) == Status_OK);
+    mbio_execute(STATE_IDLE, &block);
+}
+
+static void image_setup(void) {
+    setup();
+    memset(&slave, 0, sizeof(slave));
+    core_slave = slave_answer;
+}
+
+static void test_image_write_through(void) {
+    image_setup();
+
+    // a register written is read from the image, the table is the one of the holding registers
+    m101(2, ModBus_WriteRegister, 10, 1234);
+    CHECK(core_sent_count == 1 && slave.registers[2][9] == 1234);
+    mbio_point_t *point = mbio_image_find(2, ModBus_ReadHoldingRegisters, 9);
+    CHECK(point && point->value == 1234 && point->written);
+    sys.var5399 = -1;
+    m101(2, ModBus_ReadHoldingRegisters, 10, -1);
+    CHECK(core_sent_count == 1 && sys.var5399 == 1234);
+
+    // a coil written is read from the image when one coil is read
+    m101(2, ModBus_WriteCoil, 1, 1);
+    CHECK(core_sent_count == 2 && slave.coils[2][0]);
+    sys.var5399 = -1;
+    m101(2, ModBus_ReadCoils, 1, 1);
+    CHECK(core_sent_count == 2 && sys.var5399 == 1);
+    m101(2, ModBus_ReadCoils, 1, 2);
+    CHECK(core_sent_count == 3);
+
+    // points not written and other devices are read from the bus
+    m101(2, ModBus_ReadHoldingRegisters, 11, -1);
+    m101(3, ModBus_ReadHoldingRegisters, 10, -1);
+    CHECK(core_sent_count == 5);
+
+    // once read back with the same value the point is known as read
+    slave.registers[2][9] = 1234;
+    modbus_message_t msg = { .context = (void *)MBIO_Scan, .adu = { 2, ModBus_ReadHoldingRegisters, 2, 0x04, 0xD2 }, .rx_length = 7 };
+
+    requests[MBIO_Scan] = (mbio_request_t){ .device_address = 2, .function = ModBus_ReadHoldingRegisters, .register_address = 9, .value = 1 };
+    scan.count = 1;
+    scan.points[0] = (mbio_scan_point_t){ .device_address = 2, .function = ModBus_ReadHoldingRegisters, .register_address = 9, .users = MBIO_ScanMcode };
+    mbio_rx_packet(&msg);
+    CHECK(!point->written && point->value == 1234 && !mbio_readback_differs(2));
+}
+
+static void test_image_acknowledge(void) {
+    modbus_message_t msg = { .context = (void *)MBIO_Command, .adu = { 2, ModBus_WriteRegister, 0, 9, 0x00, 0x2A }, .rx_length = 8 };
+
+    // only a complete acknowledgement is written through
+    setup();
+    mbio_ModBus_WriteRegister(2, 9, 42);
+    msg.rx_length = 7;
+    mbio_rx_packet(&msg);
+    CHECK(mbio_image_find(2, ModBus_ReadHoldingRegisters, 9) == NULL);
+    mbio_ModBus_WriteRegister(2, 9, 42);
+    msg.rx_length = 8;
+    mbio_rx_packet(&msg);
+    CHECK(mbio_image_find(2, ModBus_ReadHoldingRegisters, 9)->value == 42);
+
+    // a coil acknowledged off
+    mbio_ModBus_WriteCoil(2, 3, 0);
+    msg.adu[1] = ModBus_WriteCoil;
+    msg.adu[3] = 3;
+    msg.adu[5] = 0;
+    mbio_rx_packet(&msg);
+    CHECK(mbio_image_find(2, ModBus_ReadCoils, 3)->value == 0 && mbio_image_find(2, ModBus_ReadCoils, 3)->written);
+
+    // nor is an exception response
+    mbio_ModBus_WriteRegister(2, 10, 42);
+    msg.adu[1] = ModBus_WriteRegister | 0x80;
+    msg.adu[2] = 2;
+    msg.rx_length = 5;
+    mbio_rx_packet(&msg);
+    CHECK(mbio_image_find(2, ModBus_ReadHoldingRegisters, 10) == NULL);
+}
+
+static void test_image_readback_differs(void) {
+    image_setup();
+    slave.offset[3] = 1;
+
+    // a device storing something else than written, found when it is read back
+    m101(3, ModBus_WriteRegister, 1, 100);
+    m101(3, ModBus_WriteCoil, 2, 1);
+    m101(2, ModBus_WriteRegister, 1, 100);
+    CHECK(mbio_image_find(3, ModBus_ReadHoldingRegisters, 0)->written && mbio_image_find(3, ModBus_ReadCoils, 1)->written);
+
+    modbus_message_t msg;
+
+    mbio_encode_request(&msg, MBIO_Sample, 3, ModBus_ReadHoldingRegisters, 0, 1, 7);
+    mbio_modbus_send_command(msg, false);
+    msg.adu[2] = 2;
+    msg.adu[3] = 0;
+    msg.adu[4] = 101;
+    msg.rx_length = 7;
+    mbio_rx_packet(&msg);
+    CHECK(mbio_readback_differs(3) && !mbio_readback_differs(2));
+    CHECK(mbio_image_find(3, ModBus_ReadHoldingRegisters, 0)->value == 101);
+
+    // its points written before are read from the device again, the other devices keep the write-through
+    CHECK(!mbio_image_find(3, ModBus_ReadHoldingRegisters, 0)->written && !mbio_image_find(3, ModBus_ReadCoils, 1)->written);
+    CHECK(mbio_image_find(2, ModBus_ReadHoldingRegisters, 0)->written);
+    uint32_t sent = core_sent_count;
+    m101(3, ModBus_ReadCoils, 2, 1);
+    CHECK(core_sent_count == sent + 1);
+
+    // and new writes to it are not written through
+    m101(3, ModBus_WriteRegister, 1, 200);
+    CHECK(slave.registers[3][0] == 201 && mbio_image_find(3, ModBus_ReadHoldingRegisters, 0)->value == 101);
+    sys.var5399 = -1;
+    m101(3, ModBus_ReadHoldingRegisters, 1, -1);
+    CHECK(core_sent_count == sent + 3 && sys.var5399 == 201);
+}
+
+int main(void) {
+    static const mbio_test_t tests[] = {
+        { "image_write_through", test_image_write_through },
+        { "image_acknowledge", test_image_acknowledge },
+        { "image_readback", test_image_readback_differs },
+    };
+
+    return mbio_test_run(tests, sizeof(tests) / sizeof(tests[0]));
+}
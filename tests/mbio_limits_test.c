@@ -0,0 +1,111 @@
+/*
+
+mbio_limits_test.c - host unit tests of the point limits
+
+Copyright (c) 2024 Richard Toth
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+Usage: mbio_limits_test
+
+Checks the limit compiler, tripping and the hysteresis, the feed hold repeated on a resumed job and
+the scan points the limits add and remove.
+
+*/
+
+#include "mbio_test.h"
+
+static void test_limit_compile(void) {
+    setup();
+    CHECK(mbio_limit_compile("D2 E4 P2 H650 Y20 :HOLD") == Status_OK);
+    CHECK(limits.count == 1 && limits.limits[0].device_address == 2 && limits.limits[0].function == ModBus_ReadInputRegisters &&
+           limits.limits[0].register_address == 1 && limits.limits[0].low == 0 && limits.limits[0].high == 650 &&
+           limits.limits[0].hysteresis == 20 && limits.limits[0].action == Rule_Hold);
+    CHECK(mbio_limit_compile("D2E4P3L400:ALARM") == Status_OK);
+    CHECK(limits.limits[1].low == 400 && limits.limits[1].high == 65535 && limits.limits[1].action == Rule_Alarm);
+
+    // the points are read by the scan list
+    CHECK(scan.count == 2 && scan.frames == 1 && scan.points[0].users == MBIO_ScanLimit && scan.points[1].users == MBIO_ScanLimit);
+
+    CHECK(mbio_limit_compile("D2E4P2H650") == Status_InvalidStatement);
+    CHECK(mbio_limit_compile("D2E4P2H650:START") == Status_InvalidStatement);
+    CHECK(mbio_limit_compile("D2E5P2H650:HOLD") == Status_InvalidStatement);
+    CHECK(mbio_limit_compile("D2E4P2L651H650:HOLD") == Status_GcodeValueOutOfRange);
+    CHECK(mbio_limit_compile("D2E4P2L100H139Y20:HOLD") == Status_GcodeValueOutOfRange);
+    CHECK(mbio_limit_compile("D2E4P2L100H140Y20:HOLD") == Status_OK);
+
+    while (limits.count < MBIO_LIMIT_COUNT) {
+        CHECK(mbio_limit_compile("D3E4P1H10:HOLD") == Status_OK);
+    }
+    CHECK(mbio_limit_compile("D3E4P1H10:HOLD") == Status_GcodeValueOutOfRange);
+    CHECK(limits.count == MBIO_LIMIT_COUNT);
+}
+
+static void test_limit_hysteresis(void) {
+    setup();
+    CHECK(mbio_limit_compile("D2E4P2H650Y20:HOLD") == Status_OK);
+    CHECK(mbio_limit_compile("D2E4P3L400:ALARM") == Status_OK);
+
+    mbio_image_update(2, ModBus_ReadInputRegisters, 1, 650, false);
+    CHECK(!limits.limits[0].tripped && core_exec_flags == 0);
+    mbio_image_update(2, ModBus_ReadInputRegisters, 1, 651, false);
+    CHECK(limits.limits[0].tripped && limits.limits[0].trips == 1 && (core_exec_flags & EXEC_FEED_HOLD));
+
+    // inside the range but not by the hysteresis, held again only while a job runs
+    core_exec_flags = 0;
+    mbio_image_update(2, ModBus_ReadInputRegisters, 1, 631, false);
+    CHECK(limits.limits[0].tripped && core_exec_flags == 0);
+    core_state = STATE_CYCLE;
+    mbio_image_update(2, ModBus_ReadInputRegisters, 1, 631, false);
+    CHECK(limits.limits[0].tripped && limits.limits[0].trips == 1 && (core_exec_flags & EXEC_FEED_HOLD));
+
+    core_exec_flags = 0;
+    mbio_image_update(2, ModBus_ReadInputRegisters, 1, 630, false);
+    CHECK(!limits.limits[0].tripped && core_exec_flags == 0);
+    mbio_image_update(2, ModBus_ReadInputRegisters, 1, 700, false);
+    CHECK(limits.limits[0].trips == 2);
+
+    // the other limit and the values of other points are independent
+    mbio_image_update(2, ModBus_ReadHoldingRegisters, 2, 0, false);
+    CHECK(!limits.limits[1].tripped && core_alarm == 0);
+    mbio_image_update(2, ModBus_ReadInputRegisters, 2, 399, false);
+    CHECK(limits.limits[1].tripped && core_alarm == Alarm_AbortCycle);
+}
+
+static void test_limit_clear(void) {
+    char clear[] = "CLEAR";
+
+    // removing the limits removes the scan points no other feature uses
+    setup();
+    CHECK(mbio_scan_add(2, ModBus_ReadInputRegisters, 1, MBIO_ScanMcode));
+    CHECK(mbio_rule_compile("D2E4P5>100:HOLD") == Status_OK);
+    CHECK(mbio_limit_compile("D2E4P2H650:HOLD") == Status_OK);
+    CHECK(mbio_limit_compile("D2E4P3H650:HOLD") == Status_OK);
+    CHECK(mbio_limit_compile("D2E4P5H650:HOLD") == Status_OK);
+    CHECK(scan.count == 3);
+    CHECK(mbio_cmd_limit(0, clear) == Status_OK);
+    CHECK(limits.count == 0 && scan.count == 2 && scan.frames == 2);
+    CHECK(scan.points[0].register_address == 1 && scan.points[0].users == MBIO_ScanMcode);
+    CHECK(scan.points[1].register_address == 4 && scan.points[1].users == MBIO_ScanRule);
+}
+
+int main(void) {
+    static const mbio_test_t tests[] = {
+        { "limit_compile", test_limit_compile },
+        { "limit_hysteresis", test_limit_hysteresis },
+        { "limit_clear", test_limit_clear },
+    };
+
+    return mbio_test_run(tests, sizeof(tests) / sizeof(tests[0]));
+}
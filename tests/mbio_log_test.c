@@ -0,0 +1,152 @@
+/*
+
+mbio_log_test.c - host unit tests of the binary log
+
+Copyright (c) 2024 Richard Toth
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+Usage: mbio_log_test
+
+Checks the record format, the accounting of the records lost when the ring buffer is full and
+the file output.
+
+*/
+
+#include "mbio_test.h"
+
+static void test_log_records(void) {
+    setup();
+    mbio_log.active = true;
+    core_ms = 0x12345678;
+
+    // header: length, type, timestamp, then the payload, all little endian
+    mbio_request_t request = { .device_address = 7, .function = ModBus_ReadHoldingRegisters, .register_address = 0x1234, .value = 0xABCD, .tx_time = 1000 };
+    mbio_log_tx(MBIO_Scan, &request);
+    static const uint8_t tx[] = { 7, MBIO_LogTx, 0x78, 0x56, 0x34, 0x12, MBIO_Scan, 7, ModBus_ReadHoldingRegisters, 0x34, 0x12, 0xCD, 0xAB };
+    CHECK(mbio_log_used() == sizeof(tx) && !memcmp(mbio_log.data, tx, sizeof(tx)));
+
+    mbio_log.head = mbio_log.tail = 0;
+    core_us = 1000 + 0x010203;
+    mbio_log_rx(MBIO_Command, &request);
+    static const uint8_t rx[] = { 7, MBIO_LogRx, 0x78, 0x56, 0x34, 0x12, MBIO_Command, 7, ModBus_ReadHoldingRegisters, 0x03, 0x02, 0x01, 0x00 };
+    CHECK(mbio_log_used() == sizeof(rx) && !memcmp(mbio_log.data, rx, sizeof(rx)));
+
+    mbio_log.head = mbio_log.tail = 0;
+    requests[MBIO_Sample] = request;
+    mbio_log_error(MBIO_Sample, 2);
+    static const uint8_t error[] = { 4, MBIO_LogError, 0x78, 0x56, 0x34, 0x12, MBIO_Sample, 7, ModBus_ReadHoldingRegisters, 2 };
+    CHECK(mbio_log_used() == sizeof(error) && !memcmp(mbio_log.data, error, sizeof(error)));
+
+    mbio_log.head = mbio_log.tail = 0;
+    parser_block_t block = { .user_mcode = UserMCode_Generic1 };
+    block.values.d = 2.0f;
+    block.values.e = (float)ModBus_WriteCoil;
+    mbio_log_mcode(&block, 0x00A1B2C3, true);
+    static const uint8_t mcode[] = { 9, MBIO_LogMcode, 0x78, 0x56, 0x34, 0x12, 101, 0, 2, ModBus_WriteCoil, 1, 0xC3, 0xB2, 0xA1, 0x00 };
+    CHECK(mbio_log_used() == sizeof(mcode) && !memcmp(mbio_log.data, mcode, sizeof(mcode)));
+
+    mbio_log.head = mbio_log.tail = 0;
+    mbio_image_update(3, ModBus_WriteRegister, 0x0102, 0x0304, true);
+    static const uint8_t point[] = { 6, MBIO_LogPoint, 0x78, 0x56, 0x34, 0x12, 3, ModBus_ReadHoldingRegisters, 0x02, 0x01, 0x04, 0x03 };
+    CHECK(mbio_log_used() == sizeof(point) && !memcmp(mbio_log.data, point, sizeof(point)));
+
+    // nothing is recorded while logging is off
+    mbio_log.head = mbio_log.tail = 0;
+    mbio_log.active = false;
+    mbio_log_tx(MBIO_Scan, &request);
+    CHECK(mbio_log_used() == 0);
+}
+
+static void test_log_lost(void) {
+    mbio_request_t request = { .device_address = 1 };
+
+    setup();
+    mbio_log.active = true;
+
+    // a record fits exactly
+    mbio_log.head = MBIO_LOG_BUFFER - 1 - (MBIO_LOG_HEADER + 7);
+    mbio_log_tx(MBIO_Command, &request);
+    CHECK(mbio_log_used() == MBIO_LOG_BUFFER - 1 && mbio_log.lost == 0);
+    mbio_log_tx(MBIO_Command, &request);
+    CHECK(mbio_log.lost == 1);
+
+    // once records were lost a record is only written when the count fits along with it
+    uint_fast16_t reserve = (MBIO_LOG_HEADER + 2) * 2 + 7;
+
+    mbio_log.head = MBIO_LOG_BUFFER - reserve;
+    mbio_log_tx(MBIO_Command, &request);
+    CHECK(mbio_log.lost == 2);
+    mbio_log.head = MBIO_LOG_BUFFER - 1 - reserve;
+    mbio_log_tx(MBIO_Command, &request);
+    CHECK(mbio_log.lost == 0 && mbio_log_used() == MBIO_LOG_BUFFER - 1 - reserve + (MBIO_LOG_HEADER + 2) + (MBIO_LOG_HEADER + 7));
+
+    uint8_t *lost = &mbio_log.data[MBIO_LOG_BUFFER - 1 - reserve];
+    CHECK(lost[0] == 2 && lost[1] == MBIO_LogLost && lost[6] == 2 && lost[7] == 0);
+    CHECK(lost[8] == 7 && lost[9] == MBIO_LogTx);
+}
+
+static void test_log_lost_saturates(void) {
+    mbio_request_t request = { .device_address = 1 };
+
+    setup();
+    mbio_log.active = true;
+
+    // the count stays at its maximum when the buffer is full, with or without records lost before
+    mbio_log.head = MBIO_LOG_BUFFER - 1;
+    mbio_log.lost = UINT16_MAX - 1;
+    mbio_log_tx(MBIO_Command, &request);
+    CHECK(mbio_log.lost == UINT16_MAX);
+    mbio_log_tx(MBIO_Command, &request);
+    CHECK(mbio_log.lost == UINT16_MAX);
+
+    // the record with the count is written before the next record that fits
+    mbio_log.head = mbio_log.tail = 0;
+    mbio_log_tx(MBIO_Command, &request);
+    CHECK(mbio_log.lost == 0 && mbio_log.data[1] == MBIO_LogLost && mbio_log.data[6] == 0xFF && mbio_log.data[7] == 0xFF);
+}
+
+static void test_log_file(void) {
+    mbio_request_t request = { .device_address = 9, .function = ModBus_WriteCoil, .register_address = 1, .value = 0xFF00 };
+
+    setup();
+    core_ms = 0x01020304;
+    CHECK(mbio_log_start("mbio.log") == Status_OK);
+    while (mbio_log_used()) {
+        mbio_log_flush(true);
+    }
+
+    static const uint8_t start[] = { 5, MBIO_LogStart, 0x04, 0x03, 0x02, 0x01, 'M', 'B', 'I', 'O', MBIO_LOG_VERSION };
+    CHECK(core_file_length == sizeof(start) && !memcmp(core_file, start, sizeof(start)));
+
+    // a record across the end of the ring buffer is written in order
+    mbio_log.head = mbio_log.tail = MBIO_LOG_BUFFER - 3;
+    mbio_log_tx(MBIO_Command, &request);
+    mbio_log_stop();
+
+    static const uint8_t tx[] = { 7, MBIO_LogTx, 0x04, 0x03, 0x02, 0x01, MBIO_Command, 9, ModBus_WriteCoil, 1, 0, 0x00, 0xFF };
+    CHECK(core_file_length == sizeof(start) + sizeof(tx) && !memcmp(&core_file[sizeof(start)], tx, sizeof(tx)));
+    CHECK(mbio_log.file == NULL && !mbio_log.active);
+}
+
+int main(void) {
+    static const mbio_test_t tests[] = {
+        { "log_records", test_log_records },
+        { "log_lost", test_log_lost },
+        { "log_lost_saturates", test_log_lost_saturates },
+        { "log_file", test_log_file },
+    };
+
+    return mbio_test_run(tests, sizeof(tests) / sizeof(tests[0]));
+}
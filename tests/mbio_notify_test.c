@@ -0,0 +1,154 @@
+/*
+
+mbio_notify_test.c - host unit tests of the M102 wait on inputs read on change notifications
+
+Copyright (c) 2024 Richard Toth
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+Usage: mbio_notify_test
+
+Checks that the wait only accepts inputs read after it started, and that a timeout shorter than the
+round trip, R0 included, still waits for that read.
+
+*/
+
+#define MBIO_NOTIFY_ENABLE 1
+
+#include "mbio_test.h"
+
+#define ROUND_TRIP 20 // ms from sending a change read to its response
+#define STEP 5        // ms per pass of the realtime loop
+
+static struct {
+    uint8_t inputs;  // discrete inputs of the notify device
+    bool answer;     // false to let the reads time out
+    bool in_flight;
+    uint32_t sent_at;
+} slave;
+
+// The realtime loop: polls the plugin and answers its change read after the round trip.
+static void realtime(void) {
+    core_ms += STEP;
+
+    if (!slave.in_flight) {
+        uint32_t count = core_sent_count;
+
+        mbio_poll(STATE_IDLE);
+        if ((slave.in_flight = core_sent_count != count && (mbio_response_t)core_sent.context == MBIO_Notify)) {
+            slave.sent_at = core_ms;
+        }
+    }
+    else if (core_ms - slave.sent_at >= ROUND_TRIP) {
+        modbus_message_t msg = core_sent;
+
+        slave.in_flight = false;
+        if (slave.answer) {
+            msg.adu[2] = 1;
+            msg.adu[3] = slave.inputs;
+            msg.rx_length = 6;
+            mbio_rx_packet(&msg);
+        }
+        else {
+            mbio_rx_exception(0, msg.context);
+        }
+    }
+}
+
+// Inputs in the image from an earlier read, the notify device answering with its current inputs.
+static void notify_setup(uint8_t image_inputs, uint8_t inputs) {
+    setup();
+    memset(&slave, 0, sizeof(slave));
+    notify.enabled = true;
+    notify.sent = notify.read = notify.done = 1;
+    for (uint_fast8_t idx = 0; idx < MBIO_NOTIFY_COUNT; idx++) {
+        mbio_image_update(MBIO_NOTIFY_DEVICE, ModBus_ReadDiscreteInputs, MBIO_NOTIFY_ADDRESS - 1 + idx, (image_inputs >> idx) & 0x01, false);
+    }
+    slave.inputs = inputs;
+    slave.answer = true;
+    core_realtime = realtime;
+}
+
+static void test_wait_r0(void) {
+    notify_setup(0x00, 0x01);
+
+    CHECK(mbio_Wait_ReadDiscreteInputs(MBIO_NOTIFY_DEVICE, MBIO_NOTIFY_ADDRESS - 1, 1, 0.0f) == 1);
+    CHECK(core_sent_count == 1);
+    CHECK(core_ms >= ROUND_TRIP);
+    CHECK(sys.var5399 == 1);
+}
+
+static void test_wait_short(void) {
+    notify_setup(0x00, 0x02);
+
+    CHECK(mbio_Wait_ReadDiscreteInputs(MBIO_NOTIFY_DEVICE, MBIO_NOTIFY_ADDRESS, 1, ROUND_TRIP / 2000.0f) == 1);
+    CHECK(core_sent_count == 1);
+}
+
+static void test_wait_stale(void) {
+    // the image says 1 but the device reads 0, the value from before the block does not count
+    notify_setup(0x01, 0x00);
+
+    CHECK(mbio_Wait_ReadDiscreteInputs(MBIO_NOTIFY_DEVICE, MBIO_NOTIFY_ADDRESS - 1, 1, 0.0f) == -1);
+    CHECK(core_sent_count == 1);
+    CHECK(core_ms >= ROUND_TRIP);
+}
+
+static void test_wait_timeout(void) {
+    notify_setup(0x00, 0x00);
+
+    CHECK(mbio_Wait_ReadDiscreteInputs(MBIO_NOTIFY_DEVICE, MBIO_NOTIFY_ADDRESS - 1, 1, 0.1f) == -1);
+    CHECK(core_ms >= 100);
+    CHECK(core_ms < 100 + ROUND_TRIP + 2 * STEP);
+    CHECK(core_sent_count >= 1);
+}
+
+static void test_wait_change(void) {
+    // the input changes while waiting, the change read picks it up
+    notify_setup(0x00, 0x00);
+    slave.inputs = 0x00;
+
+    core_realtime = NULL;
+    notify.changed = false;
+    notify.next_poll = core_ms + MBIO_NOTIFY_POLL;
+    mbio_poll(STATE_IDLE);
+    CHECK(core_sent_count == 0);
+
+    slave.inputs = 0x04;
+    core_realtime = realtime;
+    CHECK(mbio_Wait_ReadDiscreteInputs(MBIO_NOTIFY_DEVICE, MBIO_NOTIFY_ADDRESS + 1, 1, 1.0f) == 1);
+}
+
+static void test_wait_failed(void) {
+    // the read fails, R0 gives up after it instead of waiting forever
+    notify_setup(0x01, 0x01);
+    slave.answer = false;
+
+    CHECK(mbio_Wait_ReadDiscreteInputs(MBIO_NOTIFY_DEVICE, MBIO_NOTIFY_ADDRESS - 1, 1, 0.0f) == -1);
+    CHECK(core_sent_count == 1);
+    CHECK(!notify.busy && notify.changed);
+}
+
+int main(void) {
+    static const mbio_test_t tests[] = {
+        { "wait_r0", test_wait_r0 },
+        { "wait_short", test_wait_short },
+        { "wait_stale", test_wait_stale },
+        { "wait_timeout", test_wait_timeout },
+        { "wait_change", test_wait_change },
+        { "wait_failed", test_wait_failed },
+    };
+
+    return mbio_test_run(tests, sizeof(tests) / sizeof(tests[0]));
+}
@@ -0,0 +1,58 @@
+# Performance regression gate, run by the mbio_perf target and test:
+#   cmake -DMBIO_BENCH=<mbio_bench> -DMBIO_SIM=<mbio_sim> -DMBIO_PERFCMP=<mbio_perfcmp> -DBASELINE_DIR=<dir>
+#         -DOUTPUT_DIR=<dir> -DTHRESHOLD=<%> -DSIM_THRESHOLD=<%> [-DPARTS=bench|sim] [-DUPDATE=ON] -P mbio_perf.cmake
+#
+# The host microbenchmarks are scaled by their reference benchmark and compared on the average of the
+# best of five rounds. The simulated scenarios run in virtual time, they are deterministic and also
+# compared on the worst case. PARTS limits the run to the benchmarks or the simulations, both run by
+# default. With UPDATE the results replace the baseline.
+
+cmake_policy(SET CMP0057 NEW)
+
+if(NOT PARTS)
+  set(PARTS bench sim)
+endif()
+
+set(SIM_SWEEP -b 19200,115200 -d 1,4 -p 20 -a 10 -m 500 -e 0.001 -t 60 -c)
+set(SIM_MODES -M -b 19200,115200 -p 20 -c)
+
+if(bench IN_LIST PARTS)
+  execute_process(COMMAND ${MBIO_BENCH} 5 OUTPUT_VARIABLE bench RESULT_VARIABLE status)
+  if(status)
+    message(FATAL_ERROR "mbio_bench failed: ${status}")
+  endif()
+  string(REPLACE "\r" "" bench "${bench}")
+  file(WRITE ${OUTPUT_DIR}/bench.txt "${bench}")
+  list(APPEND results bench.txt)
+endif()
+
+if(sim IN_LIST PARTS)
+  execute_process(COMMAND ${MBIO_SIM} ${SIM_SWEEP} OUTPUT_VARIABLE sweep ERROR_QUIET RESULT_VARIABLE status)
+  if(status)
+    message(FATAL_ERROR "mbio_sim ${SIM_SWEEP} failed: ${status}")
+  endif()
+  execute_process(COMMAND ${MBIO_SIM} ${SIM_MODES} OUTPUT_VARIABLE modes RESULT_VARIABLE status)
+  if(status)
+    message(FATAL_ERROR "mbio_sim ${SIM_MODES} failed: ${status}")
+  endif()
+  file(WRITE ${OUTPUT_DIR}/sim.txt "${sweep}${modes}")
+  list(APPEND results sim.txt)
+endif()
+
+if(UPDATE)
+  list(TRANSFORM results PREPEND ${OUTPUT_DIR}/)
+  file(COPY ${results} DESTINATION ${BASELINE_DIR})
+  message(STATUS "baseline in ${BASELINE_DIR} updated")
+  return()
+endif()
+
+if(bench IN_LIST PARTS)
+  execute_process(COMMAND ${MBIO_PERFCMP} -r reference -t ${THRESHOLD} ${BASELINE_DIR}/bench.txt ${OUTPUT_DIR}/bench.txt RESULT_VARIABLE bench_status)
+endif()
+if(sim IN_LIST PARTS)
+  execute_process(COMMAND ${MBIO_PERFCMP} -t ${SIM_THRESHOLD} -m ${SIM_THRESHOLD} ${BASELINE_DIR}/sim.txt ${OUTPUT_DIR}/sim.txt RESULT_VARIABLE sim_status)
+endif()
+
+if(bench_status OR sim_status)
+  message(FATAL_ERROR "performance regressed against the baseline in ${BASELINE_DIR}")
+endif()
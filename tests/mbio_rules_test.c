@@ -0,0 +1,254 @@
+/*
+
+mbio_rules_test.c - host unit tests of the interlock rules
+
+Copyright (c) 2024 Richard Toth
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+Usage: mbio_rules_test
+
+Checks the rule compiler and evaluator with the bounds of the rule table and the scan points of the
+conditions.
+
+*/
+
+#include "mbio_test.h"
+
+static bool rule_is(const char *source) {
+    char text[100];
+
+    mbio_rule_text(text, rules.code);
+
+    return !strcmp(text, source);
+}
+
+static void test_rule_compile(void) {
+    setup();
+
+    CHECK(mbio_rule_compile("D2 E2 P3 = 0 : HOLD") == Status_OK);
+    static const uint8_t hold[] = { Rule_Begin, 10, Rule_Equal, 2, ModBus_ReadDiscreteInputs, 0, 2, 0, 0, Rule_Hold, Rule_End };
+    CHECK(!memcmp(rules.code, hold, sizeof(hold)));
+    CHECK(rules.count == 1 && rules.length == 10);
+    CHECK(rule_is("D2E2P3=0:HOLD"));
+
+    setup();
+    CHECK(mbio_rule_compile("D1E1P1R:D3E5P10Q1") == Status_OK);
+    static const uint8_t write[] = { Rule_Begin, 16, Rule_Rise, 1, ModBus_ReadCoils, 0, 0, 0, 0, Rule_Write, 3, ModBus_WriteCoil, 0, 9, 0xFF, 0x00, Rule_End };
+    CHECK(!memcmp(rules.code, write, sizeof(write)));
+    CHECK(rule_is("D1E1P1R:D3E5P10Q1"));
+
+    setup();
+    CHECK(mbio_rule_compile("D1E4P2>500&D1E3P3!=7&D0E2P9999F:D247E6P1Q65535") == Status_OK);
+    CHECK(rule_is("D1E4P2>500&D1E3P3!=7&D0E2P9999F:D247E6P1Q65535"));
+    CHECK(rules.code[1] == 2 + 4 * (1 + MBIO_RULE_OPERANDS));
+
+    setup();
+    CHECK(mbio_rule_compile("D1E4P1<0:START") == Status_OK);
+    CHECK(mbio_rule_compile("D1E4P1=65535:ALARM") == Status_OK);
+    CHECK(rules.count == 2);
+}
+
+static void test_rule_invalid(void) {
+    static const char *const invalid[] = {
+        "",
+        ":HOLD",
+        "D248E2P1=0:HOLD",          // device
+        "D1E2P0=0:HOLD",            // address
+        "D1E2P10000=0:HOLD",
+        "D1E0P1=0:HOLD",            // condition on a write function code
+        "D1E5P1=0:HOLD",
+        "D1E2P1=65536:HOLD",        // value
+        "D1E2P1=:HOLD",
+        "D1E2P1!0:HOLD",
+        "D1E2P1:HOLD",              // no comparison
+        "D1E2P1=0",                 // no action
+        "D1E2P1=0:",
+        "D1E2P1=0&:HOLD",
+        "D1E2P1=0:STOP",
+        "D1E2P1=0:HOLDX",
+        "D1E2P1=0:D1E3P1Q1",        // write with a read function code
+        "D1E2P1=0:D1E5P1",
+        "D1E2P1=0:D1E5P1Q",
+        "D1E2P1=0:D1E5P1Q1X",
+        "D1E2P1=0:D1E6P1Q65536",
+        "P1D1E2=0:HOLD",
+    };
+
+    setup();
+
+    for (size_t idx = 0; idx < sizeof(invalid) / sizeof(invalid[0]); idx++) {
+        if (mbio_rule_compile(invalid[idx]) != Status_InvalidStatement) {
+            fprintf(stderr, "rule accepted: %s\n", invalid[idx]);
+            CHECK(false);
+        }
+    }
+
+    CHECK(rules.count == 0 && rules.length == 0 && rules.code[0] == Rule_End);
+}
+
+static void test_rule_bounds(void) {
+    char source[200];
+
+    // at most four conditions and a write fit into MBIO_RULE_LENGTH
+    setup();
+    CHECK(mbio_rule_compile("D1E2P1=1&D1E2P2=1&D1E2P3=1&D1E2P4=1:D1E5P1Q1") == Status_OK);
+    CHECK(rules.code[1] == MBIO_RULE_LENGTH);
+    CHECK(mbio_rule_compile("D1E2P1=1&D1E2P2=1&D1E2P3=1&D1E2P4=1&D1E2P5=1:HOLD") == Status_InvalidStatement);
+    CHECK(mbio_rule_compile("D1E2P1=1&D1E2P2=1&D1E2P3=1&D1E2P4=1&D1E2P5=1:D1E5P1Q1") == Status_InvalidStatement);
+    CHECK(rules.count == 1);
+
+    // the source is limited to 79 characters without spaces
+    setup();
+    memset(source, ' ', 120);
+    strcpy(&source[120], "D1E2P1=0:HOLD");
+    CHECK(mbio_rule_compile(source) == Status_OK);
+    strcpy(source, "D100E4P1000<10000&D100E4P1001<10000&D100E4P1002<10000&D100E4P1003<10000:D1E6P1Q");
+    CHECK(strlen(source) == 79 && mbio_rule_compile(source) == Status_InvalidStatement);
+    strcpy(source, "D100E4P1000<10000&D100E4P1001<10000&D100E4P1002<10000&D100E4P1003<1000:D1E6P1Q1");
+    CHECK(strlen(source) == 79 && mbio_rule_compile(source) == Status_OK);
+    strcat(source, "0");
+    CHECK(mbio_rule_compile(source) == Status_InvalidStatement);
+
+    // MBIO_RULE_COUNT rules
+    setup();
+    for (uint_fast8_t idx = 0; idx < MBIO_RULE_COUNT; idx++) {
+        snprintf(source, sizeof(source), "D1E2P%u=1:HOLD", (unsigned)idx + 1);
+        CHECK(mbio_rule_compile(source) == Status_OK);
+    }
+    CHECK(mbio_rule_compile("D1E2P99=1:HOLD") == Status_InvalidStatement);
+    CHECK(rules.count == MBIO_RULE_COUNT);
+
+    // MBIO_RULE_CODE bytes with a byte kept for Rule_End, filled with rules of 37, 16 and 17 bytes
+    _Static_assert(MBIO_RULE_CODE == 256, "the table is filled for the default size");
+
+    setup();
+    for (uint_fast8_t idx = 0; idx < 6; idx++) {
+        CHECK(mbio_rule_compile("D1E2P1=1&D1E2P2=1&D1E2P3=1&D1E2P4=1:D1E5P1Q1") == Status_OK);
+    }
+    CHECK(rules.length == 222);
+    CHECK(mbio_rule_compile("D1E2P1=1&D1E2P2=1&D1E2P3=1&D1E2P4=1:D1E5P1Q1") == Status_InvalidStatement);
+    CHECK(mbio_rule_compile("D1E2P1=1:D1E5P1Q1") == Status_OK);
+    CHECK(mbio_rule_compile("D1E2P1=1&D1E2P2=1:HOLD") == Status_OK);
+    CHECK(rules.length == MBIO_RULE_CODE - 1 && rules.code[MBIO_RULE_CODE - 1] == Rule_End);
+    CHECK(mbio_rule_compile("D1E2P1=1:HOLD") == Status_InvalidStatement);
+
+    // a rule ending exactly at the end of the table leaves no room for Rule_End
+    setup();
+    for (uint_fast8_t idx = 0; idx < 6; idx++) {
+        CHECK(mbio_rule_compile("D1E2P1=1&D1E2P2=1&D1E2P3=1&D1E2P4=1:D1E5P1Q1") == Status_OK);
+    }
+    CHECK(mbio_rule_compile("D1E2P1=1&D1E2P2=1&D1E2P3=1:HOLD") == Status_OK);
+    CHECK(rules.length == 246);
+    CHECK(mbio_rule_compile("D1E2P1=1:HOLD") == Status_InvalidStatement);
+    CHECK(rules.length == 246 && rules.code[246] == Rule_End);
+}
+
+static void test_rule_eval(void) {
+    // a level rule fires when its conditions become met, again only after they ended
+    setup();
+    CHECK(mbio_rule_compile("D2E2P3=1:HOLD") == Status_OK);
+    mbio_image_update(2, ModBus_ReadDiscreteInputs, 2, 1, false);
+    CHECK(rules.fired[0] == 1 && (core_exec_flags & EXEC_FEED_HOLD));
+    core_exec_flags = 0;
+    mbio_image_update(2, ModBus_ReadDiscreteInputs, 2, 1, false);
+    mbio_image_update(2, ModBus_ReadDiscreteInputs, 3, 1, false);
+    CHECK(rules.fired[0] == 1 && core_exec_flags == 0);
+    mbio_image_update(2, ModBus_ReadDiscreteInputs, 2, 0, false);
+    CHECK(rules.fired[0] == 1 && !rules.active[0]);
+    mbio_image_update(2, ModBus_ReadDiscreteInputs, 2, 1, false);
+    CHECK(rules.fired[0] == 2);
+
+    // edges fire on changes of a known point only
+    setup();
+    CHECK(mbio_rule_compile("D2E2P3R:START") == Status_OK);
+    CHECK(mbio_rule_compile("D2E2P3F:ALARM") == Status_OK);
+    mbio_image_update(2, ModBus_ReadDiscreteInputs, 2, 1, false);
+    CHECK(rules.fired[0] == 0 && rules.fired[1] == 0);
+    mbio_image_update(2, ModBus_ReadDiscreteInputs, 2, 0, false);
+    CHECK(rules.fired[0] == 0 && rules.fired[1] == 1 && core_alarm == Alarm_AbortCycle);
+    mbio_image_update(2, ModBus_ReadDiscreteInputs, 2, 1, false);
+    CHECK(rules.fired[0] == 1 && (core_exec_flags & EXEC_CYCLE_START));
+
+    // comparisons at their bounds, registers written and read share a table
+    setup();
+    CHECK(mbio_rule_compile("D1E3P1<10:HOLD") == Status_OK);
+    CHECK(mbio_rule_compile("D1E3P1>65534:START") == Status_OK);
+    CHECK(mbio_rule_compile("D1E3P1!=5:ALARM") == Status_OK);
+    mbio_image_update(1, ModBus_WriteRegister, 0, 10, true);
+    CHECK(rules.fired[0] == 0 && rules.fired[1] == 0 && rules.fired[2] == 1);
+    mbio_image_update(1, ModBus_ReadHoldingRegisters, 0, 5, false);
+    CHECK(rules.fired[0] == 1 && rules.fired[1] == 0 && rules.fired[2] == 1);
+    mbio_image_update(1, ModBus_ReadHoldingRegisters, 0, 65535, false);
+    CHECK(rules.fired[0] == 1 && rules.fired[1] == 1 && rules.fired[2] == 2);
+
+    // all conditions have to be met, a point not in the image is not, evaluation goes on with the next rule
+    setup();
+    CHECK(mbio_rule_compile("D2E4P9>100&D2E2P3=1:HOLD") == Status_OK);
+    CHECK(mbio_rule_compile("D2E2P3=1&D2E4P1>100:D3E5P1Q1") == Status_OK);
+    mbio_image_update(2, ModBus_ReadDiscreteInputs, 2, 1, false);
+    CHECK(rules.fired[0] == 0 && rules.fired[1] == 0);
+    mbio_image_update(2, ModBus_ReadInputRegisters, 0, 101, false);
+    CHECK(rules.fired[0] == 0 && rules.fired[1] == 1);
+
+    mbio_deferred_t *point = &write_behind.points[0];
+    CHECK(point->used && point->dirty && point->device_address == 3 && point->function == ModBus_WriteCoil);
+    CHECK(point->register_address == 0 && point->value == 0xFF00);
+}
+
+static void test_rule_scan(void) {
+    char clear[] = "CLEAR";
+
+    // the condition points are added to the scan list, a rule on a point nothing else reads fires
+    setup();
+    CHECK(mbio_rule_compile("D2E2P3=0:HOLD") == Status_OK);
+    CHECK(scan.count == 1 && scan.frames == 1 && scan.points[0].device_address == 2 && scan.points[0].function == ModBus_ReadDiscreteInputs &&
+           scan.points[0].register_address == 2 && scan.points[0].users == MBIO_ScanRule);
+
+    modbus_message_t msg = { .context = (void *)MBIO_Scan, .adu = { 2, ModBus_ReadDiscreteInputs, 1, 0x00 }, .rx_length = 6 };
+
+    mbio_scan_request();
+    CHECK(core_sent.adu[0] == 2 && core_sent.adu[1] == ModBus_ReadDiscreteInputs && core_sent.adu[3] == 2);
+    mbio_rx_packet(&msg);
+    CHECK(rules.fired[0] == 1 && (core_exec_flags & EXEC_FEED_HOLD));
+
+    // points shared with M104 or used twice are added once and stay with M104 when the rules are removed
+    CHECK(mbio_scan_add(2, ModBus_ReadInputRegisters, 0, MBIO_ScanMcode));
+    CHECK(mbio_rule_compile("D2E4P1>100&D2E4P2<5&D2E4P2>1:ALARM") == Status_OK);
+    CHECK(scan.count == 3 && scan.points[1].users == (MBIO_ScanMcode | MBIO_ScanRule) && scan.points[2].users == MBIO_ScanRule);
+    CHECK(mbio_cmd_rule(0, clear) == Status_OK);
+    CHECK(rules.count == 0 && scan.count == 1 && scan.points[0].users == MBIO_ScanMcode && scan.points[0].register_address == 0);
+
+    // a rule is not added when the scan list has no room for its points
+    setup();
+    for (uint_fast8_t idx = 0; idx < MBIO_SCAN_POINTS - 1; idx++) {
+        CHECK(mbio_scan_add(1, ModBus_ReadCoils, idx, MBIO_ScanMcode));
+    }
+    CHECK(mbio_rule_compile("D1E1P1=1&D1E1P99=1&D1E1P100=1:HOLD") == Status_GcodeValueOutOfRange);
+    CHECK(rules.count == 0 && rules.code[0] == Rule_End && scan.count == MBIO_SCAN_POINTS - 1);
+    CHECK(mbio_rule_compile("D1E1P1=1&D1E1P99=1:HOLD") == Status_OK);
+    CHECK(rules.count == 1 && scan.count == MBIO_SCAN_POINTS && scan.points[0].users == (MBIO_ScanMcode | MBIO_ScanRule));
+}
+
+int main(void) {
+    static const mbio_test_t tests[] = {
+        { "rule_compile", test_rule_compile },
+        { "rule_invalid", test_rule_invalid },
+        { "rule_bounds", test_rule_bounds },
+        { "rule_eval", test_rule_eval },
+        { "rule_scan", test_rule_scan },
+    };
+
+    return mbio_test_run(tests, sizeof(tests) / sizeof(tests[0]));
+}
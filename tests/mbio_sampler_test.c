@@ -0,0 +1,204 @@
+/*
+
+mbio_sampler_test.c - host unit tests of the M103 sampler
+
+Copyright (c) 2024 Richard Toth
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+Usage: mbio_sampler_test
+
+Checks M103 start and stop by time and by distance, the ring buffer overflow with the count of the
+dropped samples and the time and position the samples are tagged with.
+
+*/
+
+#include "mbio_test.h"
+
+static void sampler_block(parser_block_t *block, float p, float r, float q) {
+    memset(block, 0, sizeof(parser_block_t));
+    block->user_mcode = UserMCode_Generic3;
+    block->words.d = block->words.p = On;
+    block->words.r = r != 0.0f;
+    block->words.q = q != 0.0f;
+    block->values.d = 2.0f;
+    block->values.p = p;
+    block->values.r = r;
+    block->values.q = q;
+}
+
+// Answers the sample request in flight.
+static void sampler_response(uint16_t value) {
+    modbus_message_t msg = { .context = (void *)MBIO_Sample, .adu = { 2, ModBus_ReadInputRegisters, 2, value >> 8, value & 0xFF }, .rx_length = 7 };
+
+    mbio_rx_packet(&msg);
+}
+
+static void test_sampler_interval(void) {
+    parser_block_t block;
+
+    setup();
+    sampler_block(&block, 5.0f, 0.05f, 0.0f);
+    CHECK(mbio_validate(&block, NULL) == Status_OK);
+    mbio_execute(STATE_IDLE, &block);
+    CHECK(sampler.active && sampler.device_address == 2 && sampler.function == ModBus_ReadInputRegisters && sampler.register_address == 4);
+    CHECK(sampler.interval == 50 && sampler.distance == 0.0f);
+
+    // the first sample is due at once, only one request is in flight
+    mbio_poll(STATE_IDLE);
+    CHECK(sampler.busy && core_sent_count == 1 && core_sent.adu[0] == 2 && core_sent.adu[1] == ModBus_ReadInputRegisters && core_sent.adu[3] == 4);
+    core_ms += 120;
+    mbio_poll(STATE_IDLE);
+    CHECK(core_sent_count == 1);
+    sampler_response(1234);
+    CHECK(!sampler.busy && samples.head == 1 && samples.data[0].value == 1234 && samples.data[0].seq == 0);
+
+    // the bus was late by more than an interval, the next sample is due an interval after this one instead of at once again
+    mbio_poll(STATE_IDLE);
+    CHECK(core_sent_count == 2);
+    sampler_response(1235);
+    core_ms += 49;
+    mbio_poll(STATE_IDLE);
+    CHECK(core_sent_count == 2);
+    core_ms += 1;
+    mbio_poll(STATE_IDLE);
+    CHECK(core_sent_count == 3);
+    sampler_response(1236);
+
+    // otherwise at a fixed rate
+    core_ms += 60;
+    mbio_poll(STATE_IDLE);
+    CHECK(core_sent_count == 4);
+    sampler_response(1237);
+    core_ms += 40;
+    mbio_poll(STATE_IDLE);
+    CHECK(core_sent_count == 5);
+    sampler_response(1238);
+
+    // M103 without parameters stops sampling
+    sampler_block(&block, 0.0f, 0.0f, 0.0f);
+    block.words.d = block.words.p = Off;
+    CHECK(mbio_validate(&block, NULL) == Status_OK);
+    mbio_execute(STATE_IDLE, &block);
+    core_ms += 100;
+    mbio_poll(STATE_IDLE);
+    CHECK(!sampler.active && core_sent_count == 5 && sampler.seq == 5);
+
+    // one of interval and distance is required
+    sampler_block(&block, 5.0f, 0.0f, 0.0f);
+    CHECK(mbio_validate(&block, NULL) == Status_GcodeValueWordMissing);
+    sampler_block(&block, 5.0f, 0.05f, 1.0f);
+    CHECK(mbio_validate(&block, NULL) == Status_GcodeValueWordMissing);
+    sampler_block(&block, 5.0f, 0.0005f, 0.0f);
+    CHECK(mbio_validate(&block, NULL) == Status_GcodeValueOutOfRange);
+}
+
+static void test_sampler_distance(void) {
+    parser_block_t block;
+
+    // a sample each time the machine moved 1 mm, the stand-in has 100 steps/mm
+    setup();
+    sys.position[X_AXIS] = 1000;
+    sampler_block(&block, 1.0f, 0.0f, 1.0f);
+    CHECK(mbio_validate(&block, NULL) == Status_OK);
+    mbio_execute(STATE_IDLE, &block);
+    CHECK(sampler.active && sampler.interval == 0 && sampler.distance == 1.0f);
+
+    mbio_poll(STATE_CYCLE);
+    CHECK(core_sent_count == 0);
+    sys.position[X_AXIS] += 60;
+    sys.position[Y_AXIS] += 79;
+    mbio_poll(STATE_CYCLE);
+    CHECK(core_sent_count == 0);
+    sys.position[Y_AXIS] += 1;
+    mbio_poll(STATE_CYCLE);
+    CHECK(core_sent_count == 1);
+    sampler_response(1);
+
+    // measured from where the last sample was requested
+    sys.position[X_AXIS] -= 99;
+    mbio_poll(STATE_CYCLE);
+    CHECK(core_sent_count == 1);
+    sys.position[X_AXIS] -= 1;
+    mbio_poll(STATE_CYCLE);
+    CHECK(core_sent_count == 2);
+}
+
+static void test_sampler_overflow(void) {
+    setup();
+    mbio_sampler_start(2, ModBus_ReadInputRegisters, 0, 0.01f, 0.0f);
+
+    // the ring keeps one slot free, the samples which do not fit are counted and keep their sequence number
+    for (uint_fast16_t idx = 0; idx < MBIO_SAMPLE_BUFFER + 2; idx++) {
+        mbio_sampler_request();
+        sampler_response(idx);
+    }
+    CHECK(samples.head == MBIO_SAMPLE_BUFFER - 1 && samples.tail == 0);
+    CHECK(sampler.dropped == 3 && sampler.seq == MBIO_SAMPLE_BUFFER + 2);
+    CHECK(samples.data[MBIO_SAMPLE_BUFFER - 2].seq == MBIO_SAMPLE_BUFFER - 2 && samples.data[MBIO_SAMPLE_BUFFER - 2].value == MBIO_SAMPLE_BUFFER - 2);
+
+    // a sample taken after room was made shows the gap in its sequence number
+    samples.tail = 1;
+    mbio_sampler_request();
+    sampler_response(500);
+    CHECK(samples.head == 0 && samples.data[MBIO_SAMPLE_BUFFER - 1].seq == MBIO_SAMPLE_BUFFER + 2 && sampler.dropped == 3);
+
+    // a restart empties the buffer and resets the counts
+    mbio_sampler_start(2, ModBus_ReadInputRegisters, 0, 0.01f, 0.0f);
+    CHECK(samples.head == 0 && samples.tail == 0 && sampler.seq == 0 && sampler.dropped == 0 && sampler.errors == 0);
+}
+
+static void test_sampler_position(void) {
+    setup();
+    sys.position[X_AXIS] = 1000;
+    sys.position[Y_AXIS] = -200;
+    sys.position[Z_AXIS] = 7;
+    core_ms = 1000;
+    mbio_sampler_start(2, ModBus_ReadInputRegisters, 0, 0.01f, 0.0f);
+    mbio_poll(STATE_CYCLE);
+    CHECK(sampler.busy && sampler.tx_time == 1000);
+
+    // tagged with the time and position halfway between request and response
+    core_ms = 1011;
+    sys.position[X_AXIS] = 1100;
+    sys.position[Y_AXIS] = -250;
+    sys.position[Z_AXIS] = 0;
+    sampler_response(42);
+    CHECK(samples.head == 1 && samples.data[0].timestamp == 1005 && samples.data[0].value == 42);
+    CHECK(samples.data[0].position[X_AXIS] == 1050 && samples.data[0].position[Y_AXIS] == -225 && samples.data[0].position[Z_AXIS] == 4);
+
+    // a request queued behind another one is tagged when that one completes and it goes on the bus
+    modbus_message_t msg = { .context = (void *)MBIO_WriteBehind, .adu = { 3, ModBus_WriteRegister, 0, 0, 0, 1 }, .rx_length = 8 };
+
+    core_ms = 1030;
+    CHECK(mbio_write_behind(3, ModBus_WriteRegister, 0, 1, 0));
+    mbio_write_behind_request();
+    mbio_sampler_request();
+    CHECK(write_behind.busy && sampler.busy && pending.count == 2);
+    core_ms = 1040;
+    sys.position[X_AXIS] = 1200;
+    mbio_rx_packet(&msg);
+    CHECK(!write_behind.busy && sampler.tx_time == 1040 && sampler.tx_position[X_AXIS] == 1200);
+}
+
+int main(void) {
+    static const mbio_test_t tests[] = {
+        { "sampler_interval", test_sampler_interval },
+        { "sampler_distance", test_sampler_distance },
+        { "sampler_overflow", test_sampler_overflow },
+        { "sampler_position", test_sampler_position },
+    };
+
+    return mbio_test_run(tests, sizeof(tests) / sizeof(tests[0]));
+}
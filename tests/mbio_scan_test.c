@@ -0,0 +1,259 @@
+/*
+
+mbio_scan_test.c - host unit tests of the scan planner
+
+Copyright (c) 2024 Richard Toth
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+Usage: mbio_scan_test
+
+Checks the plans against an exhaustive search and the item limits of MODBUS_MAX_ADU_SIZE, the decoding
+of the responses, a re-plan while a frame is in flight and the start of a scan after the ms tick passed 2^31.
+
+*/
+
+#include "mbio_test.h"
+
+static uint_fast16_t scan_limit(uint8_t function) {
+    return mbio_scan_bits(function) ? MBIO_READ_BITS : MBIO_READ_REGISTERS;
+}
+
+// Cheapest plan by trying every split of the sorted points.
+static uint32_t scan_exhaustive(void) {
+    uint32_t best = UINT32_MAX;
+
+    for (uint32_t splits = 0; splits < (1u << (scan.count - 1)); splits++) {
+        uint32_t cost = 0;
+        uint_fast8_t first = 0;
+        bool valid = true;
+
+        for (uint_fast8_t idx = 1; idx <= scan.count && valid; idx++) {
+            if (idx < scan.count && !(splits & (1u << (idx - 1)))) {
+                valid = scan.points[idx].device_address == scan.points[first].device_address && scan.points[idx].function == scan.points[first].function;
+                continue;
+            }
+
+            uint_fast16_t count = scan.points[idx - 1].register_address - scan.points[first].register_address + 1;
+
+            valid = count <= scan_limit(scan.points[first].function);
+            cost += MBIO_FRAME_COST + mbio_scan_bytes(scan.points[first].function, count);
+            first = idx;
+        }
+
+        if (valid && cost < best) {
+            best = cost;
+        }
+    }
+
+    return best;
+}
+
+// Checks that the frames read all points in order within the limits and returns their cost.
+static uint32_t scan_check_plan(void) {
+    uint32_t cost = 0;
+    uint_fast8_t point = 0;
+
+    for (uint_fast8_t idx = 0; idx < scan.frames; idx++) {
+        mbio_frame_t *frame = &scan.plan[idx];
+        mbio_scan_point_t *first = &scan.points[point], *last = &scan.points[point + frame->points - 1];
+
+        CHECK(frame->points > 0 && point + frame->points <= scan.count);
+        CHECK(frame->device_address == first->device_address && frame->function == first->function);
+        CHECK(frame->register_address == first->register_address);
+        CHECK(frame->count == last->register_address - first->register_address + 1);
+        CHECK(last->device_address == first->device_address && last->function == first->function);
+        CHECK(frame->count <= scan_limit(frame->function));
+        CHECK(5 + mbio_scan_bytes(frame->function, frame->count) <= MODBUS_MAX_ADU_SIZE);
+
+        cost += MBIO_FRAME_COST + mbio_scan_bytes(frame->function, frame->count);
+        point += frame->points;
+    }
+
+    CHECK(point == scan.count);
+
+    return cost;
+}
+
+static void test_scan_limits(void) {
+    // byte count, data and CRC of a response have to fit into MODBUS_MAX_ADU_SIZE
+    CHECK(MBIO_READ_BITS == (MODBUS_MAX_ADU_SIZE - 5) * 8);
+    CHECK(MBIO_READ_REGISTERS == (MODBUS_MAX_ADU_SIZE - 5) / 2);
+
+    // coils at the ends of the longest read
+    setup();
+    CHECK(mbio_scan_add(1, ModBus_ReadCoils, 0, MBIO_ScanMcode) && mbio_scan_add(1, ModBus_ReadCoils, MBIO_READ_BITS - 1, MBIO_ScanMcode));
+    mbio_scan_plan();
+    CHECK(scan.frames == 1 && scan.plan[0].count == MBIO_READ_BITS && scan.plan[0].points == 2);
+    scan_check_plan();
+
+    setup();
+    CHECK(mbio_scan_add(1, ModBus_ReadCoils, 0, MBIO_ScanMcode) && mbio_scan_add(1, ModBus_ReadCoils, MBIO_READ_BITS, MBIO_ScanMcode));
+    mbio_scan_plan();
+    CHECK(scan.frames == 2 && scan.plan[0].count == 1 && scan.plan[1].count == 1);
+
+    // consecutive registers are split at the limit
+    setup();
+    for (uint16_t address = 0; address <= MBIO_READ_REGISTERS; address++) {
+        CHECK(mbio_scan_add(1, ModBus_ReadInputRegisters, address, MBIO_ScanMcode));
+    }
+    mbio_scan_plan();
+    CHECK(scan.frames == 2 && scan.plan[0].count == MBIO_READ_REGISTERS && scan.plan[1].count == 1);
+    scan_check_plan();
+
+    // devices and tables are never read together, points are kept sorted and unique
+    setup();
+    CHECK(mbio_scan_add(2, ModBus_ReadHoldingRegisters, 0, MBIO_ScanMcode));
+    CHECK(mbio_scan_add(1, ModBus_ReadHoldingRegisters, 1, MBIO_ScanMcode));
+    CHECK(mbio_scan_add(1, ModBus_ReadInputRegisters, 0, MBIO_ScanMcode));
+    CHECK(mbio_scan_add(1, ModBus_ReadHoldingRegisters, 0, MBIO_ScanMcode));
+    CHECK(mbio_scan_add(1, ModBus_ReadHoldingRegisters, 0, MBIO_ScanMcode));
+    mbio_scan_plan();
+    CHECK(scan.count == 4 && scan.frames == 3);
+    CHECK(scan.plan[0].device_address == 1 && scan.plan[0].function == ModBus_ReadHoldingRegisters && scan.plan[0].count == 2);
+    CHECK(scan.plan[1].function == ModBus_ReadInputRegisters && scan.plan[2].device_address == 2);
+
+    // the list is bounded
+    setup();
+    for (uint16_t address = 0; address < MBIO_SCAN_POINTS; address++) {
+        CHECK(mbio_scan_add(1, ModBus_ReadCoils, address * 3, MBIO_ScanMcode));
+    }
+    CHECK(!mbio_scan_add(1, ModBus_ReadCoils, 1, MBIO_ScanMcode));
+    CHECK(mbio_scan_add(1, ModBus_ReadCoils, 3, MBIO_ScanMcode));
+    mbio_scan_plan();
+    CHECK(scan.cost == scan_check_plan());
+}
+
+static void test_scan_optimal(void) {
+    uint32_t state = 1;
+
+    for (uint_fast16_t round = 0; round < 500; round++) {
+        uint_fast8_t count = 1 + random_next(&state) % 12;
+
+        setup();
+        while (scan.count < count) {
+            mbio_scan_add(1 + random_next(&state) % 2, ModBus_ReadCoils + random_next(&state) % 4, random_next(&state) % (round < 250 ? 16 : 100), MBIO_ScanMcode);
+        }
+        mbio_scan_plan();
+
+        CHECK(scan.cost == scan_check_plan());
+        CHECK(scan.cost == scan_exhaustive());
+    }
+}
+
+static void test_scan_rx(void) {
+    modbus_message_t msg = {0};
+
+    setup();
+    mbio_scan_add(1, ModBus_ReadCoils, 0, MBIO_ScanMcode);
+    mbio_scan_add(1, ModBus_ReadCoils, 9, MBIO_ScanMcode);
+    mbio_scan_add(1, ModBus_ReadCoils, 39, MBIO_ScanMcode);
+    mbio_scan_plan();
+    CHECK(scan.frames == 1);
+
+    mbio_scan_request();
+    CHECK(core_sent.adu[1] == ModBus_ReadCoils && core_sent.adu[5] == 40 && core_sent.rx_length == 5 + 5);
+
+    // coils 0 and 39 set, 9 clear, the gaps are not added to the image
+    msg.context = (void *)MBIO_Scan;
+    msg.adu[0] = 1;
+    msg.adu[1] = ModBus_ReadCoils;
+    msg.adu[2] = 5;
+    msg.adu[3] = 0x01;
+    msg.adu[4] = 0x00;
+    msg.adu[7] = 0x80;
+    msg.rx_length = 10;
+    mbio_rx_packet(&msg);
+
+    CHECK(image.count == 3);
+    CHECK(mbio_image_find(1, ModBus_ReadCoils, 0)->value == 1);
+    CHECK(mbio_image_find(1, ModBus_ReadCoils, 9)->value == 0);
+    CHECK(mbio_image_find(1, ModBus_ReadCoils, 39)->value == 1);
+    CHECK(scan.scans == 1);
+
+    // a response shorter than its byte count is read as far as it goes
+    setup();
+    mbio_scan_add(1, ModBus_ReadCoils, 0, MBIO_ScanMcode);
+    mbio_scan_add(1, ModBus_ReadCoils, 39, MBIO_ScanMcode);
+    mbio_scan_plan();
+    mbio_scan_request();
+    msg.rx_length = 6;
+    mbio_rx_packet(&msg);
+    CHECK(image.count == 1 && mbio_image_find(1, ModBus_ReadCoils, 0) != NULL);
+
+    msg.rx_length = 4;
+    mbio_scan_request();
+    mbio_rx_packet(&msg);
+    CHECK(image.count == 1);
+}
+
+static void test_scan_replan(void) {
+    modbus_message_t msg = { .context = (void *)MBIO_Scan, .adu = { 1, ModBus_ReadHoldingRegisters, 2, 0x12, 0x34 }, .rx_length = 7 };
+
+    setup();
+    mbio_scan_add(1, ModBus_ReadHoldingRegisters, 0, MBIO_ScanMcode);
+    mbio_scan_add(2, ModBus_ReadHoldingRegisters, 0, MBIO_ScanMcode);
+    mbio_scan_plan();
+    CHECK(scan.frames == 2);
+
+    // a point is added while the first frame is in flight
+    mbio_scan_request();
+    mbio_scan_add(1, ModBus_ReadHoldingRegisters, 1, MBIO_ScanMcode);
+    mbio_scan_plan();
+    CHECK(scan.busy && scan.frame == 0);
+
+    // the response is decoded against the request sent and the new plan starts at its first frame
+    mbio_rx_packet(&msg);
+    CHECK(mbio_image_find(1, ModBus_ReadHoldingRegisters, 0)->value == 0x1234);
+    CHECK(mbio_image_find(1, ModBus_ReadHoldingRegisters, 1) == NULL);
+    CHECK(!scan.busy && scan.frame == 0 && scan.scans == 0);
+    mbio_scan_request();
+    CHECK(core_sent.adu[0] == 1 && core_sent.adu[3] == 0 && core_sent.adu[5] == 2);
+
+    // the scan list is cleared while the second frame is in flight, the interrupted scan is not counted
+    mbio_rx_packet(&msg);
+    mbio_scan_request();
+    CHECK(scan.frame == 1 && core_sent.adu[0] == 2);
+    mbio_scan_remove(MBIO_ScanMcode);
+    msg.adu[0] = 2;
+    mbio_rx_packet(&msg);
+    CHECK(scan.frame == 0 && scan.frames == 0 && scan.scans == 0);
+
+    // without a frame in flight the next frame is not held back
+    mbio_scan_add(1, ModBus_ReadHoldingRegisters, 0, MBIO_ScanMcode);
+    mbio_scan_plan();
+    CHECK(!scan.restart);
+}
+
+static void test_scan_start(void) {
+    // the controller has been up for more than 2^31 ms, a scan that was idle since boot still starts right away
+    setup();
+    core_ms = 0x80000000u + 1000u;
+    mbio_scan_add(1, ModBus_ReadCoils, 0, MBIO_ScanMcode);
+    mbio_scan_plan();
+    mbio_poll(STATE_IDLE);
+    CHECK(scan.busy && core_sent_count == 1);
+}
+
+int main(void) {
+    static const mbio_test_t tests[] = {
+        { "scan_limits", test_scan_limits },
+        { "scan_optimal", test_scan_optimal },
+        { "scan_rx", test_scan_rx },
+        { "scan_replan", test_scan_replan },
+        { "scan_start", test_scan_start },
+    };
+
+    return mbio_test_run(tests, sizeof(tests) / sizeof(tests[0]));
+}
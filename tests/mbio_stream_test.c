@@ -0,0 +1,144 @@
+/*
+
+mbio_stream_test.c - host unit tests of the sample stream encoder
+
+Copyright (c) 2024 Richard Toth
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+Usage: mbio_stream_test
+
+Checks the [MBK:] keyframe, [MBD:] delta and [MBE:] end lines, the batching of the samples and the
+length of the lines against the output buffer of the core.
+
+*/
+
+#include "mbio_test.h"
+
+static void push_sample(uint32_t seq, uint32_t timestamp, uint16_t value, int32_t x, int32_t y, int32_t z) {
+    mbio_sample_t *sample = &samples.data[samples.head];
+
+    sample->seq = seq;
+    sample->timestamp = timestamp;
+    sample->value = value;
+    sample->position[X_AXIS] = x;
+    sample->position[Y_AXIS] = y;
+    sample->position[Z_AXIS] = z;
+    samples.head = (samples.head + 1) & (MBIO_SAMPLE_BUFFER - 1);
+}
+
+static const char *stream_next(void) {
+    core_output_length = 0;
+    core_output[0] = '\0';
+    mbio_stream_samples();
+
+    return core_output;
+}
+
+static void test_stream_format(void) {
+    setup();
+    sampler.active = true;
+    sampler.errors = 2;
+
+    CHECK(!strcmp(stream_next(), ""));
+
+    push_sample(0, 1000, 500, 100, -200, 0);
+    push_sample(1, 1010, 490, 110, -200, -5);
+    push_sample(2, 1020, 520, 120, -190, -5);
+    CHECK(!strcmp(stream_next(), "[MBK:0,0,2,1000,500,100,-200,0]\r\n"));
+    CHECK(!strcmp(stream_next(), "[MBD:1|10,-10,10,0,-5|10,30,10,10,0]\r\n"));
+    CHECK(!strcmp(stream_next(), ""));
+
+    // a gap in the sequence starts a keyframe, dropped samples are reported with it
+    sampler.dropped = 1;
+    push_sample(4, 1040, 0, 0, 0, 0);
+    push_sample(5, 1050, 65535, 0, 0, 0);
+    CHECK(!strcmp(stream_next(), "[MBK:4,1,2,1040,0,0,0,0]\r\n"));
+    CHECK(!strcmp(stream_next(), "[MBD:5|10,65535,0,0,0]\r\n"));
+
+    // held back while the output buffer is filled
+    push_sample(6, 1060, 1, 0, 0, 0);
+    core_tx_count = MBIO_STREAM_TX_LIMIT + 1;
+    CHECK(!strcmp(stream_next(), "") && stream.throttled == 1);
+    core_tx_count = 0;
+    CHECK(!strcmp(stream_next(), "[MBD:6|10,-65534,0,0,0]\r\n"));
+
+    // the end marker once sampling stopped and all samples were sent
+    sampler.active = false;
+    sampler.seq = 7;
+    CHECK(!strcmp(stream_next(), "[MBE:7,1,2]\r\n"));
+    CHECK(!strcmp(stream_next(), ""));
+}
+
+static void test_stream_batches(void) {
+    uint32_t seq = 0;
+
+    setup();
+    sampler.active = true;
+
+    // MBIO_STREAM_BATCH samples per line
+    for (uint_fast8_t idx = 0; idx < MBIO_STREAM_BATCH + 3; idx++, seq++) {
+        push_sample(seq, seq, 0, 0, 0, 0);
+    }
+    CHECK(!strncmp(stream_next(), "[MBK:0,", 7));
+    CHECK(!strcmp(stream_next(), "[MBD:1|1,0,0,0,0|1,0,0,0,0|1,0,0,0,0|1,0,0,0,0|1,0,0,0,0|1,0,0,0,0|1,0,0,0,0|1,0,0,0,0]\r\n"));
+    CHECK(!strcmp(stream_next(), "[MBD:9|1,0,0,0,0|1,0,0,0,0]\r\n"));
+
+    // a keyframe after MBIO_STREAM_KEYFRAME delta lines
+    for (uint_fast8_t line = 2; line < MBIO_STREAM_KEYFRAME; line++, seq++) {
+        push_sample(seq, seq, 0, 0, 0, 0);
+        CHECK(!strncmp(stream_next(), "[MBD:", 5));
+    }
+    push_sample(seq, seq, 0, 0, 0, 0);
+    CHECK(!strncmp(stream_next(), "[MBK:", 5));
+}
+
+// Deltas of the widest values fit into the line, no sample is lost.
+static void test_stream_line_length(void) {
+    uint32_t seq = 0, streamed = 0;
+
+    setup();
+    sampler.active = true;
+
+    for (uint_fast16_t round = 0; round < 8; round++) {
+        for (uint_fast8_t idx = 0; idx < 50; idx++, seq++) {
+            int32_t position = seq & 1 ? 999999999 : -999999999;
+
+            push_sample(seq, seq & 1 ? 0x7FFFFFFF : 0, seq & 1 ? 65535 : 0, position, -position, position);
+        }
+
+        while (samples.tail != samples.head) {
+            const char *line = stream_next();
+            size_t length = strlen(line);
+
+            CHECK(length < sizeof(stream.line) && length > 3 && !strcmp(&line[length - 3], "]\r\n"));
+            streamed += line[3] == 'K' ? 1 : 0;
+            for (const char *s = line; *s; s++) {
+                streamed += *s == '|';
+            }
+        }
+    }
+
+    CHECK(streamed == seq);
+}
+
+int main(void) {
+    static const mbio_test_t tests[] = {
+        { "stream_format", test_stream_format },
+        { "stream_batches", test_stream_batches },
+        { "stream_line_length", test_stream_line_length },
+    };
+
+    return mbio_test_run(tests, sizeof(tests) / sizeof(tests[0]));
+}
@@ -0,0 +1,101 @@
+/*
+
+mbio_test.h - checks and plugin state reset shared by the host unit tests
+
+Copyright (c) 2024 Richard Toth
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+Includes modbus_io.c to reach its static functions and state, the core is the stand-in in core/.
+A test program defines the plugin switches it needs (MBIO_NOTIFY_ENABLE, MBIO_COOLANT_ENABLE)
+before including this file, runs its tests with mbio_test_run() and exits with its result.
+
+*/
+
+#ifndef _MBIO_TEST_H_
+#define _MBIO_TEST_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "core.h"
+#include "modbus_io.c"
+
+typedef struct {
+    const char *name;
+    void (*run)(void);
+} mbio_test_t;
+
+static unsigned checks, failures;
+
+#define CHECK(condition) check(condition, #condition, __FILE__, __LINE__)
+
+static void check(bool ok, const char *text, const char *file, int line) {
+    checks++;
+    if (!ok) {
+        failures++;
+        fprintf(stderr, "%s:%d: check failed: %s\n", file, line, text);
+    }
+}
+
+// Clears the plugin state and the core stand-in.
+static void setup(void) {
+    core_init();
+    memset(&image, 0, sizeof(image));
+    memset(&rules, 0, sizeof(rules));
+    memset(&limits, 0, sizeof(limits));
+    memset(&scan, 0, sizeof(scan));
+    memset(&write_behind, 0, sizeof(write_behind));
+    memset(&sampler, 0, sizeof(sampler));
+    memset(&samples, 0, sizeof(samples));
+    memset(&stream, 0, sizeof(stream));
+    memset(&mbio_log, 0, sizeof(mbio_log));
+    memset(&trace, 0, sizeof(trace));
+    memset(&latency, 0, sizeof(latency));
+    memset(&adapt, 0, sizeof(adapt));
+    memset(&thermal, 0, sizeof(thermal));
+    memset(readback_differs, 0, sizeof(readback_differs));
+    memset(&claimed, 0, sizeof(claimed));
+    memset(&user_mcode, 0, sizeof(user_mcode));
+    memset(requests, 0, sizeof(requests));
+    memset(&pending, 0, sizeof(pending));
+#if MBIO_NOTIFY_ENABLE
+    memset(&notify, 0, sizeof(notify));
+#endif
+#if MBIO_COOLANT_ENABLE
+    memset(&coolant, 0, sizeof(coolant));
+#endif
+}
+
+static uint32_t random_next(uint32_t *state) {
+    *state = *state * 1103515245u + 12345u;
+
+    return *state >> 16;
+}
+
+// Runs the tests in order, the exit code is 1 when a check failed.
+static int mbio_test_run(const mbio_test_t *tests, size_t count) {
+    for (size_t idx = 0; idx < count; idx++) {
+        unsigned failed = failures;
+
+        tests[idx].run();
+        printf("%-24s %s\n", tests[idx].name, failures == failed ? "ok" : "FAILED");
+    }
+
+    printf("%u checks, %u failed\n", checks, failures);
+
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+#endif
@@ -0,0 +1,156 @@
+/*
+
+mbio_thermal_test.c - host unit tests of the thermal Z compensation
+
+Copyright (c) 2024 Richard Toth
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+Usage: mbio_thermal_test
+
+Checks that the compensation goes to the Z tool length offset while a job runs, on top of the offset set
+by the program, that G49 and a reset are handled and that M170 without parameters removes it.
+
+*/
+
+#include "mbio_test.h"
+
+static void noop_reset(void) {
+}
+
+// Feeds a temperature read to the plugin.
+static void thermal_read(uint16_t value) {
+    modbus_message_t msg = { .context = (void *)MBIO_Thermal, .adu = { 3, ModBus_ReadInputRegisters, 2, value >> 8, value & 0xFF }, .rx_length = 7 };
+
+    mbio_rx_packet(&msg);
+}
+
+// Compensation of 0.01 mm per register unit above 200.
+static void thermal_setup(void) {
+    setup();
+    core_state = STATE_CYCLE;
+    mbio_thermal_start(3, ModBus_ReadInputRegisters, 7, 0.01f, 200.0f);
+}
+
+static bool near(float a, float b) {
+    return fabsf(a - b) < MBIO_THERMAL_STEP / 10.0f;
+}
+
+static void test_thermal_cycle(void) {
+    thermal_setup();
+    mbio_poll(core_state);
+    CHECK(thermal.busy && core_sent_count == 1 && core_sent.adu[0] == 3 && core_sent.adu[1] == ModBus_ReadInputRegisters && core_sent.adu[3] == 7);
+
+    // applied while the job runs, from the poll and not from the callback
+    thermal_read(205);
+    CHECK(!thermal.busy && gc_state.tool_length_offset[Z_AXIS] == 0.0f);
+    mbio_poll(core_state);
+    CHECK(near(gc_state.tool_length_offset[Z_AXIS], 0.05f) && core_wco_changes == 1);
+    CHECK(gc_state.modal.tool_offset_mode == ToolLengthOffset_Cancel);
+
+    // changes below MBIO_THERMAL_STEP are not applied
+    thermal_read(205);
+    mbio_poll(core_state);
+    CHECK(core_wco_changes == 1);
+
+    // limited to MBIO_THERMAL_MAX
+    thermal_read(400);
+    mbio_poll(core_state);
+    CHECK(near(gc_state.tool_length_offset[Z_AXIS], MBIO_THERMAL_MAX) && core_wco_changes == 2);
+
+    // M170 without parameters removes it
+    mbio_thermal_stop();
+    mbio_poll(core_state);
+    CHECK(!thermal.active && gc_state.tool_length_offset[Z_AXIS] == 0.0f && thermal.offset == 0.0f);
+}
+
+static void test_thermal_offset(void) {
+    // a G43 H offset stays one, the compensation is added to it
+    thermal_setup();
+    gc_state.modal.tool_offset_mode = ToolLengthOffset_Enable;
+    gc_state.tool_length_offset[Z_AXIS] = 20.0f;
+    thermal_read(210);
+    mbio_poll(core_state);
+    CHECK(near(gc_state.tool_length_offset[Z_AXIS], 20.1f) && gc_state.modal.tool_offset_mode == ToolLengthOffset_Enable);
+
+    // the program sets another tool, the compensation is added to the new offset
+    gc_state.tool_length_offset[Z_AXIS] = 30.0f;
+    mbio_poll(core_state);
+    CHECK(near(gc_state.tool_length_offset[Z_AXIS], 30.1f));
+    thermal_read(220);
+    mbio_poll(core_state);
+    CHECK(near(gc_state.tool_length_offset[Z_AXIS], 30.2f));
+
+    // G49 cancels the offset, it is not put back
+    gc_state.modal.tool_offset_mode = ToolLengthOffset_Cancel;
+    gc_state.tool_length_offset[Z_AXIS] = 0.0f;
+    mbio_poll(core_state);
+    thermal_read(230);
+    mbio_poll(core_state);
+    CHECK(gc_state.tool_length_offset[Z_AXIS] == 0.0f && thermal.cancelled);
+
+    // until the next G43
+    gc_state.modal.tool_offset_mode = ToolLengthOffset_Enable;
+    gc_state.tool_length_offset[Z_AXIS] = 20.0f;
+    mbio_poll(core_state);
+    CHECK(near(gc_state.tool_length_offset[Z_AXIS], 20.3f) && !thermal.cancelled);
+}
+
+static void test_thermal_g49(void) {
+    // G49 before the first compensation, when the offset was 0 already
+    thermal_setup();
+    gc_state.modal.tool_offset_mode = ToolLengthOffset_EnableDynamic;
+    mbio_poll(core_state);
+    gc_state.modal.tool_offset_mode = ToolLengthOffset_Cancel;
+    thermal_read(210);
+    mbio_poll(core_state);
+    CHECK(gc_state.tool_length_offset[Z_AXIS] == 0.0f && thermal.cancelled);
+}
+
+static void test_thermal_reset(void) {
+    // the parser init of a reset cancels the offset, the compensation keeps running
+    thermal_setup();
+    on_reset = noop_reset;
+    gc_state.modal.tool_offset_mode = ToolLengthOffset_Enable;
+    gc_state.tool_length_offset[Z_AXIS] = 20.0f;
+    thermal_read(210);
+    mbio_poll(core_state);
+    CHECK(near(gc_state.tool_length_offset[Z_AXIS], 20.1f));
+
+    mbio_reset();
+    CHECK(thermal.active && !thermal.busy);
+    core_state = STATE_IDLE;
+    gc_state.modal.tool_offset_mode = ToolLengthOffset_Cancel;
+    gc_state.tool_length_offset[Z_AXIS] = 0.0f;
+    mbio_poll(core_state);
+    CHECK(near(gc_state.tool_length_offset[Z_AXIS], 0.1f) && !thermal.cancelled);
+
+    // a G49 after that is one
+    core_state = STATE_CYCLE;
+    mbio_poll(core_state);
+    gc_state.tool_length_offset[Z_AXIS] = 0.0f;
+    mbio_poll(core_state);
+    CHECK(gc_state.tool_length_offset[Z_AXIS] == 0.0f && thermal.cancelled);
+}
+
+int main(void) {
+    static const mbio_test_t tests[] = {
+        { "thermal_cycle", test_thermal_cycle },
+        { "thermal_offset", test_thermal_offset },
+        { "thermal_g49", test_thermal_g49 },
+        { "thermal_reset", test_thermal_reset },
+    };
+
+    return mbio_test_run(tests, sizeof(tests) / sizeof(tests[0]));
+}
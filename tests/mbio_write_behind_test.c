@@ -0,0 +1,235 @@
+/*
+
+mbio_write_behind_test.c - host unit tests of the deferred writes
+
+Copyright (c) 2024 Richard Toth
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+Usage: mbio_write_behind_test
+
+Checks M101 writes with the R word: coalescing within the deadline, the order of the writes, the
+retry of a failed write, the fallback to a direct write when the queue is full, a direct write
+replacing a waiting deferred one and the reset.
+
+*/
+
+#include "mbio_test.h"
+
+// Acknowledges the blocking writes.
+static bool slave_echo(modbus_message_t *msg) {
+    msg->rx_length = 8;
+
+    return true;
+}
+
+static void noop_reset(void) {
+}
+
+// Runs M101 D<device> E<function> P<address> Q<value> [R<seconds>] like the core does.
+static void m101(uint8_t device, uint8_t function, uint16_t address, uint16_t value, float r) {
+    parser_block_t block = { .user_mcode = UserMCode_Generic1 };
+
+    block.words.d = block.words.e = block.words.p = block.words.q = On;
+    block.words.r = r != 0.0f;
+    block.values.d = (float)device;
+    block.values.e = (float)function;
+    block.values.p = (float)address;
+    block.values.q = (float)value;
+    block.values.r = r;
+    CHECK(mbio_validate(&block, NULL) == Status_OK);
+    mbio_execute(STATE_IDLE, &block);
+}
+
+// Acknowledges the deferred write on the bus.
+static void write_behind_ack(void) {
+    modbus_message_t msg = { .context = (void *)MBIO_WriteBehind, .rx_length = 8 };
+
+    memcpy(msg.adu, core_sent.adu, 6);
+    mbio_rx_packet(&msg);
+}
+
+static void write_behind_setup(void) {
+    setup();
+    core_slave = slave_echo;
+    on_reset = noop_reset;
+}
+
+static void test_write_behind_coalesce(void) {
+    write_behind_setup();
+
+    // only the latest value is written, at the deadline of the first change
+    m101(2, ModBus_WriteRegister, 1, 10, 0.1f);
+    CHECK(core_sent_count == 0);
+    core_ms = 50;
+    m101(2, ModBus_WriteRegister, 1, 20, 0.1f);
+    core_ms = 99;
+    mbio_poll(STATE_IDLE);
+    CHECK(core_sent_count == 0 && write_behind.coalesced == 1);
+    core_ms = 100;
+    mbio_poll(STATE_IDLE);
+    CHECK(core_sent_count == 1 && core_sent.adu[1] == ModBus_WriteRegister && core_sent.adu[3] == 0 && core_sent.adu[5] == 20);
+    CHECK(write_behind.busy && write_behind.written == 1);
+
+    // a value set while the write is on the bus is written after its own period
+    core_ms = 110;
+    m101(2, ModBus_WriteRegister, 1, 30, 0.1f);
+    write_behind_ack();
+    CHECK(!write_behind.busy && mbio_image_find(2, ModBus_ReadHoldingRegisters, 0)->value == 20);
+    core_ms = 209;
+    mbio_poll(STATE_IDLE);
+    CHECK(core_sent_count == 1);
+    core_ms = 210;
+    mbio_poll(STATE_IDLE);
+    CHECK(core_sent_count == 2 && core_sent.adu[5] == 30);
+    write_behind_ack();
+
+    // a shorter period pulls the deadline in, a longer one does not push it out
+    core_ms = 1000;
+    m101(2, ModBus_WriteCoil, 1, 1, 1.0f);
+    m101(2, ModBus_WriteCoil, 1, 0, 0.2f);
+    m101(2, ModBus_WriteCoil, 1, 1, 5.0f);
+    core_ms = 1200;
+    mbio_poll(STATE_IDLE);
+    CHECK(core_sent_count == 3 && core_sent.adu[1] == ModBus_WriteCoil && (uint8_t)core_sent.adu[4] == 0xFF);
+    CHECK(write_behind.coalesced == 3);
+}
+
+static void test_write_behind_order(void) {
+    write_behind_setup();
+
+    // the earliest deadline first, one write on the bus at a time
+    m101(2, ModBus_WriteRegister, 1, 1, 0.3f);
+    m101(2, ModBus_WriteRegister, 2, 2, 0.1f);
+    m101(3, ModBus_WriteRegister, 1, 3, 0.2f);
+    core_ms = 300;
+    mbio_poll(STATE_IDLE);
+    CHECK(core_sent_count == 1 && core_sent.adu[5] == 2);
+    mbio_poll(STATE_IDLE);
+    CHECK(core_sent_count == 1);
+    write_behind_ack();
+    mbio_poll(STATE_IDLE);
+    CHECK(core_sent_count == 2 && core_sent.adu[5] == 3);
+    write_behind_ack();
+    mbio_poll(STATE_IDLE);
+    CHECK(core_sent_count == 3 && core_sent.adu[5] == 1);
+    write_behind_ack();
+    CHECK(write_behind.written == 3 && write_behind.errors == 0);
+}
+
+static void test_write_behind_retry(void) {
+    write_behind_setup();
+
+    // a failed write is tried again after its period, at least MBIO_WRITE_RETRY ms
+    m101(2, ModBus_WriteRegister, 1, 1, 0.01f);
+    core_ms = 10;
+    mbio_poll(STATE_IDLE);
+    CHECK(core_sent_count == 1);
+    mbio_rx_exception(0, (void *)MBIO_WriteBehind);
+    CHECK(!write_behind.busy && write_behind.errors == 1 && core_alarm == Alarm_None);
+    core_ms = 10 + MBIO_WRITE_RETRY - 1;
+    mbio_poll(STATE_IDLE);
+    CHECK(core_sent_count == 1);
+    core_ms = 10 + MBIO_WRITE_RETRY;
+    mbio_poll(STATE_IDLE);
+    CHECK(core_sent_count == 2 && core_sent.adu[5] == 1);
+
+    // unless a newer value is waiting already
+    m101(2, ModBus_WriteRegister, 1, 2, 0.5f);
+    mbio_rx_exception(0, (void *)MBIO_WriteBehind);
+    core_ms += 499;
+    mbio_poll(STATE_IDLE);
+    CHECK(core_sent_count == 2);
+    core_ms += 1;
+    mbio_poll(STATE_IDLE);
+    CHECK(core_sent_count == 3 && core_sent.adu[5] == 2);
+}
+
+static void test_write_behind_full(void) {
+    write_behind_setup();
+
+    // a write which does not fit into the queue is written at once
+    for (uint_fast8_t idx = 0; idx < MBIO_WRITE_BEHIND_POINTS; idx++) {
+        m101(2, ModBus_WriteRegister, idx + 1, idx, 1.0f);
+    }
+    CHECK(core_sent_count == 0);
+    m101(2, ModBus_WriteRegister, 100, 7, 1.0f);
+    CHECK(core_sent_count == 1 && core_sent.adu[3] == 99 && mbio_image_find(2, ModBus_ReadHoldingRegisters, 99)->value == 7);
+
+    // a point already waiting takes its new value
+    m101(2, ModBus_WriteRegister, 1, 8, 1.0f);
+    CHECK(core_sent_count == 1 && write_behind.coalesced == 1);
+}
+
+static void test_write_behind_direct(void) {
+    write_behind_setup();
+
+    // M101 D2 E5 P1 Q1 R5 followed by M101 D2 E5 P1 Q0 leaves the coil off
+    m101(2, ModBus_WriteCoil, 1, 1, 5.0f);
+    m101(2, ModBus_WriteCoil, 1, 0, 0.0f);
+    CHECK(core_sent_count == 1 && core_sent.adu[1] == ModBus_WriteCoil && core_sent.adu[4] == 0);
+    core_ms = 5000;
+    mbio_poll(STATE_IDLE);
+    CHECK(core_sent_count == 1 && !write_behind.busy);
+
+    // other points keep their deferred writes
+    m101(2, ModBus_WriteCoil, 1, 1, 1.0f);
+    m101(2, ModBus_WriteCoil, 2, 1, 1.0f);
+    m101(2, ModBus_WriteCoil, 1, 0, 0.0f);
+    core_ms += 1000;
+    mbio_poll(STATE_IDLE);
+    CHECK(core_sent_count == 3 && core_sent.adu[3] == 1 && (uint8_t)core_sent.adu[4] == 0xFF);
+    write_behind_ack();
+
+    // a deferred write on the bus is sent first, it is not retried after the direct write
+    m101(2, ModBus_WriteCoil, 1, 1, 1.0f);
+    core_ms += 1000;
+    mbio_poll(STATE_IDLE);
+    CHECK(write_behind.busy && core_sent_count == 4);
+    m101(2, ModBus_WriteCoil, 1, 0, 0.0f);
+    CHECK(core_sent_count == 5 && core_sent.adu[4] == 0);
+    mbio_rx_exception(0, (void *)MBIO_WriteBehind);
+    core_ms += 10000;
+    mbio_poll(STATE_IDLE);
+    CHECK(core_sent_count == 5);
+}
+
+static void test_write_behind_reset(void) {
+    write_behind_setup();
+
+    // waiting writes are dropped, outputs do not change after a reset
+    m101(2, ModBus_WriteRegister, 1, 1, 0.1f);
+    m101(2, ModBus_WriteRegister, 2, 2, 0.5f);
+    core_ms = 100;
+    mbio_poll(STATE_IDLE);
+    CHECK(core_sent_count == 1);
+    mbio_reset();
+    CHECK(!write_behind.busy);
+    core_ms = 1000;
+    mbio_poll(STATE_IDLE);
+    CHECK(core_sent_count == 1);
+}
+
+int main(void) {
+    static const mbio_test_t tests[] = {
+        { "write_behind_coalesce", test_write_behind_coalesce },
+        { "write_behind_order", test_write_behind_order },
+        { "write_behind_retry", test_write_behind_retry },
+        { "write_behind_full", test_write_behind_full },
+        { "write_behind_direct", test_write_behind_direct },
+        { "write_behind_reset", test_write_behind_reset },
+    };
+
+    return mbio_test_run(tests, sizeof(tests) / sizeof(tests[0]));
+}
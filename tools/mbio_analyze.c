@@ -0,0 +1,455 @@
+/*
+
+mbio_analyze.c - summarizes binary logs of the MODBUS I/O plugin for grblHAL
+
+Copyright (c) 2024 Richard Toth
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+Build: cc -O2 -o mbio_analyze tools/mbio_analyze.c
+Usage: mbio_analyze [-b burst gap ms] [-n min burst errors] [-c cycle gap ms] [-v] file...
+
+*/
+
+#define _FILE_OFFSET_BITS 64
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "../modbus_io.h"
+#include "mbio_host.h"
+
+#define WINDOW (64u << 20)      // bytes of the file mapped at once
+#define MAX_STEPS 32            // distinct M-code/function pairs tracked
+
+typedef struct {
+    uint64_t tx;
+    uint64_t rx;
+    uint64_t errors;
+    mbio_hist_t latency;
+} device_t;
+
+typedef struct {
+    uint16_t mcode;
+    uint8_t function;
+    uint64_t failed;
+    uint64_t cycle_time;        // us spent in this step in the current cycle
+    mbio_hist_t duration;       // us per execution
+    mbio_hist_t per_cycle;      // us per cycle
+} step_t;
+
+typedef struct {
+    uint64_t start;
+    uint64_t last;
+    uint64_t count;
+    uint8_t devices[32];        // bitmap
+} burst_t;
+
+static struct {
+    uint32_t burst_gap;
+    uint32_t burst_min;
+    uint32_t cycle_gap;
+    bool verbose;
+} options = { 1000, 3, 2000, false };
+
+static struct {
+    uint64_t bytes;
+    uint64_t records;
+    uint64_t sessions;
+    uint64_t lost;
+    uint64_t corrupt;
+    uint64_t keyframes;
+    uint64_t points;
+    uint32_t last_ts;
+    uint64_t base;
+    device_t *devices[256];
+    step_t steps[MAX_STEPS];
+    uint_fast8_t n_steps;
+    burst_t burst;
+    uint64_t bursts;
+    uint64_t cycle_start;
+    uint64_t cycle_last;
+    uint64_t cycle_steps;
+    uint64_t cycles;
+    mbio_hist_t cycle_time;
+} stats;
+
+static inline uint16_t get_u16(const uint8_t *p) {
+    return p[0] | (p[1] << 8);
+}
+
+static inline uint32_t get_u32(const uint8_t *p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static device_t *get_device(uint8_t address) {
+    if (stats.devices[address] == NULL && (stats.devices[address] = calloc(1, sizeof(device_t))) == NULL) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+
+    return stats.devices[address];
+}
+
+static step_t *get_step(uint16_t mcode, uint8_t function) {
+    for (uint_fast8_t idx = 0; idx < stats.n_steps; idx++) {
+        if (stats.steps[idx].mcode == mcode && stats.steps[idx].function == function) {
+            return &stats.steps[idx];
+        }
+    }
+
+    if (stats.n_steps == MAX_STEPS) {
+        return NULL;
+    }
+
+    stats.steps[stats.n_steps].mcode = mcode;
+    stats.steps[stats.n_steps].function = function;
+
+    return &stats.steps[stats.n_steps++];
+}
+
+static void burst_end(void) {
+    if (stats.burst.count >= options.burst_min) {
+        if (stats.bursts++ == 0) {
+            printf("Error bursts (>= %u errors, gap < %u ms):\n", options.burst_min, options.burst_gap);
+            printf("%14s %12s %8s  %s\n", "start ms", "duration ms", "errors", "devices");
+        }
+        printf("%14llu %12llu %8llu ", (unsigned long long)stats.burst.start,
+                (unsigned long long)(stats.burst.last - stats.burst.start), (unsigned long long)stats.burst.count);
+        for (uint_fast16_t dev = 0; dev < 256; dev++) {
+            if (stats.burst.devices[dev >> 3] & (1 << (dev & 7))) {
+                printf(" %u", (unsigned)dev);
+            }
+        }
+        printf("\n");
+    }
+
+    memset(&stats.burst, 0, sizeof(burst_t));
+}
+
+static void burst_add(uint64_t ts, uint8_t device) {
+    if (stats.burst.count && ts - stats.burst.last > options.burst_gap) {
+        burst_end();
+    }
+
+    if (stats.burst.count++ == 0) {
+        stats.burst.start = ts;
+    }
+    stats.burst.last = ts;
+    stats.burst.devices[device >> 3] |= 1 << (device & 7);
+}
+
+static void cycle_end(void) {
+    if (stats.cycle_steps) {
+        uint64_t duration = stats.cycle_last - stats.cycle_start;
+
+        stats.cycles++;
+        mbio_hist_add(&stats.cycle_time, (uint32_t)duration);
+
+        if (options.verbose) {
+            printf("cycle %llu at %llu ms: %llu ms, %llu steps\n", (unsigned long long)stats.cycles,
+                    (unsigned long long)stats.cycle_start, (unsigned long long)duration, (unsigned long long)stats.cycle_steps);
+        }
+
+        for (uint_fast8_t idx = 0; idx < stats.n_steps; idx++) {
+            if (stats.steps[idx].cycle_time) {
+                mbio_hist_add(&stats.steps[idx].per_cycle, (uint32_t)stats.steps[idx].cycle_time);
+                stats.steps[idx].cycle_time = 0;
+            }
+        }
+    }
+
+    stats.cycle_steps = 0;
+}
+
+static void cycle_add(uint64_t ts, uint32_t duration, step_t *step) {
+    uint64_t start = ts - duration / 1000;
+
+    if (stats.cycle_steps && start - stats.cycle_last > options.cycle_gap) {
+        cycle_end();
+    }
+
+    if (stats.cycle_steps++ == 0) {
+        stats.cycle_start = start;
+    }
+    stats.cycle_last = ts;
+
+    if (step) {
+        step->cycle_time += duration;
+    }
+}
+
+static void session_end(void) {
+    burst_end();
+    cycle_end();
+}
+
+// Timestamps are 32 bit ms counters, make them monotonic.
+static uint64_t unwrap(uint32_t ts) {
+    if (ts < stats.last_ts && stats.last_ts - ts > 0x80000000u) {
+        stats.base += 0x100000000ull;
+    }
+    stats.last_ts = ts;
+
+    return stats.base + ts;
+}
+
+static bool process_record(const uint8_t *r) {
+    uint8_t length = r[0];
+    const uint8_t *payload = r + MBIO_LOG_HEADER;
+    uint64_t ts;
+
+    switch ((mbio_log_record_t)r[1]) {
+
+        case MBIO_LogStart:
+            if (length < 5 || memcmp(payload, "MBIO", 4)) {
+                return false;
+            }
+            session_end();
+            stats.sessions++;
+            stats.base = 0;
+            stats.last_ts = get_u32(r + 2);
+            break;
+
+        case MBIO_LogKeyframe:
+            stats.keyframes++;
+            break;
+
+        case MBIO_LogPoint:
+            stats.points++;
+            break;
+
+        case MBIO_LogTx:
+            if (length < 7) {
+                return false;
+            }
+            get_device(payload[1])->tx++;
+            break;
+
+        case MBIO_LogRx:
+            if (length < 7) {
+                return false;
+            }
+            {
+                device_t *device = get_device(payload[1]);
+                device->rx++;
+                mbio_hist_add(&device->latency, get_u32(payload + 3));
+            }
+            break;
+
+        case MBIO_LogError:
+            if (length < 4) {
+                return false;
+            }
+            get_device(payload[1])->errors++;
+            burst_add(unwrap(get_u32(r + 2)), payload[1]);
+            break;
+
+        case MBIO_LogLost:
+            if (length < 2) {
+                return false;
+            }
+            stats.lost += get_u16(payload);
+            break;
+
+        case MBIO_LogMcode:
+            if (length < 9) {
+                return false;
+            }
+            ts = unwrap(get_u32(r + 2));
+            {
+                step_t *step = get_step(get_u16(payload), payload[3]);
+                uint32_t duration = get_u32(payload + 5);
+                if (step) {
+                    mbio_hist_add(&step->duration, duration);
+                    step->failed += payload[4] != 0;
+                }
+                cycle_add(ts, duration, step);
+            }
+            break;
+
+        default:
+            return false;
+    }
+
+    if (r[1] != MBIO_LogStart) {
+        unwrap(get_u32(r + 2));
+    }
+
+    stats.records++;
+
+    return true;
+}
+
+// Skip to the next start record after corrupted data.
+static const uint8_t *resync(const uint8_t *r, const uint8_t *end) {
+    while (++r + MBIO_LOG_HEADER + 4 <= end) {
+        if (r[0] == 5 && r[1] == MBIO_LogStart && !memcmp(r + MBIO_LOG_HEADER, "MBIO", 4)) {
+            return r;
+        }
+        stats.corrupt++;
+    }
+
+    return r;
+}
+
+static bool analyze_file(const char *path) {
+    int fd;
+    struct stat st;
+    off_t offset = 0;
+    long page = sysconf(_SC_PAGESIZE);
+
+    if ((fd = open(path, O_RDONLY)) < 0 || fstat(fd, &st) < 0) {
+        perror(path);
+        if (fd >= 0) {
+            close(fd);
+        }
+        return false;
+    }
+
+    stats.bytes += st.st_size;
+
+    // The file is mapped window by window so logs of any size are streamed with constant memory use.
+    while (offset < st.st_size) {
+        off_t map_start = offset & ~(off_t)(page - 1);
+        size_t length = st.st_size - map_start > WINDOW ? WINDOW : (size_t)(st.st_size - map_start);
+        bool last = map_start + (off_t)length == st.st_size;
+        uint8_t *map = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, map_start);
+
+        if (map == MAP_FAILED) {
+            perror(path);
+            close(fd);
+            return false;
+        }
+
+        madvise(map, length, MADV_SEQUENTIAL);
+
+        const uint8_t *r = map + (offset - map_start), *end = map + length;
+
+        while (end - r >= MBIO_LOG_HEADER && end - r >= MBIO_LOG_HEADER + r[0]) {
+            if (process_record(r)) {
+                r += MBIO_LOG_HEADER + r[0];
+            }
+            else {
+                stats.corrupt++;
+                r = resync(r, last ? end : end - MBIO_LOG_HEADER - 255);
+            }
+        }
+
+        offset = map_start + (r - map);
+        munmap(map, length);
+
+        if (last) {
+            if (offset < st.st_size) {
+                fprintf(stderr, "%s: %lld bytes of a truncated record at the end\n", path, (long long)(st.st_size - offset));
+            }
+            break;
+        }
+    }
+
+    close(fd);
+
+    return true;
+}
+
+static void report(void) {
+    session_end();
+
+    printf("\n%llu bytes, %llu sessions, %llu records, %llu keyframes, %llu point changes, %llu records lost, %llu corrupt bytes\n",
+            (unsigned long long)stats.bytes, (unsigned long long)stats.sessions, (unsigned long long)stats.records,
+             (unsigned long long)stats.keyframes, (unsigned long long)stats.points,
+              (unsigned long long)stats.lost, (unsigned long long)stats.corrupt);
+
+    printf("\nTransactions per device (round trip time in us):\n");
+    printf("%6s %10s %10s %8s %8s %8s %8s %8s %8s\n", "device", "tx", "rx", "errors", "avg", "p50", "p90", "p99", "max");
+    for (uint_fast16_t dev = 0; dev < 256; dev++) {
+        device_t *device = stats.devices[dev];
+        if (device) {
+            mbio_hist_t *h = &device->latency;
+            printf("%6u %10llu %10llu %8llu %8llu %8u %8u %8u %8u\n", (unsigned)dev,
+                    (unsigned long long)device->tx, (unsigned long long)device->rx, (unsigned long long)device->errors,
+                     (unsigned long long)(h->count ? h->sum / h->count : 0),
+                      mbio_hist_percentile(h, 50.0), mbio_hist_percentile(h, 90.0), mbio_hist_percentile(h, 99.0), h->max);
+        }
+    }
+
+    printf("\n%llu error bursts\n", (unsigned long long)stats.bursts);
+
+    printf("\nATC cycles (M-code sequences with gaps < %u ms): %llu", options.cycle_gap, (unsigned long long)stats.cycles);
+    if (stats.cycles) {
+        printf(", avg %llu ms, p90 %u ms, max %u ms", (unsigned long long)(stats.cycle_time.sum / stats.cycle_time.count),
+                mbio_hist_percentile(&stats.cycle_time, 90.0), stats.cycle_time.max);
+    }
+    printf("\n");
+
+    if (stats.n_steps) {
+        printf("%-10s %10s %8s %12s %10s %10s %14s\n", "step", "count", "failed", "total ms", "avg ms", "max ms", "ms per cycle");
+        for (uint_fast8_t idx = 0; idx < stats.n_steps; idx++) {
+            step_t *step = &stats.steps[idx];
+            char name[16];
+            snprintf(name, sizeof(name), "M%u E%u", step->mcode, step->function);
+            printf("%-10s %10llu %8llu %12.1f %10.2f %10.2f %14.2f\n", name,
+                    (unsigned long long)step->duration.count, (unsigned long long)step->failed,
+                     step->duration.sum / 1000.0, step->duration.sum / 1000.0 / step->duration.count, step->duration.max / 1000.0,
+                      step->per_cycle.count ? step->per_cycle.sum / 1000.0 / step->per_cycle.count : 0.0);
+        }
+    }
+}
+
+int main(int argc, char **argv) {
+    int opt;
+
+    while ((opt = getopt(argc, argv, "b:n:c:v")) != -1) {
+        switch (opt) {
+            case 'b':
+                options.burst_gap = (uint32_t)strtoul(optarg, NULL, 10);
+                break;
+            case 'n':
+                options.burst_min = (uint32_t)strtoul(optarg, NULL, 10);
+                break;
+            case 'c':
+                options.cycle_gap = (uint32_t)strtoul(optarg, NULL, 10);
+                break;
+            case 'v':
+                options.verbose = true;
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-b burst gap ms] [-n min burst errors] [-c cycle gap ms] [-v] file...\n", argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
+    if (optind >= argc) {
+        fprintf(stderr, "usage: %s [-b burst gap ms] [-n min burst errors] [-c cycle gap ms] [-v] file...\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    for (int idx = optind; idx < argc; idx++) {
+        if (!analyze_file(argv[idx])) {
+            return EXIT_FAILURE;
+        }
+    }
+
+    report();
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,484 @@
+/*
+
+mbio_bus.h - simulated MODBUS driver and RS-485 bus for host runs of the MODBUS I/O plugin
+
+Copyright (c) 2024 Richard Toth
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+Included by the host tools after modbus_io.c, the core is the stand-in in tests/core. It puts a model
+of the core MODBUS driver behind modbus_send(): messages are queued FIFO, up to MBIO_BUS_QUEUE, and sent
+one at a time on a virtual clock with byte times, t3.5 gaps, slave turnaround with jitter, lost responses
+and the response timeout. Responses are delivered from the realtime loop like the driver does, a blocking
+message runs the realtime loop until it is completed. The slave is a callback of the tool.
+
+The plugin only acts on a tick of hal.get_elapsed_ticks() or a response, so the realtime loop is run once
+per ms and at each delivery, hours of traffic take seconds. hal.get_micros() and hal.get_elapsed_ticks()
+start at any value, so the wraps can be tested.
+
+The plugin state is static, one bus per process. mbio_bus_fork() runs each of a number of tasks in a child
+process of its own, so every task starts with a clean plugin and tasks run in parallel.
+
+*/
+
+#ifndef _MBIO_BUS_H_
+#define _MBIO_BUS_H_
+
+#include <stdio.h>
+#include <math.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "core.h"
+#include "mbio_host.h"
+
+#define MBIO_BUS_QUEUE 8 // messages queued by the core MODBUS driver
+
+typedef struct {
+    uint32_t baud;
+    uint_fast8_t bits;          // bits per character
+    double turnaround_us;       // mean slave turnaround
+    double jitter_us;           // max deviation from the mean turnaround
+    double loop_us;             // realtime loop period of the controller
+    double timeout_ms;          // response timeout of the driver
+    double error_rate;          // probability of a lost or corrupted response
+    uint64_t seed;
+    uint32_t us_start;          // hal.get_micros() at time 0
+    uint32_t ms_start;          // hal.get_elapsed_ticks() at time 0
+    // Answers the request in msg like a slave sampling at now (us): sets the response in adu and rx_length,
+    // CRC included. Returns false for no response.
+    bool (*slave)(modbus_message_t *msg, double now);
+} mbio_bus_config_t;
+
+typedef struct {
+    modbus_message_t msg;
+    const modbus_callbacks_t *callbacks;
+    double queued;              // us
+    uint32_t generation;        // messages queued before a reset are not delivered
+    uint32_t id;
+} mbio_bus_message_t;
+
+typedef struct {
+    mbio_bus_config_t config;
+    double now;                 // us, virtual time
+    mbio_bus_message_t queue[MBIO_BUS_QUEUE];
+    size_t head;
+    size_t count;
+    bool busy;                  // a transaction is on the bus
+    bool failed;
+    mbio_bus_message_t current;
+    double done;                // us, end of the response or of the timeout
+    double bus_free;            // us, end of the last activity on the bus
+    uint32_t generation;
+    uint32_t next_id;
+    uint32_t completed_id;      // last message delivered
+    bool completed_ok;
+    uint64_t rng;
+    // statistics
+    uint64_t frames;
+    uint64_t errors;
+    uint64_t refused;           // messages not queued as the queue was full
+    double busy_us;             // time with a frame on the wire
+    size_t max_queue;
+    // optional hooks of the tool
+    void (*on_done)(const mbio_bus_message_t *message, bool failed);
+    void (*on_loop)(void);
+} mbio_bus_t;
+
+static mbio_bus_t bus;
+
+static double mbio_bus_random(void) {
+    // xorshift64*
+    bus.rng ^= bus.rng >> 12;
+    bus.rng ^= bus.rng << 25;
+    bus.rng ^= bus.rng >> 27;
+
+    return (double)((bus.rng * 2685821657736338717ull) >> 11) / 9007199254740992.0;
+}
+
+static uint32_t mbio_bus_micros(void) {
+    return bus.config.us_start + (uint32_t)(uint64_t)bus.now;
+}
+
+static uint32_t mbio_bus_ticks(void) {
+    return bus.config.ms_start + (uint32_t)(uint64_t)(bus.now / 1000.0);
+}
+
+static void mbio_bus_noop_state(sys_state_t state) {
+}
+
+static void mbio_bus_noop(void) {
+}
+
+static void mbio_bus_noop_options(bool newopt) {
+}
+
+static sys_commands_t *mbio_bus_no_commands(void) {
+    return NULL;
+}
+
+// Puts the next queued message on the bus when it is free, the slave answers it right away.
+static void mbio_bus_transmit(void) {
+    if (bus.busy || bus.count == 0) {
+        return;
+    }
+
+    const mbio_bus_config_t *cfg = &bus.config;
+    double t35 = mbio_t35_us(cfg->baud, cfg->bits);
+    double tx_start = bus.now > bus.bus_free + t35 ? bus.now : bus.bus_free + t35;
+    double tx_end = tx_start + mbio_frame_us(bus.queue[bus.head].msg.tx_length, cfg->baud, cfg->bits);
+
+    bus.current = bus.queue[bus.head];
+    bus.head = (bus.head + 1) % MBIO_BUS_QUEUE;
+    bus.count--;
+    bus.busy = true;
+    bus.frames++;
+    bus.busy_us += tx_end - tx_start;
+
+    if (mbio_bus_random() < cfg->error_rate || !cfg->slave(&bus.current.msg, tx_end)) {
+        // the response is lost or corrupted, the driver gives up after the timeout
+        bus.failed = true;
+        bus.bus_free = tx_end;
+        bus.done = tx_end + cfg->timeout_ms * 1000.0;
+    }
+    else {
+        double turnaround = cfg->turnaround_us + (mbio_bus_random() * 2.0 - 1.0) * cfg->jitter_us;
+        double rx_start = tx_end + (turnaround > t35 ? turnaround : t35);
+        double rx_end = rx_start + mbio_frame_us(bus.current.msg.rx_length, cfg->baud, cfg->bits);
+
+        bus.failed = false;
+        bus.busy_us += rx_end - rx_start;
+        bus.bus_free = rx_end;
+        bus.done = rx_end;
+    }
+}
+
+// Hands a completed transaction to the plugin, from the realtime loop.
+static void mbio_bus_deliver(void) {
+    if (!bus.busy || bus.now < bus.done) {
+        return;
+    }
+
+    mbio_bus_message_t message = bus.current;
+    bool failed = bus.failed;
+
+    bus.busy = false;
+
+    if (message.generation == bus.generation) {
+        bus.completed_id = message.id;
+        bus.completed_ok = !failed;
+        if (failed) {
+            bus.errors++;
+            message.callbacks->on_rx_exception(0, message.msg.context);
+        }
+        else {
+            message.callbacks->on_rx_packet(&message.msg);
+        }
+        if (bus.on_done) {
+            bus.on_done(&message, failed);
+        }
+    }
+
+    mbio_bus_transmit();
+}
+
+// Time of the next realtime loop iteration that can make a difference to the plugin: the next ms tick or
+// the delivery of the transaction on the bus.
+static double mbio_bus_next(void) {
+    double loop = bus.config.loop_us > 0.0 ? bus.config.loop_us : 1.0;
+    double next = (floor(bus.now / 1000.0) + 1.0) * 1000.0;
+
+    if (bus.busy && bus.done < next) {
+        next = bus.done;
+    }
+
+    next = ceil(next / loop) * loop;
+
+    return next > bus.now ? next : bus.now + loop;
+}
+
+// One iteration of the realtime loop at time: the driver delivers a completed transaction, then the plugin polls.
+static void mbio_bus_loop(double time) {
+    bus.now = time;
+    mbio_bus_deliver();
+    grbl.on_execute_realtime(state_get());
+
+    if (bus.count > bus.max_queue) {
+        bus.max_queue = bus.count;
+    }
+    if (bus.on_loop) {
+        bus.on_loop();
+    }
+}
+
+// protocol_execute_realtime() of the stand-in, e.g. from the M102 wait.
+static void mbio_bus_realtime(void) {
+    mbio_bus_loop(mbio_bus_next());
+}
+
+// Runs the realtime loop until time.
+static void mbio_bus_run(double time) {
+    double next;
+
+    while ((next = mbio_bus_next()) <= time) {
+        mbio_bus_loop(next);
+    }
+
+    if (time > bus.now) {
+        bus.now = time;
+    }
+}
+
+// hal.delay_ms(), the bus goes on, the plugin is not polled.
+static bool mbio_bus_delay(uint32_t ms, void (*callback)(void)) {
+    bus.now += ms * 1000.0;
+
+    if (callback) {
+        callback();
+    }
+
+    return true;
+}
+
+// modbus_send() of the driver model. A blocking message runs the realtime loop until it is completed.
+static bool mbio_bus_send(modbus_message_t *msg, const modbus_callbacks_t *callbacks, bool block) {
+    uint32_t id = ++bus.next_id, generation = bus.generation;
+
+    if (bus.count == MBIO_BUS_QUEUE) {
+        bus.refused++;
+        return false;
+    }
+
+    bus.queue[(bus.head + bus.count++) % MBIO_BUS_QUEUE] = (mbio_bus_message_t){ .msg = *msg, .callbacks = callbacks, .queued = bus.now, .generation = generation, .id = id };
+    mbio_bus_transmit();
+
+    if (!block) {
+        return true;
+    }
+
+    while (bus.completed_id != id && bus.generation == generation) {
+        mbio_bus_realtime();
+    }
+
+    return bus.completed_id == id && bus.completed_ok;
+}
+
+// Number of messages of context in the queue or on the bus, and since when the oldest of them was queued.
+static uint_fast8_t mbio_bus_outstanding(mbio_response_t context, double *since) {
+    uint_fast8_t count = 0;
+
+    if (bus.busy && bus.current.generation == bus.generation && (mbio_response_t)bus.current.msg.context == context) {
+        *since = bus.current.queued;
+        count++;
+    }
+
+    for (size_t idx = 0; idx < bus.count; idx++) {
+        const mbio_bus_message_t *message = &bus.queue[(bus.head + idx) % MBIO_BUS_QUEUE];
+
+        if ((mbio_response_t)message->msg.context == context) {
+            if (count == 0) {
+                *since = message->queued;
+            }
+            count++;
+        }
+    }
+
+    return count;
+}
+
+// A controller reset: the driver queue is flushed, a transaction on the bus completes unseen, then the core
+// calls the reset handlers.
+static void mbio_bus_reset(void) {
+    bus.count = 0;
+    bus.generation++;
+    grbl.on_reset();
+}
+
+// Resets the core stand-in, wires the driver model and the virtual clock to it and initializes the plugin.
+static void mbio_bus_start(const mbio_bus_config_t *config) {
+    memset(&bus, 0, sizeof(bus));
+    bus.config = *config;
+    bus.rng = config->seed ? config->seed : 1;
+    bus.bus_free = -1e9;
+
+    core_init();
+    hal.get_micros = mbio_bus_micros;
+    hal.get_elapsed_ticks = mbio_bus_ticks;
+    hal.delay_ms = mbio_bus_delay;
+    core_send = mbio_bus_send;
+    core_realtime = mbio_bus_realtime;
+
+    grbl.on_report_options = mbio_bus_noop_options;
+    grbl.on_execute_realtime = grbl.on_execute_delay = mbio_bus_noop_state;
+    grbl.on_reset = mbio_bus_noop;
+    grbl.on_get_commands = mbio_bus_no_commands;
+
+    mbio_init();
+}
+
+// Returns the value of word letter in the block or NAN.
+static double mbio_bus_word(const char *block, char letter) {
+    for (const char *s = block; *s; s++) {
+        if (*s == letter) {
+            // no strtod, G-code numbers have no exponent and E is a word
+            const char *v = s + 1;
+            double value = 0.0, scale = 1.0, sign = *v == '-' ? -1.0 : 1.0;
+            bool digits = false;
+
+            if (*v == '-' || *v == '+') {
+                v++;
+            }
+            for (; (*v >= '0' && *v <= '9') || (*v == '.' && scale == 1.0); v++) {
+                if (*v == '.') {
+                    scale = 0.1;
+                }
+                else if (scale == 1.0) {
+                    value = value * 10.0 + (*v - '0');
+                    digits = true;
+                }
+                else {
+                    value += (*v - '0') * scale;
+                    scale /= 10.0;
+                    digits = true;
+                }
+            }
+            if (digits) {
+                return sign * value;
+            }
+        }
+    }
+
+    return NAN;
+}
+
+// Uppercases a line of G-code into block without spaces and comments.
+static void mbio_bus_block(const char *line, char *block, size_t size) {
+    bool comment = false;
+    size_t length = 0;
+
+    for (const char *s = line; *s && *s != ';' && *s != '\n' && length < size - 1; s++) {
+        if (*s == '(') {
+            comment = true;
+        }
+        else if (*s == ')') {
+            comment = false;
+        }
+        else if (!comment && *s != ' ' && *s != '\t' && *s != '\r') {
+            block[length++] = (*s >= 'a' && *s <= 'z') ? *s - 'a' + 'A' : *s;
+        }
+    }
+    block[length] = '\0';
+}
+
+// Runs a block with a M-code of a plugin the way the core does: the M-code is claimed with check, the words
+// are validated and must all be used, then the block is executed. Returns the status the core reports.
+static status_code_t mbio_bus_mcode(const char *block) {
+    parser_block_t gc_block = {0};
+    double m = mbio_bus_word(block, 'M'), value;
+    status_code_t status;
+
+    if (isnan(m) || m != floor(m) || hal.user_mcode.check == NULL ||
+         (gc_block.user_mcode = hal.user_mcode.check((user_mcode_t)m)) == UserMCode_Ignore) {
+        return Status_GcodeUnsupportedCommand;
+    }
+
+#define MBIO_BUS_WORD(letter, word) \
+    if (!isnan(value = mbio_bus_word(block, letter))) { \
+        gc_block.values.word = (float)value; \
+        gc_block.words.word = On; \
+    }
+
+    MBIO_BUS_WORD('D', d)
+    MBIO_BUS_WORD('E', e)
+    MBIO_BUS_WORD('F', f)
+    MBIO_BUS_WORD('H', h)
+    MBIO_BUS_WORD('P', p)
+    MBIO_BUS_WORD('Q', q)
+    MBIO_BUS_WORD('R', r)
+    MBIO_BUS_WORD('S', s)
+    MBIO_BUS_WORD('L', l)
+    MBIO_BUS_WORD('O', o)
+    MBIO_BUS_WORD('T', t)
+
+#undef MBIO_BUS_WORD
+
+    if ((status = hal.user_mcode.validate(&gc_block, NULL)) != Status_OK) {
+        return status;
+    }
+
+    if (gc_block.words.d || gc_block.words.e || gc_block.words.f || gc_block.words.h || gc_block.words.p || gc_block.words.q ||
+         gc_block.words.r || gc_block.words.s || gc_block.words.l || gc_block.words.o || gc_block.words.t) {
+        return Status_GcodeUnusedWords;
+    }
+
+    hal.user_mcode.execute(state_get(), &gc_block);
+
+    return Status_OK;
+}
+
+// Memory shared with the child processes of mbio_bus_fork(), zeroed.
+static void *mbio_bus_shared(size_t size) {
+    void *memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+    if (memory == MAP_FAILED) {
+        perror("mmap");
+        exit(EXIT_FAILURE);
+    }
+
+    return memory;
+}
+
+// Runs run(idx, arg) for idx 0..count-1, each in a child process with a clean plugin, at most jobs at a time.
+// Results go to memory from mbio_bus_shared(). Returns false when a task did not exit with EXIT_SUCCESS.
+static bool mbio_bus_fork(size_t count, long jobs, int (*run)(size_t idx, void *arg), void *arg) {
+    size_t next = 0;
+    long running = 0;
+    bool ok = true;
+    int status;
+
+    fflush(NULL);
+
+    while (next < count || running) {
+        if (next < count && running < (jobs > 0 ? jobs : 1)) {
+            pid_t pid = fork();
+
+            if (pid == 0) {
+                int code = run(next, arg);
+
+                fflush(NULL);
+                _exit(code);
+            }
+            if (pid < 0) {
+                perror("fork");
+                ok = false;
+                count = next;
+                continue;
+            }
+            next++;
+            running++;
+        }
+        else if (wait(&status) > 0) {
+            running--;
+            ok = ok && WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS;
+        }
+        else {
+            break;
+        }
+    }
+
+    return ok;
+}
+
+#endif
@@ -0,0 +1,162 @@
+/*
+
+mbio_host.h - helpers shared by the MODBUS I/O host tools
+
+Copyright (c) 2024 Richard Toth
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef _MBIO_HOST_H_
+#define _MBIO_HOST_H_
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MBIO_HOST_MAX_FRAME 256
+#define MBIO_HIST_SUB 8         // histogram buckets per power of 2
+#define MBIO_HIST_BUCKETS (2 * MBIO_HIST_SUB + 28 * MBIO_HIST_SUB)
+
+// Log scale histogram with ~12% resolution, for percentiles over any number of values in constant memory.
+typedef struct {
+    uint64_t count;
+    uint64_t sum;
+    uint32_t max;
+    uint32_t buckets[MBIO_HIST_BUCKETS];
+} mbio_hist_t;
+
+static inline uint16_t mbio_crc(const uint8_t *data, size_t length) {
+    uint16_t crc = 0xFFFF;
+
+    while (length--) {
+        crc ^= *data++;
+        for (uint_fast8_t bit = 0; bit < 8; bit++) {
+            crc = crc & 0x0001 ? (crc >> 1) ^ 0xA001 : crc >> 1;
+        }
+    }
+
+    return crc;
+}
+
+// Time for one character on the wire, 8 data bits plus start, stop and parity bits.
+static inline double mbio_char_us(uint32_t baud, uint_fast8_t bits) {
+    return bits * 1000000.0 / baud;
+}
+
+// Minimum silent interval between frames, fixed above 19200 baud as per the MODBUS RTU specification.
+static inline double mbio_t35_us(uint32_t baud, uint_fast8_t bits) {
+    return baud > 19200 ? 1750.0 : mbio_char_us(baud, bits) * 3.5;
+}
+
+static inline double mbio_frame_us(uint_fast16_t length, uint32_t baud, uint_fast8_t bits) {
+    return length * mbio_char_us(baud, bits);
+}
+
+static inline uint_fast16_t mbio_hist_index(uint32_t value) {
+    if (value < 2 * MBIO_HIST_SUB) {
+        return value;
+    }
+
+    uint_fast8_t exp = 31 - __builtin_clz(value);
+
+    return 2 * MBIO_HIST_SUB + (exp - 4) * MBIO_HIST_SUB + ((value >> (exp - 3)) & (MBIO_HIST_SUB - 1));
+}
+
+static inline uint32_t mbio_hist_value(uint_fast16_t idx) {
+    if (idx < 2 * MBIO_HIST_SUB) {
+        return idx;
+    }
+
+    uint_fast8_t exp = (idx - 2 * MBIO_HIST_SUB) / MBIO_HIST_SUB + 4, sub = (idx - 2 * MBIO_HIST_SUB) % MBIO_HIST_SUB;
+
+    // middle of the bucket
+    return ((MBIO_HIST_SUB + sub) << (exp - 3)) + (1u << (exp - 4));
+}
+
+static inline void mbio_hist_add(mbio_hist_t *hist, uint32_t value) {
+    hist->count++;
+    hist->sum += value;
+    if (value > hist->max) {
+        hist->max = value;
+    }
+    hist->buckets[mbio_hist_index(value)]++;
+}
+
+static inline void mbio_hist_merge(mbio_hist_t *hist, const mbio_hist_t *other) {
+    hist->count += other->count;
+    hist->sum += other->sum;
+    if (other->max > hist->max) {
+        hist->max = other->max;
+    }
+    for (uint_fast16_t idx = 0; idx < MBIO_HIST_BUCKETS; idx++) {
+        hist->buckets[idx] += other->buckets[idx];
+    }
+}
+
+static inline uint32_t mbio_hist_percentile(const mbio_hist_t *hist, double percentile) {
+    uint64_t rank = (uint64_t)(hist->count * percentile / 100.0), seen = 0;
+
+    for (uint_fast16_t idx = 0; idx < MBIO_HIST_BUCKETS; idx++) {
+        if ((seen += hist->buckets[idx]) > rank) {
+            return mbio_hist_value(idx) > hist->max ? hist->max : mbio_hist_value(idx);
+        }
+    }
+
+    return hist->max;
+}
+
+static inline uint32_t mbio_hist_avg(const mbio_hist_t *hist) {
+    return hist->count ? (uint32_t)(hist->sum / hist->count) : 0;
+}
+
+static inline int mbio_hex_digit(char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+
+    return -1;
+}
+
+// Parses a $MBIOTRACE line [MBT:<us>,<T|R|E>,<hex>], returns the frame length without CRC or -1.
+static inline int mbio_parse_trace(const char *line, uint32_t *timestamp, char *dir, uint8_t *frame) {
+    const char *s = strstr(line, "[MBT:");
+    char *end;
+    int length = 0, hi, lo;
+
+    if (s == NULL) {
+        return -1;
+    }
+
+    *timestamp = (uint32_t)strtoul(s + 5, &end, 10);
+    if (end[0] != ',' || end[1] == '\0' || end[2] != ',') {
+        return -1;
+    }
+
+    *dir = end[1];
+    for (s = end + 3; (hi = mbio_hex_digit(s[0])) >= 0 && (lo = mbio_hex_digit(s[1])) >= 0 && length < MBIO_HOST_MAX_FRAME - 2; s += 2) {
+        frame[length++] = (uint8_t)(hi << 4 | lo);
+    }
+
+    return *s == ']' ? length : -1;
+}
+
+#endif
@@ -0,0 +1,140 @@
+/*
+
+mbio_pcap.c - converts MODBUS I/O plugin frame traces to pcap files
+
+Copyright (c) 2024 Richard Toth
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+Build: cc -O2 -o mbio_pcap tools/mbio_pcap.c
+Usage: mbio_pcap [-s start time s] [-o output.pcap] [console capture]
+
+Reads the output of $MBIOTRACE as captured from the console, other lines are ignored.
+Frames are written with link type DLT_USER0 (147) and the CRC appended. To decode them in
+Wireshark add "mbrtu" as payload protocol for User 0 in Preferences > Protocols > DLT_USER.
+
+*/
+
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "mbio_host.h"
+
+#define LINKTYPE_USER0 147
+
+static void put_u16(uint8_t *p, uint16_t value) {
+    memcpy(p, &value, sizeof(value));
+}
+
+static void put_u32(uint8_t *p, uint32_t value) {
+    memcpy(p, &value, sizeof(value));
+}
+
+int main(int argc, char **argv) {
+    int opt;
+    FILE *in = stdin, *out = NULL;
+    const char *output = "mbio.pcap";
+    uint64_t start = 0, base = 0;
+    uint32_t last = 0;
+    unsigned long frames = 0, exceptions = 0;
+    char line[1024];
+
+    while ((opt = getopt(argc, argv, "s:o:")) != -1) {
+        switch (opt) {
+            case 's':
+                start = strtoull(optarg, NULL, 10);
+                break;
+            case 'o':
+                output = optarg;
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-s start time s] [-o output.pcap] [console capture]\n", argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
+    if (optind < argc && (in = fopen(argv[optind], "r")) == NULL) {
+        perror(argv[optind]);
+        return EXIT_FAILURE;
+    }
+
+    if ((out = fopen(output, "wb")) == NULL) {
+        perror(output);
+        return EXIT_FAILURE;
+    }
+
+    uint8_t header[24];
+    put_u32(header, 0xA1B2C3D4);       // magic, us timestamps
+    put_u16(header + 4, 2);             // version
+    put_u16(header + 6, 4);
+    put_u32(header + 8, 0);             // GMT offset
+    put_u32(header + 12, 0);            // timestamp accuracy
+    put_u32(header + 16, MBIO_HOST_MAX_FRAME);    // snap length
+    put_u32(header + 20, LINKTYPE_USER0);
+    fwrite(header, sizeof(header), 1, out);
+
+    while (fgets(line, sizeof(line), in)) {
+        uint8_t record[16 + MBIO_HOST_MAX_FRAME], *frame = record + 16;
+        uint32_t timestamp;
+        char dir;
+        int length = mbio_parse_trace(line, &timestamp, &dir, frame);
+
+        if (length < 0) {
+            continue;
+        }
+
+        if (dir == 'E') {
+            exceptions++;
+            continue;
+        }
+
+        // the controller timestamps are a 32 bit us counter
+        if (frames && timestamp < last && last - timestamp > 0x80000000u) {
+            base += 0x100000000ull;
+        }
+        last = timestamp;
+
+        uint64_t us = base + timestamp;
+        uint16_t crc = mbio_crc(frame, length);
+
+        frame[length++] = crc & 0xFF;
+        frame[length++] = crc >> 8;
+
+        put_u32(record, (uint32_t)(start + us / 1000000));
+        put_u32(record + 4, (uint32_t)(us % 1000000));
+        put_u32(record + 8, length);
+        put_u32(record + 12, length);
+        fwrite(record, 16 + length, 1, out);
+        frames++;
+    }
+
+    if (in != stdin) {
+        fclose(in);
+    }
+
+    if (fclose(out)) {
+        perror(output);
+        return EXIT_FAILURE;
+    }
+
+    fprintf(stderr, "%lu frames written to %s, %lu exceptions skipped\n", frames, output, exceptions);
+
+    return EXIT_SUCCESS;
+}
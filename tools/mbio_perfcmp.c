@@ -0,0 +1,203 @@
+/*
+
+mbio_perfcmp.c - compares MODBUS I/O plugin benchmark results against a baseline
+
+Copyright (c) 2024 Richard Toth
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+Build: cc -O2 -o mbio_perfcmp tools/mbio_perfcmp.c
+Usage: mbio_perfcmp [-t max avg regression %] [-m max worst case regression %] [-r reference] baseline current
+
+Both files are either CSV files written by $MBIOBENCH=<filename> or console captures of the
+[MBIOBENCH:...] lines. When a benchmark is found several times, e.g. results of several runs appended
+to the same file, the best run is used to keep the comparison robust against interrupts. The exit
+code is 2 when any benchmark regressed more than allowed or is missing in the current results, so it
+can gate a release.
+
+With -r the current results in the unit of the named reference benchmark are scaled by the ratio of
+its baseline and current average, so results of hosts of different speed can be compared.
+
+*/
+
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+
+#define MAX_BENCHES 64
+
+typedef struct {
+    char name[32];
+    char unit[8];
+    uint32_t min;
+    uint32_t avg;
+    uint32_t max;
+} bench_t;
+
+typedef struct {
+    size_t count;
+    bench_t benches[MAX_BENCHES];
+} results_t;
+
+static bench_t *find(results_t *results, const char *name) {
+    for (size_t idx = 0; idx < results->count; idx++) {
+        if (!strcmp(results->benches[idx].name, name)) {
+            return &results->benches[idx];
+        }
+    }
+
+    return NULL;
+}
+
+static bool load(const char *path, results_t *results) {
+    FILE *in;
+    char line[256];
+
+    if ((in = fopen(path, "r")) == NULL) {
+        perror(path);
+        return false;
+    }
+
+    while (fgets(line, sizeof(line), in)) {
+        char *s = strstr(line, "[MBIOBENCH:");
+        bench_t bench = {0};
+        unsigned long iterations, min, avg, max;
+
+        s = s ? s + 11 : line;
+        if (sscanf(s, "%31[^,],%lu,%lu,%lu,%lu,%7[a-z]", bench.name, &iterations, &min, &avg, &max, bench.unit) != 6) {
+            continue;
+        }
+
+        bench.min = (uint32_t)min;
+        bench.avg = (uint32_t)avg;
+        bench.max = (uint32_t)max;
+
+        bench_t *known = find(results, bench.name);
+
+        if (known == NULL && results->count < MAX_BENCHES) {
+            *(known = &results->benches[results->count++]) = bench;
+        } else if (known && bench.avg < known->avg) {
+            *known = bench;
+        }
+    }
+
+    fclose(in);
+
+    return results->count > 0;
+}
+
+static double change(uint32_t baseline, uint32_t current) {
+    return baseline ? ((double)current - baseline) * 100.0 / baseline : 0.0;
+}
+
+int main(int argc, char **argv) {
+    static results_t baseline, current;
+
+    int opt;
+    double max_avg = 10.0, max_worst = -1.0;
+    size_t regressions = 0, missing = 0;
+    const char *reference = NULL;
+
+    while ((opt = getopt(argc, argv, "t:m:r:")) != -1) {
+        switch (opt) {
+            case 't':
+                max_avg = strtod(optarg, NULL);
+                break;
+            case 'm':
+                max_worst = strtod(optarg, NULL);
+                break;
+            case 'r':
+                reference = optarg;
+                break;
+            default:
+                optind = argc;
+                break;
+        }
+    }
+
+    if (argc - optind != 2) {
+        fprintf(stderr, "usage: %s [-t max avg regression %%] [-m max worst case regression %%] [-r reference] baseline current\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    if (!load(argv[optind], &baseline) || !load(argv[optind + 1], &current)) {
+        fprintf(stderr, "no benchmark results found\n");
+        return EXIT_FAILURE;
+    }
+
+    if (reference) {
+        bench_t *base = find(&baseline, reference), *now = find(&current, reference);
+
+        if (base == NULL || now == NULL || now->avg == 0 || strcmp(base->unit, now->unit)) {
+            fprintf(stderr, "reference %s not found in both results\n", reference);
+            return EXIT_FAILURE;
+        }
+
+        double scale = (double)base->avg / now->avg;
+
+        printf("current results in %s scaled by %.3f\n", base->unit, scale);
+        for (size_t idx = 0; idx < current.count; idx++) {
+            bench_t *bench = &current.benches[idx];
+
+            if (!strcmp(bench->unit, base->unit)) {
+                bench->min = (uint32_t)(bench->min * scale + 0.5);
+                bench->avg = (uint32_t)(bench->avg * scale + 0.5);
+                bench->max = (uint32_t)(bench->max * scale + 0.5);
+            }
+        }
+    }
+
+    printf("%-31s %-6s %10s %10s %8s %10s %10s %8s\n", "", "unit", "base avg", "avg", "change", "base max", "max", "change");
+
+    for (size_t idx = 0; idx < current.count; idx++) {
+        bench_t *now = &current.benches[idx], *base = find(&baseline, now->name);
+
+        if (base == NULL) {
+            printf("%-31s %-6s %10s %10u %8s %10s %10u %8s  new\n", now->name, now->unit, "-", now->avg, "", "-", now->max, "");
+            continue;
+        }
+
+        if (strcmp(base->unit, now->unit)) {
+            printf("%-31s unit changed from %s to %s, not compared\n", now->name, base->unit, now->unit);
+            continue;
+        }
+
+        double avg = change(base->avg, now->avg), worst = change(base->max, now->max);
+        bool regressed = avg > max_avg || (max_worst >= 0.0 && worst > max_worst);
+
+        printf("%-31s %-6s %10u %10u %+7.1f%% %10u %10u %+7.1f%%%s\n", now->name, now->unit,
+                base->avg, now->avg, avg, base->max, now->max, worst, regressed ? "  REGRESSED" : "");
+
+        regressions += regressed;
+    }
+
+    for (size_t idx = 0; idx < baseline.count; idx++) {
+        if (find(&current, baseline.benches[idx].name) == NULL) {
+            printf("%-31s missing in %s\n", baseline.benches[idx].name, argv[optind + 1]);
+            missing++;
+        }
+    }
+
+    if (regressions || missing) {
+        printf("\n%zu benchmark(s) regressed, %zu missing\n", regressions, missing);
+        return 2;
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,523 @@
+/*
+
+mbio_replay.c - replays slave responses of a MODBUS I/O frame trace to the controller
+
+Copyright (c) 2024 Richard Toth
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+Build: cc -O2 -DMBIO_HOST -I. -Itests/core -Itools -o mbio_replay tools/mbio_replay.c tests/core/core.c -lm
+Usage: mbio_replay [-b baud] [-p n|e|o] [-s stop bits] [-t max slowdown %] serial device console capture
+       mbio_replay -H gcode [-b baud] [-p n|e|o] [-s stop bits] [-l loop us] [-t max slowdown %] console capture
+
+Acts as the slave(s) of a recorded $MBIOTRACE dump: each request from the controller is answered
+with the recorded response after the recorded slave turnaround time. Run the same G-code on the
+controller as when the trace was captured, then the time the controller spends between transactions
+is compared with the original, so firmware changes can be measured on an identical real workload.
+
+With -H the controller is the plugin of this source tree, built on the host against the core stand-in
+in tests/core, on the simulated bus of mbio_bus.h, so a change is checked before it is flashed. Its
+M-code blocks from the G-code file are run like the core does, G4 dwells run the realtime loop, other
+blocks are skipped. The host has no motion, so a block starts when the time the capture has from the
+last response to the next request has passed. The exit code is 2 when the plugin sends a request that
+is not in the trace, rejects a block or is slower than -t allows.
+
+*/
+
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <termios.h>
+
+#include "core.h"
+#include "modbus_io.c"
+#include "mbio_bus.h"
+
+#define RESYNC_WINDOW 8 // number of recorded transactions searched for a request out of order
+#define HOST_TIMEOUT_MS 50 // host replay, response timeout of the core MODBUS driver
+
+typedef struct {
+    uint8_t request[MBIO_HOST_MAX_FRAME];
+    uint8_t response[MBIO_HOST_MAX_FRAME];
+    int request_length;
+    int response_length;        // 0 when the slave did not answer
+    uint32_t tx_time;           // us, controller time
+    uint32_t rx_time;
+    double turnaround;          // us, slave processing time derived from the trace
+    double gap;                 // us, controller time from the previous response to this request, < 0 for the first one
+    double replay_gap;
+    bool replayed;
+} transaction_t;
+
+static struct {
+    uint32_t baud;
+    char parity;
+    uint_fast8_t stop_bits;
+    double max_slowdown;
+    double loop_us;             // host replay, realtime loop period
+    const char *gcode;          // host replay
+} options = { 19200, 'n', 1, -1.0, 100.0, NULL };
+
+static transaction_t *transactions;
+static size_t n_transactions;
+
+static struct {
+    size_t next;                // first transaction not replayed yet
+    size_t replayed;
+    size_t mismatched;          // requests not in the trace
+    size_t crc_errors;
+    size_t first;
+    size_t last;
+    double last_response;
+    double first_request;
+    double last_request;
+    size_t rejected;            // host replay, blocks rejected by the plugin
+} replay;
+
+static double now_us(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000000.0 + ts.tv_nsec / 1000.0;
+}
+
+static void sleep_until(double us) {
+    double delay = us - now_us();
+
+    if (delay > 0.0) {
+        struct timespec ts = { (time_t)(delay / 1000000.0), (long)(delay * 1000.0) % 1000000000L };
+        nanosleep(&ts, NULL);
+    }
+}
+
+static uint_fast8_t char_bits(void) {
+    return 1 + 8 + (options.parity != 'n') + options.stop_bits;
+}
+
+static bool load_trace(const char *path) {
+    FILE *in;
+    char line[1024];
+    size_t size = 0;
+    transaction_t *pending = NULL;
+
+    if ((in = fopen(path, "r")) == NULL) {
+        perror(path);
+        return false;
+    }
+
+    while (fgets(line, sizeof(line), in)) {
+        uint8_t frame[MBIO_HOST_MAX_FRAME];
+        uint32_t timestamp;
+        char dir;
+        int length = mbio_parse_trace(line, &timestamp, &dir, frame);
+
+        if (length < 0) {
+            continue;
+        }
+
+        switch (dir) {
+
+            case 'T':
+                if (n_transactions == size) {
+                    size = size ? size * 2 : 256;
+                    if ((transactions = realloc(transactions, size * sizeof(transaction_t))) == NULL) {
+                        perror("realloc");
+                        exit(EXIT_FAILURE);
+                    }
+                }
+                pending = &transactions[n_transactions++];
+                memset(pending, 0, sizeof(transaction_t));
+                memcpy(pending->request, frame, length);
+                pending->request_length = length;
+                pending->tx_time = pending->rx_time = timestamp;
+                break;
+
+            case 'R':
+                if (pending) {
+                    memcpy(pending->response, frame, length);
+                    pending->response_length = length;
+                    pending->rx_time = timestamp;
+                    pending = NULL;
+                }
+                break;
+
+            default: // exception, the slave did not answer
+                pending = NULL;
+                break;
+        }
+    }
+
+    fclose(in);
+
+    uint_fast8_t bits = char_bits();
+
+    for (size_t idx = 0; idx < n_transactions; idx++) {
+        transaction_t *t = &transactions[idx];
+
+        if (t->response_length) {
+            t->turnaround = (double)(uint32_t)(t->rx_time - t->tx_time)
+                             - mbio_frame_us(t->request_length + 2, options.baud, bits)
+                              - mbio_frame_us(t->response_length + 2, options.baud, bits);
+            if (t->turnaround < 0.0) {
+                t->turnaround = 0.0;
+            }
+        }
+        t->gap = idx ? (double)(int32_t)(t->tx_time - transactions[idx - 1].rx_time) : -1.0;
+    }
+
+    return n_transactions > 0;
+}
+
+static int open_port(const char *path) {
+    static const struct { uint32_t baud; speed_t speed; } speeds[] = {
+        { 9600, B9600 }, { 19200, B19200 }, { 38400, B38400 }, { 57600, B57600 }, { 115200, B115200 }
+    };
+
+    int fd;
+    struct termios tio;
+    speed_t speed = 0;
+
+    for (size_t idx = 0; idx < sizeof(speeds) / sizeof(speeds[0]); idx++) {
+        if (speeds[idx].baud == options.baud) {
+            speed = speeds[idx].speed;
+        }
+    }
+
+    if (speed == 0) {
+        fprintf(stderr, "unsupported baud rate %u\n", options.baud);
+        return -1;
+    }
+
+    if ((fd = open(path, O_RDWR | O_NOCTTY)) < 0 || tcgetattr(fd, &tio) < 0) {
+        perror(path);
+        return -1;
+    }
+
+    cfmakeraw(&tio);
+    cfsetispeed(&tio, speed);
+    cfsetospeed(&tio, speed);
+    tio.c_cflag |= CLOCAL | CREAD;
+    tio.c_cflag &= ~(PARENB | PARODD | CSTOPB);
+    if (options.parity != 'n') {
+        tio.c_cflag |= PARENB | (options.parity == 'o' ? PARODD : 0);
+    }
+    if (options.stop_bits == 2) {
+        tio.c_cflag |= CSTOPB;
+    }
+    tio.c_cc[VMIN] = 0;
+    tio.c_cc[VTIME] = 0;
+
+    if (tcsetattr(fd, TCSANOW, &tio) < 0) {
+        perror(path);
+        close(fd);
+        return -1;
+    }
+
+    tcflush(fd, TCIOFLUSH);
+
+    return fd;
+}
+
+// Reads one frame, frames are delimited by silence. Returns the length without CRC, 0 on idle, -1 on a CRC error.
+static int read_frame(int fd, uint8_t *frame, double *end, int idle_ms) {
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    int length = 0, gap_ms = (int)(mbio_t35_us(options.baud, char_bits()) / 1000.0) + 2;
+    ssize_t n;
+
+    while (poll(&pfd, 1, length ? gap_ms : idle_ms) > 0) {
+        if ((n = read(fd, frame + length, MBIO_HOST_MAX_FRAME - length)) <= 0) {
+            break;
+        }
+        length += (int)n;
+        *end = now_us();
+        if (length == MBIO_HOST_MAX_FRAME) {
+            break;
+        }
+    }
+
+    if (length < 4) {
+        return length ? -1 : 0;
+    }
+
+    return mbio_crc(frame, length - 2) == (frame[length - 2] | (frame[length - 1] << 8)) ? length - 2 : -1;
+}
+
+static int compare_double(const void *a, const void *b) {
+    double d = *(const double *)a - *(const double *)b;
+
+    return d < 0.0 ? -1 : d > 0.0;
+}
+
+static void report_gaps(const char *label, bool replay) {
+    double *gaps = malloc(n_transactions * sizeof(double)), sum = 0.0;
+    size_t count = 0;
+
+    for (size_t idx = 1; idx < n_transactions && gaps; idx++) {
+        if (transactions[idx].replayed && transactions[idx - 1].replayed) {
+            double gap = replay ? transactions[idx].replay_gap : transactions[idx].gap;
+            gaps[count++] = gap;
+            sum += gap;
+        }
+    }
+
+    if (count) {
+        qsort(gaps, count, sizeof(double), compare_double);
+        printf("%-10s %10zu %12.0f %10.0f %10.0f %10.0f %10.0f\n", label, count, sum, sum / count,
+                gaps[count / 2], gaps[count * 90 / 100], gaps[count - 1]);
+    }
+
+    free(gaps);
+}
+
+// Finds the request started at start (us) in the trace, a few transactions ahead are searched in case requests
+// were skipped. Returns NULL for a request not in the trace.
+static transaction_t *replay_match(const uint8_t *frame, int length, double start) {
+    size_t idx = replay.next, last = replay.next + RESYNC_WINDOW < n_transactions ? replay.next + RESYNC_WINDOW : n_transactions;
+
+    while (idx < last && (transactions[idx].request_length != length || memcmp(transactions[idx].request, frame, length))) {
+        idx++;
+    }
+
+    if (idx == last) {
+        replay.mismatched++;
+        return NULL;
+    }
+
+    transaction_t *t = &transactions[idx];
+
+    t->replayed = true;
+    t->replay_gap = replay.replayed ? start - replay.last_response : -1.0;
+    if (replay.replayed++ == 0) {
+        replay.first = idx;
+        replay.first_request = start;
+    }
+    replay.last = idx;
+    replay.last_request = start;
+    replay.next = idx + 1;
+
+    return t;
+}
+
+static void replay_serial(int fd) {
+    fprintf(stderr, "%zu transactions loaded, waiting for the controller...\n", n_transactions);
+
+    while (replay.next < n_transactions) {
+        uint8_t frame[MBIO_HOST_MAX_FRAME];
+        double end = 0.0;
+        int length = read_frame(fd, frame, &end, replay.replayed ? 10000 : -1);
+        transaction_t *t;
+
+        if (length == 0) {
+            fprintf(stderr, "no request for 10 s, stopping\n");
+            break;
+        }
+
+        if (length < 0) {
+            replay.crc_errors++;
+            continue;
+        }
+
+        if ((t = replay_match(frame, length, end - mbio_frame_us(length + 2, options.baud, char_bits()))) == NULL) {
+            continue;
+        }
+
+        if (t->response_length) {
+            uint8_t response[MBIO_HOST_MAX_FRAME];
+            uint16_t crc = mbio_crc(t->response, t->response_length);
+
+            memcpy(response, t->response, t->response_length);
+            response[t->response_length] = crc & 0xFF;
+            response[t->response_length + 1] = crc >> 8;
+
+            sleep_until(end + t->turnaround);
+            if (write(fd, response, t->response_length + 2) != t->response_length + 2) {
+                perror("write");
+                break;
+            }
+            tcdrain(fd);
+        }
+
+        replay.last_response = now_us();
+    }
+}
+
+// The slave of the host replay: answers with the recorded response after the recorded turnaround.
+static bool replay_slave(modbus_message_t *msg, double now) {
+    int length = msg->tx_length - 2;
+    double t35 = mbio_t35_us(options.baud, char_bits());
+    transaction_t *t = replay_match((const uint8_t *)msg->adu, length, now - mbio_frame_us(msg->tx_length, options.baud, char_bits()));
+
+    if (t == NULL || t->response_length == 0 || t->response_length + 2 > MODBUS_MAX_ADU_SIZE) {
+        replay.last_response = now + bus.config.timeout_ms * 1000.0;
+        return false;
+    }
+
+    memcpy(msg->adu, t->response, t->response_length);
+    msg->rx_length = t->response_length + 2;
+
+    // the bus takes the turnaround from its configuration after the slave answered
+    bus.config.turnaround_us = t->turnaround;
+    replay.last_response = now + fmax(t->turnaround, t35) + mbio_frame_us(msg->rx_length, options.baud, char_bits());
+
+    return true;
+}
+
+// Runs the M-code blocks of the G-code file on the plugin, returns false when the file cannot be read.
+static bool replay_host(const char *path) {
+    FILE *in;
+    char line[256], block[256];
+    unsigned number = 0;
+    mbio_bus_config_t config = {
+        .baud = options.baud,
+        .bits = char_bits(),
+        .loop_us = options.loop_us,
+        .timeout_ms = HOST_TIMEOUT_MS,
+        .slave = replay_slave
+    };
+
+    if ((in = fopen(path, "r")) == NULL) {
+        perror(path);
+        return false;
+    }
+
+    mbio_bus_start(&config);
+
+    while (fgets(line, sizeof(line), in)) {
+        double p;
+        status_code_t status;
+
+        number++;
+        mbio_bus_block(line, block, sizeof(block));
+        p = mbio_bus_word(block, 'P');
+
+        if (mbio_bus_word(block, 'G') == 4.0 && !isnan(p)) {
+            mbio_bus_run(bus.now + p * 1000000.0);
+        }
+        else if (!isnan(mbio_bus_word(block, 'M'))) {
+            // the time between the blocks, motion included, is taken from the capture
+            if (replay.replayed && replay.next < n_transactions && transactions[replay.next].gap > 0.0) {
+                mbio_bus_run(replay.last_response + transactions[replay.next].gap);
+            }
+            // M-codes of the core or other plugins are not claimed by this one
+            if ((status = mbio_bus_mcode(block)) != Status_OK && status != Status_GcodeUnsupportedCommand) {
+                printf("line %u: %s rejected, status %d\n", number, block, (int)status);
+                replay.rejected++;
+            }
+        }
+    }
+
+    fclose(in);
+
+    // the G-code is done, the requests it queued still go out
+    while (bus.busy || bus.count) {
+        mbio_bus_realtime();
+    }
+
+    return true;
+}
+
+int main(int argc, char **argv) {
+    int opt, fd;
+    bool failed = false;
+
+    while ((opt = getopt(argc, argv, "b:p:s:t:l:H:")) != -1) {
+        switch (opt) {
+            case 'b':
+                options.baud = (uint32_t)strtoul(optarg, NULL, 10);
+                break;
+            case 'p':
+                options.parity = optarg[0];
+                break;
+            case 's':
+                options.stop_bits = optarg[0] == '2' ? 2 : 1;
+                break;
+            case 't':
+                options.max_slowdown = strtod(optarg, NULL);
+                break;
+            case 'l':
+                options.loop_us = strtod(optarg, NULL);
+                break;
+            case 'H':
+                options.gcode = optarg;
+                break;
+            default:
+                optind = argc;
+                break;
+        }
+    }
+
+    if (argc - optind != (options.gcode ? 1 : 2)) {
+        fprintf(stderr, "usage: %s [-b baud] [-p n|e|o] [-s stop bits] [-t max slowdown %%] serial device console capture\n"
+                         "       %s -H gcode [-b baud] [-p n|e|o] [-s stop bits] [-l loop us] [-t max slowdown %%] console capture\n", argv[0], argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    const char *capture = argv[argc - 1];
+
+    if (!load_trace(capture)) {
+        fprintf(stderr, "%s: no transactions found\n", capture);
+        return EXIT_FAILURE;
+    }
+
+    if (options.gcode) {
+        if (!replay_host(options.gcode)) {
+            return EXIT_FAILURE;
+        }
+    }
+    else {
+        if ((fd = open_port(argv[optind])) < 0) {
+            return EXIT_FAILURE;
+        }
+        replay_serial(fd);
+        close(fd);
+    }
+
+    printf("%zu of %zu transactions replayed, %zu requests not in the trace, %zu CRC errors\n",
+            replay.replayed, n_transactions, replay.mismatched, replay.crc_errors);
+    printf("\nController time between a response and the next request (us):\n");
+    printf("%-10s %10s %12s %10s %10s %10s %10s\n", "", "count", "total", "avg", "p50", "p90", "max");
+    report_gaps("original", false);
+    report_gaps("replay", true);
+
+    // both spans from the first to the last transaction replayed, requests skipped at the start are not counted
+    double original = (double)(uint32_t)(transactions[replay.last].tx_time - transactions[replay.first].tx_time);
+    double replayed = replay.last_request - replay.first_request;
+
+    if (options.gcode && (replay.mismatched || replay.rejected)) {
+        printf("\nthe plugin sent %zu requests not in the trace and rejected %zu blocks\n", replay.mismatched, replay.rejected);
+        failed = true;
+    }
+
+    if (original > 0.0 && replay.replayed > 1) {
+        double slowdown = (replayed - original) * 100.0 / original;
+
+        printf("\nfirst to last request: original %.0f us, replay %.0f us, %+.1f %%\n", original, replayed, slowdown);
+
+        if (options.max_slowdown >= 0.0 && slowdown > options.max_slowdown) {
+            printf("slower than the allowed %.1f %%\n", options.max_slowdown);
+            failed = true;
+        }
+    }
+
+    return failed ? 2 : EXIT_SUCCESS;
+}
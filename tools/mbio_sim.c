@@ -0,0 +1,1449 @@
+/*
+
+mbio_sim.c - discrete event simulation of the MODBUS I/O plugin traffic on a RS-485 bus
+
+Copyright (c) 2024 Richard Toth
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+Build: cc -O2 -pthread -DMBIO_HOST -I. -Itests/core -Itools -o mbio_sim tools/mbio_sim.c tests/core/core.c -lm
+Usage: mbio_sim [options], see usage() below
+
+Models the controller side as the plugin drives it: requests are issued from the realtime loop,
+queued FIFO by the core MODBUS driver and sent one at a time, responses are handled on the next
+realtime loop iteration. On the bus byte times, t3.5 gaps, slave turnaround with jitter, lost
+responses and response timeouts are modelled. Time is virtual, so hours of traffic are simulated
+in a fraction of a second and whole sweeps over baud rates, device counts and poll periods can be run.
+Every configuration can be simulated for a fleet of independent machines, each with its own bus and
+random seed, the simulations are spread over a pool of threads and their statistics are aggregated.
+
+The soak mode (-S) runs the plugin itself, built against the core stand-in in tests/core, on the simulated
+driver and bus of mbio_bus.h: M104 scans an input of every device, M103 samples a register and M101 blocks
+are executed at randomized times, with bursts of lost responses and controller resets, for hours of virtual
+time. It checks that the requests the plugin waits for are exactly the ones queued and on the bus, no request
+is stuck longer than the worst case, the M-code times measured on the 32 bit us tick survive its wraps and
+latency does not drift between the first and the last window of the run. The exit code is 2 when any check
+fails. The sweeps and the mode comparison (-M) stay models, they compare configurations and designs the
+plugin is not built for.
+
+*/
+
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "core.h"
+#include "modbus_io.c"
+#include "mbio_bus.h"
+
+#define MAX_SOURCES 64
+#define MAX_LIST 16
+#define WAIT_STEP_MS 50.0 // M102 poll delay of the plugin
+
+typedef enum {
+    Class_Poll = 0,     // periodic input poll per device
+    Class_Sample,       // M103 sampler
+    Class_Mcode,        // blocking M101 from the G-code stream
+    Class_N
+} sim_class_t;
+
+static const char *const class_name[Class_N] = { "poll", "sample", "mcode" };
+
+typedef struct {
+    uint32_t baud;
+    uint_fast8_t bits;          // bits per character
+    uint_fast16_t devices;
+    double poll_ms;             // input poll period per device, 0 for none
+    double sample_ms;           // sampler period, 0 for none
+    double mcode_ms;            // period of blocking M101 writes, 0 for none
+    double turnaround_us;       // mean slave turnaround
+    double jitter_us;           // max deviation from the mean turnaround
+    double loop_us;             // realtime loop period of the controller
+    double timeout_ms;          // response timeout of the core MODBUS driver
+    double error_rate;          // probability of a lost or corrupted response
+    double duration_s;          // virtual time to simulate
+    uint32_t seed;
+    bool soak;                  // randomize timing, inject error bursts and resets, check invariants
+    double reset_min;           // mean time between controller resets in soak mode, 0 for none
+    double burst_rate;          // probability of a lost response during an error burst in soak mode
+} sim_config_t;
+
+typedef struct {
+    uint64_t frames;
+    uint64_t errors;
+    uint64_t overruns;          // periodic requests skipped as the previous one was still in flight
+    uint64_t events;
+    uint_fast16_t machines;     // number of simulations aggregated
+    double busy_us;             // time with a frame on the wire
+    double duration_us;
+    double util_max;            // highest bus utilization of the aggregated simulations, %
+    double wall_s;              // real time the simulations took
+    mbio_hist_t latency[Class_N];   // us from when the request was due to the response callback
+    // soak mode
+    uint64_t resets;
+    uint64_t bursts;
+    uint64_t wraps;             // 32 bit us tick wraps
+    uint64_t tick_errors;       // latencies computed from the wrapped ticks that do not match the real ones
+    uint64_t leaks;             // busy sources not accounted for by the queue, the bus or pending requests
+    uint64_t stuck;             // requests outstanding longer than the worst case
+    size_t max_queue;
+    mbio_hist_t first[Class_N];     // latency in the first and last window of the run, for drift
+    mbio_hist_t last[Class_N];
+} sim_result_t;
+
+typedef struct {
+    sim_class_t cls;
+    uint8_t device;
+    uint8_t function;
+    double period;              // us
+    bool busy;
+} sim_source_t;
+
+typedef enum {
+    Event_Due = 0,
+    Event_Enqueue,
+    Event_Done,
+} sim_event_type_t;
+
+typedef struct {
+    double time;
+    sim_event_type_t type;
+    uint_fast16_t source;
+    double due;
+    bool failed;
+} sim_event_t;
+
+// All state of one simulation, nothing is shared so simulations can run concurrently.
+typedef struct {
+    const sim_config_t *config;
+    sim_result_t *result;
+    sim_source_t sources[MAX_SOURCES];
+    uint_fast16_t n_sources;
+    sim_event_t *heap;
+    size_t heap_size;
+    size_t heap_count;
+    sim_event_t *queue;         // requests waiting in the MODBUS driver
+    size_t queue_head;
+    size_t queue_count;
+    bool master_busy;
+    double bus_free;            // end of the last activity on the bus
+    uint64_t rng;
+} sim_t;
+
+static double rnd(sim_t *sim) {
+    // xorshift64*
+    sim->rng ^= sim->rng >> 12;
+    sim->rng ^= sim->rng << 25;
+    sim->rng ^= sim->rng >> 27;
+
+    return (double)((sim->rng * 2685821657736338717ull) >> 11) / 9007199254740992.0;
+}
+
+static void push(sim_t *sim, sim_event_t event) {
+    if (sim->heap_count == sim->heap_size) {
+        sim->heap_size = sim->heap_size ? sim->heap_size * 2 : 64;
+        if ((sim->heap = realloc(sim->heap, sim->heap_size * sizeof(sim_event_t))) == NULL) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    size_t idx = sim->heap_count++;
+
+    while (idx && sim->heap[(idx - 1) / 2].time > event.time) {
+        sim->heap[idx] = sim->heap[(idx - 1) / 2];
+        idx = (idx - 1) / 2;
+    }
+    sim->heap[idx] = event;
+}
+
+static sim_event_t pop(sim_t *sim) {
+    sim_event_t top = sim->heap[0], last = sim->heap[--sim->heap_count];
+    size_t idx = 0, child;
+
+    while ((child = idx * 2 + 1) < sim->heap_count) {
+        if (child + 1 < sim->heap_count && sim->heap[child + 1].time < sim->heap[child].time) {
+            child++;
+        }
+        if (last.time <= sim->heap[child].time) {
+            break;
+        }
+        sim->heap[idx] = sim->heap[child];
+        idx = child;
+    }
+    sim->heap[idx] = last;
+
+    return top;
+}
+
+// The plugin and the MODBUS driver only act from the realtime loop.
+static double loop_time(const sim_config_t *config, double time) {
+    return config->loop_us > 0.0 ? ceil(time / config->loop_us) * config->loop_us : time;
+}
+
+static double next_loop(sim_t *sim, double time) {
+    return loop_time(sim->config, time);
+}
+
+static uint_fast8_t response_length(uint8_t function) {
+    switch (function) {
+        case 1:
+        case 2:
+            return 6;
+        case 3:
+        case 4:
+            return 7;
+        default:
+            return 8;
+    }
+}
+
+static void add_source(sim_t *sim, sim_class_t cls, uint8_t device, uint8_t function, double period_ms, double phase) {
+    if (period_ms > 0.0 && sim->n_sources < MAX_SOURCES) {
+        sim_source_t *source = &sim->sources[sim->n_sources];
+
+        source->cls = cls;
+        source->device = device;
+        source->function = function;
+        source->period = period_ms * 1000.0;
+        source->busy = false;
+
+        push(sim, (sim_event_t){ .time = phase * source->period, .type = Event_Due, .source = sim->n_sources++ });
+    }
+}
+
+static void start_next(sim_t *sim, double now) {
+    if (sim->master_busy || sim->queue_count == 0) {
+        return;
+    }
+
+    const sim_config_t *cfg = sim->config;
+    sim_event_t request = sim->queue[sim->queue_head];
+    sim_source_t *source = &sim->sources[request.source];
+    double t35 = mbio_t35_us(cfg->baud, cfg->bits);
+    double tx_start = now > sim->bus_free + t35 ? now : sim->bus_free + t35;
+    double tx_end = tx_start + mbio_frame_us(8, cfg->baud, cfg->bits);
+
+    sim->queue_head = (sim->queue_head + 1) % MAX_SOURCES;
+    sim->queue_count--;
+    sim->master_busy = true;
+    sim->result->frames++;
+    sim->result->busy_us += tx_end - tx_start;
+
+    if (rnd(sim) < cfg->error_rate) {
+        // the response is lost or corrupted, the driver gives up after the timeout
+        sim->bus_free = tx_end;
+        request.failed = true;
+        request.time = tx_end + cfg->timeout_ms * 1000.0;
+    }
+    else {
+        double turnaround = cfg->turnaround_us + (rnd(sim) * 2.0 - 1.0) * cfg->jitter_us;
+        double rx_start = tx_end + (turnaround > t35 ? turnaround : t35);
+        double rx_end = rx_start + mbio_frame_us(response_length(source->function), cfg->baud, cfg->bits);
+
+        sim->result->busy_us += rx_end - rx_start;
+        sim->bus_free = rx_end;
+        request.failed = false;
+        request.time = rx_end;
+    }
+
+    request.type = Event_Done;
+    push(sim, request);
+}
+
+// The controller time stamps with a 32 bit us counter.
+static uint32_t ticks(double time) {
+    return (uint32_t)(uint64_t)time;
+}
+
+static void handle(sim_t *sim, sim_event_t event) {
+    sim_source_t *source = &sim->sources[event.source];
+
+    switch (event.type) {
+
+        case Event_Due:
+            if (source->busy) {
+                sim->result->overruns++;
+            }
+            else {
+                source->busy = true;
+                push(sim, (sim_event_t){ .time = next_loop(sim, event.time), .type = Event_Enqueue, .source = event.source, .due = event.time });
+            }
+            event.time += source->period;
+            push(sim, event);
+            break;
+
+        case Event_Enqueue:
+            sim->queue[(sim->queue_head + sim->queue_count++) % MAX_SOURCES] = event;
+            start_next(sim, event.time);
+            break;
+
+        case Event_Done:
+            event.time = next_loop(sim, event.time);
+            sim->master_busy = false;
+            source->busy = false;
+            if (event.failed) {
+                sim->result->errors++;
+            }
+            mbio_hist_add(&sim->result->latency[source->cls], ticks(event.time) - ticks(event.due));
+            start_next(sim, event.time);
+            break;
+    }
+}
+
+static void sim_run(const sim_config_t *config, sim_result_t *result) {
+    sim_t sim = { .config = config, .result = result, .rng = config->seed ? config->seed : 1 };
+    double end = config->duration_s * 1000000.0;
+    struct timespec t0, t1;
+
+    memset(result, 0, sizeof(sim_result_t));
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    // each source has at most one request queued, so the driver queue never holds more than MAX_SOURCES
+    if ((sim.queue = malloc(MAX_SOURCES * sizeof(sim_event_t))) == NULL) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    for (uint_fast16_t device = 0; device < config->devices; device++) {
+        add_source(&sim, Class_Poll, device + 1, 2, config->poll_ms, (double)device / config->devices);
+    }
+    add_source(&sim, Class_Sample, 1, 4, config->sample_ms, 0.0);
+    add_source(&sim, Class_Mcode, 1, 5, config->mcode_ms, 0.5);
+
+    while (sim.heap_count && sim.heap[0].time < end) {
+        sim_event_t event = pop(&sim);
+
+        handle(&sim, event);
+        result->events++;
+    }
+
+    result->machines = 1;
+    result->duration_us = end;
+    result->util_max = result->busy_us * 100.0 / end;
+
+    free(sim.heap);
+    free(sim.queue);
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    result->wall_s = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+}
+
+static void sim_merge(sim_result_t *total, const sim_result_t *result) {
+    total->frames += result->frames;
+    total->errors += result->errors;
+    total->overruns += result->overruns;
+    total->events += result->events;
+    total->machines += result->machines;
+    total->busy_us += result->busy_us;
+    total->duration_us += result->duration_us;
+    total->wall_s += result->wall_s;
+    if (result->util_max > total->util_max) {
+        total->util_max = result->util_max;
+    }
+    for (uint_fast8_t cls = 0; cls < Class_N; cls++) {
+        mbio_hist_merge(&total->latency[cls], &result->latency[cls]);
+        mbio_hist_merge(&total->first[cls], &result->first[cls]);
+        mbio_hist_merge(&total->last[cls], &result->last[cls]);
+    }
+    total->resets += result->resets;
+    total->bursts += result->bursts;
+    total->wraps += result->wraps;
+    total->tick_errors += result->tick_errors;
+    total->leaks += result->leaks;
+    total->stuck += result->stuck;
+    if (result->max_queue > total->max_queue) {
+        total->max_queue = result->max_queue;
+    }
+}
+
+typedef struct {
+    sim_config_t config;
+    sim_result_t result;
+} sim_task_t;
+
+typedef struct {
+    sim_task_t *tasks;
+    size_t count;
+    size_t next;
+} sim_pool_t;
+
+static void *sim_worker(void *arg) {
+    sim_pool_t *pool = arg;
+    size_t idx;
+
+    while ((idx = __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED)) < pool->count) {
+        sim_run(&pool->tasks[idx].config, &pool->tasks[idx].result);
+    }
+
+    return NULL;
+}
+
+// Runs all tasks on a pool of threads, one bus per task.
+static void sim_run_all(sim_task_t *tasks, size_t count, long jobs) {
+    sim_pool_t pool = { .tasks = tasks, .count = count, .next = 0 };
+    pthread_t *threads;
+    long started = 0;
+
+    if (jobs > (long)count) {
+        jobs = (long)count;
+    }
+
+    if (jobs > 1 && (threads = calloc(jobs, sizeof(pthread_t)))) {
+        while (started < jobs && pthread_create(&threads[started], NULL, sim_worker, &pool) == 0) {
+            started++;
+        }
+        sim_worker(&pool);
+        while (started) {
+            pthread_join(threads[--started], NULL);
+        }
+        free(threads);
+    }
+    else {
+        sim_worker(&pool);
+    }
+}
+
+static size_t parse_list(const char *arg, double *list) {
+    size_t count = 0;
+    char *end;
+
+    while (count < MAX_LIST) {
+        list[count++] = strtod(arg, &end);
+        if (*end != ',') {
+            break;
+        }
+        arg = end + 1;
+    }
+
+    return count;
+}
+
+/*
+ * Soak test: the plugin itself, modbus_io.c on the core stand-in, drives the driver model of mbio_bus.h. The input
+ * poll is the scan of M104 points, one per device every MBIO_SCAN_INTERVAL ms, the sampler is M103 and the blocking
+ * writes are M101 blocks run like the core does.
+ */
+
+static struct {
+    sim_result_t *result;
+    double window;              // length of the first and last window for the drift check
+    double end;
+    double stuck_us;            // worst case time a request can be outstanding
+    double stuck_since;         // queue time of the request last counted as stuck
+    uint32_t last_us;
+    bool leaking;               // the plugin and the driver disagree, counted once until they agree again
+    uint16_t coil;
+} soak;
+
+// Devices answer every request that fits the ADU, inputs and registers follow the time.
+static bool soak_slave(modbus_message_t *msg, double now) {
+    uint16_t count = modbus_read_u16((uint8_t *)&msg->adu[4]), value = (uint16_t)(now / 1000.0);
+
+    switch (msg->adu[1]) {
+
+        case ModBus_ReadCoils:
+        case ModBus_ReadDiscreteInputs:
+            if (5 + (count + 7) / 8 > MODBUS_MAX_ADU_SIZE) {
+                return false;
+            }
+            msg->adu[2] = (count + 7) / 8;
+            for (uint_fast8_t idx = 0; idx < msg->adu[2]; idx++) {
+                msg->adu[3 + idx] = (char)(value >> (idx * 3));
+            }
+            msg->rx_length = 5 + msg->adu[2];
+            break;
+
+        case ModBus_ReadHoldingRegisters:
+        case ModBus_ReadInputRegisters:
+            if (5 + count * 2 > MODBUS_MAX_ADU_SIZE) {
+                return false;
+            }
+            msg->adu[2] = count * 2;
+            for (uint_fast8_t idx = 0; idx < count; idx++) {
+                msg->adu[3 + idx * 2] = MODBUS_SET_MSB16(value + idx);
+                msg->adu[4 + idx * 2] = MODBUS_SET_LSB16(value + idx);
+            }
+            msg->rx_length = 5 + count * 2;
+            break;
+
+        default: // writes are echoed
+            msg->rx_length = 8;
+            break;
+    }
+
+    return true;
+}
+
+static void soak_latency(sim_class_t cls, double due, double latency) {
+    mbio_hist_add(&soak.result->latency[cls], (uint32_t)latency);
+    if (due < soak.window) {
+        mbio_hist_add(&soak.result->first[cls], (uint32_t)latency);
+    }
+    else if (due >= soak.end - soak.window) {
+        mbio_hist_add(&soak.result->last[cls], (uint32_t)latency);
+    }
+}
+
+static void soak_done(const mbio_bus_message_t *message, bool failed) {
+    switch ((mbio_response_t)message->msg.context) {
+        case MBIO_Scan:
+            soak_latency(Class_Poll, message->queued, bus.now - message->queued);
+            break;
+        case MBIO_Sample:
+            soak_latency(Class_Sample, message->queued, bus.now - message->queued);
+            break;
+        default:
+            break;
+    }
+}
+
+// Checked after every realtime loop iteration: the requests the plugin waits for are the ones in the driver queue
+// and on the bus, in the same order, its busy flags match them and none is outstanding longer than the worst case.
+static void soak_check(void) {
+    static const struct {
+        mbio_response_t context;
+        const bool *busy;
+    } flags[] = {
+        { MBIO_Sample, &sampler.busy },
+        { MBIO_Scan, &scan.busy },
+        { MBIO_WriteBehind, &write_behind.busy },
+        { MBIO_Adapt, &adapt.busy },
+        { MBIO_Thermal, &thermal.busy },
+    };
+    uint_fast8_t outstanding = 0;
+    bool leak = false;
+    double since;
+
+    if (bus.busy && bus.current.generation == bus.generation) {
+        leak = pending.count == 0 || pending.order[0] != (mbio_response_t)bus.current.msg.context;
+        outstanding++;
+    }
+    for (size_t idx = 0; idx < bus.count && !leak; idx++, outstanding++) {
+        leak = outstanding >= pending.count || pending.order[outstanding] != (mbio_response_t)bus.queue[(bus.head + idx) % MBIO_BUS_QUEUE].msg.context;
+    }
+    leak = leak || outstanding != pending.count;
+
+    for (size_t idx = 0; idx < sizeof(flags) / sizeof(flags[0]); idx++) {
+        uint_fast8_t count = mbio_bus_outstanding(flags[idx].context, &since);
+
+        leak = leak || count > 1 || (count == 1) != *flags[idx].busy;
+        if (count && bus.now - since > soak.stuck_us && since != soak.stuck_since) {
+            soak.stuck_since = since;
+            soak.result->stuck++;
+        }
+    }
+
+    if (leak && !soak.leaking) {
+        soak.result->leaks++;
+    }
+    soak.leaking = leak;
+
+    if (mbio_bus_micros() < soak.last_us) {
+        soak.result->wraps++;
+    }
+    soak.last_us = mbio_bus_micros();
+}
+
+// Total of the M-code execution times the plugin recorded, us.
+static uint64_t soak_mcode_us(void) {
+    uint64_t sum = 0;
+
+    for (uint_fast8_t idx = 0; idx < latency.count; idx++) {
+        sum += latency.slots[idx].sum;
+    }
+
+    return sum;
+}
+
+// A blocking M101 write, the time the plugin measures across the wrapping us tick must match the virtual time.
+static void soak_mcode(double due) {
+    char block[32];
+    double start = bus.now;
+    uint64_t recorded = soak_mcode_us();
+
+    snprintf(block, sizeof(block), "M101D1E5P1Q%u", soak.coil ^= 1);
+    if (mbio_bus_mcode(block) != Status_OK) {
+        soak.result->tick_errors++;
+    }
+
+    if (fabs((double)(soak_mcode_us() - recorded) - floor(bus.now - start)) > 1.0) {
+        soak.result->tick_errors++;
+    }
+    soak_latency(Class_Mcode, due, bus.now - due);
+}
+
+static int soak_run(size_t idx, void *arg) {
+    sim_task_t *task = &((sim_task_t *)arg)[idx];
+    const sim_config_t *config = &task->config;
+    sim_result_t *result = &task->result;
+    double end = config->duration_s * 1000000.0, mcode_period = config->mcode_ms * 1000.0;
+    double next_mcode = mcode_period > 0.0 ? mcode_period / 2.0 : INFINITY, next_reset = INFINITY, next_burst = INFINITY, burst_end = INFINITY;
+    double t35 = mbio_t35_us(config->baud, config->bits), reply = config->turnaround_us + config->jitter_us;
+    double transaction = mbio_frame_us(MODBUS_MAX_ADU_SIZE, config->baud, config->bits) + t35 + config->loop_us
+                          + fmax(config->timeout_ms * 1000.0, fmax(reply, t35) + mbio_frame_us(MODBUS_MAX_ADU_SIZE, config->baud, config->bits));
+    mbio_bus_config_t bus_config = {
+        .baud = config->baud,
+        .bits = config->bits,
+        .turnaround_us = config->turnaround_us,
+        .jitter_us = config->jitter_us,
+        .loop_us = config->loop_us,
+        .timeout_ms = config->timeout_ms,
+        .error_rate = config->error_rate,
+        .seed = config->seed,
+        .us_start = (uint32_t)(0x100000000ull - 10000000ull),   // wraps after 10 s
+        .ms_start = (uint32_t)(0x100000000ull - 600000ull),     // wraps after 10 min
+        .slave = soak_slave
+    };
+    char block[32];
+    struct timespec t0, t1;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    memset(result, 0, sizeof(sim_result_t));
+
+    mbio_bus_start(&bus_config);
+    bus.on_done = soak_done;
+    bus.on_loop = soak_check;
+    core_state = STATE_CYCLE;
+
+    soak.result = result;
+    soak.end = end;
+    soak.window = fmin(3600000000.0, end / 4.0);
+    soak.stuck_us = (MBIO_Contexts + 1) * transaction + 2.0 * config->loop_us;
+    soak.stuck_since = -1.0;
+    soak.last_us = mbio_bus_micros();
+
+    for (uint_fast16_t device = 1; device <= config->devices; device++) {
+        snprintf(block, sizeof(block), "M104D%uE2P1", (unsigned)device);
+        if (mbio_bus_mcode(block) != Status_OK) {
+            fprintf(stderr, "%s failed, more devices than MBIO_SCAN_POINTS?\n", block);
+            return EXIT_FAILURE;
+        }
+    }
+    if (config->sample_ms > 0.0) {
+        snprintf(block, sizeof(block), "M103D1E4P1R%g", config->sample_ms / 1000.0);
+        if (mbio_bus_mcode(block) != Status_OK) {
+            fprintf(stderr, "%s failed\n", block);
+            return EXIT_FAILURE;
+        }
+    }
+    if (config->reset_min > 0.0) {
+        next_reset = -log(1.0 - mbio_bus_random()) * config->reset_min * 60000000.0;
+    }
+    if (config->burst_rate > 0.0) {
+        next_burst = -log(1.0 - mbio_bus_random()) * 600000000.0;
+    }
+
+    while (bus.now < end) {
+        double next = fmin(fmin(end, next_mcode), fmin(fmin(next_reset, next_burst), burst_end));
+
+        mbio_bus_run(next);
+
+        if (bus.now >= burst_end) {
+            bus.config.error_rate = config->error_rate;
+            burst_end = INFINITY;
+        }
+        if (bus.now >= next_burst) {
+            // a burst of noise on the bus for up to a second, on average every ten minutes
+            bus.config.error_rate = config->burst_rate;
+            burst_end = bus.now + mbio_bus_random() * 1000000.0;
+            next_burst = bus.now - log(1.0 - mbio_bus_random()) * 600000000.0;
+            result->bursts++;
+        }
+        if (bus.now >= next_reset) {
+            mbio_bus_reset();
+            next_reset = bus.now - log(1.0 - mbio_bus_random()) * config->reset_min * 60000000.0;
+            result->resets++;
+        }
+        if (bus.now >= next_mcode) {
+            double due = next_mcode;
+
+            next_mcode += mcode_period * (0.8 + mbio_bus_random() * 0.4);
+            soak_mcode(due);
+        }
+    }
+
+    result->frames = bus.frames;
+    result->errors = bus.errors;
+    result->busy_us = bus.busy_us;
+    result->max_queue = bus.max_queue;
+    result->events = bus.frames;
+    result->machines = 1;
+    result->duration_us = end;
+    result->util_max = result->busy_us * 100.0 / end;
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    result->wall_s = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+
+    return EXIT_SUCCESS;
+}
+
+/*
+ * Mode comparison: a G-code job is run as a sequence of steps on one bus, without randomness, once per mode.
+ */
+
+typedef enum {
+    Mode_Blocking = 0,  // every M101/M102 waits for its transaction, as the plugin does today
+    Mode_Async,         // writes are queued and the G-code continues, reads still wait
+    Mode_Cached,        // writes are queued, reads and waits are served from the I/O image kept fresh by polling
+    Mode_Batched,       // as async, with adjacent reads and queued writes merged into multi point frames
+    Mode_N
+} sim_mode_t;
+
+static const char *const mode_name[Mode_N] = { "blocking", "async", "cached", "batched" };
+
+typedef enum {
+    Step_Write = 0,     // M101 E5/E6
+    Step_Read,          // M101 E1-E4, the value is used by the next block
+    Step_Wait,          // M102, the input changes after the given time
+    Step_Motion,        // motion without MODBUS traffic
+    Step_Repeat         // repeats the steps from the given index the given number of times
+} step_type_t;
+
+typedef struct {
+    step_type_t type;
+    uint8_t device;
+    uint8_t function;
+    uint16_t address;
+    double ms;          // motion time, time until the input changes or repeat count
+} step_t;
+
+typedef struct {
+    const char *name;
+    const step_t *steps;
+    size_t count;
+} scenario_t;
+
+static const step_t atc_macro[] = {
+    { Step_Write, 1, 5, 0, 0.0 },            // spindle orient
+    { Step_Wait, 1, 2, 0, 120.0 },      // oriented
+    { Step_Motion, 0, 0, 0, 800.0 },    // into the holder
+    { Step_Write, 1, 5, 1, 0.0 },            // drawbar release
+    { Step_Write, 1, 5, 2, 0.0 },            // air blast on
+    { Step_Wait, 1, 2, 1, 150.0 },      // drawbar open
+    { Step_Motion, 0, 0, 0, 400.0 },    // Z up
+    { Step_Read, 1, 3, 10, 0.0 },            // tool in the new pocket
+    { Step_Motion, 0, 0, 0, 1200.0 },   // to the new pocket
+    { Step_Motion, 0, 0, 0, 400.0 },    // Z down
+    { Step_Write, 1, 5, 2, 0.0 },            // air blast off
+    { Step_Write, 1, 5, 1, 0.0 },            // drawbar clamp
+    { Step_Wait, 1, 2, 2, 150.0 },      // drawbar closed
+    { Step_Read, 1, 3, 11, 0.0 },            // tool id check
+    { Step_Motion, 0, 0, 0, 800.0 },    // out of the holder
+};
+
+static const step_t telemetry_job[] = {
+    { Step_Motion, 0, 0, 0, 20.0 },
+    { Step_Read, 1, 4, 0, 0.0 },             // spindle load
+    { Step_Read, 1, 4, 1, 0.0 },             // coolant temperature
+    { Step_Read, 1, 4, 2, 0.0 },             // coolant flow
+    { Step_Read, 1, 4, 3, 0.0 },             // air pressure
+    { Step_Repeat, 0, 0, 0, 500.0 },
+};
+
+static const step_t pulse_job[] = {
+    { Step_Write, 1, 5, 0, 0.0 },            // marker on
+    { Step_Motion, 0, 0, 0, 5.0 },
+    { Step_Write, 1, 5, 0, 0.0 },            // marker off
+    { Step_Motion, 0, 0, 0, 15.0 },
+    { Step_Repeat, 0, 0, 0, 500.0 },
+};
+
+static const scenario_t scenarios[] = {
+    { "atc", atc_macro, sizeof(atc_macro) / sizeof(step_t) },
+    { "telemetry", telemetry_job, sizeof(telemetry_job) / sizeof(step_t) },
+    { "pulse", pulse_job, sizeof(pulse_job) / sizeof(step_t) },
+};
+
+typedef struct {
+    const sim_config_t *config;
+    double bus_free;            // end of the last frame on the bus
+    double bus_us;
+    uint64_t frames;
+    double poll_us;             // cached mode, image poll period
+    double next_poll;           // cached mode, next round of the image poll
+    step_t points[MAX_SOURCES]; // cached mode, points read by the job
+    size_t n_points;
+    step_t queued[MAX_SOURCES]; // async writes waiting for the bus
+    double queued_at[MAX_SOURCES];
+    size_t n_queued;
+} mode_sim_t;
+
+// Runs one transaction starting no earlier than time, returns when the response is received and sets *sampled
+// to when the slave took the value.
+static double mode_transact(mode_sim_t *sim, double time, uint_fast16_t tx_length, uint_fast16_t rx_length, double *sampled) {
+    const sim_config_t *cfg = sim->config;
+    double t35 = mbio_t35_us(cfg->baud, cfg->bits);
+    double tx_start = time > sim->bus_free + t35 ? time : sim->bus_free + t35;
+    double tx_end = tx_start + mbio_frame_us(tx_length, cfg->baud, cfg->bits);
+    double rx_start = tx_end + (cfg->turnaround_us > t35 ? cfg->turnaround_us : t35);
+    double rx_end = rx_start + mbio_frame_us(rx_length, cfg->baud, cfg->bits);
+
+    if (sampled) {
+        *sampled = tx_end;
+    }
+    sim->bus_free = rx_end;
+    sim->bus_us += rx_end - tx_start;
+    sim->frames++;
+
+    return loop_time(cfg, rx_end);
+}
+
+static uint_fast16_t mode_read_length(uint8_t function, uint_fast16_t count) {
+    return 5 + 2 + (function <= 2 ? (count + 7) / 8 : count * 2);
+}
+
+// Hands the queued writes to the bus as it becomes free up to time, merging adjacent ones in batched mode.
+// Returns when the last write sent started.
+static double mode_drain(mode_sim_t *sim, double time, sim_mode_t mode) {
+    double t35 = mbio_t35_us(sim->config->baud, sim->config->bits), started = 0.0;
+
+    while (sim->n_queued) {
+        double start = sim->bus_free + t35 > sim->queued_at[0] ? sim->bus_free + t35 : sim->queued_at[0];
+        step_t *first = &sim->queued[0];
+        size_t count = 1;
+
+        if (start > time) {
+            break;
+        }
+
+        // only writes queued before the bus became free can be merged
+        while (mode == Mode_Batched && count < sim->n_queued && sim->queued_at[count] <= start && sim->queued[count].device == first->device
+                && sim->queued[count].function == first->function && sim->queued[count].address == first->address + count) {
+            count++;
+        }
+
+        if (count == 1) {
+            mode_transact(sim, start, 8, 8, NULL);
+        }
+        else { // FC15/FC16
+            mode_transact(sim, start, 9 + (first->function == 5 ? (count + 7) / 8 : count * 2), 8, NULL);
+        }
+
+        started = start;
+        sim->n_queued -= count;
+        memmove(sim->queued, sim->queued + count, sim->n_queued * sizeof(step_t));
+        memmove(sim->queued_at, sim->queued_at + count, sim->n_queued * sizeof(double));
+    }
+
+    return started;
+}
+
+// Cached mode: runs the rounds of the image poll due up to time, one frame per point.
+static void mode_poll(mode_sim_t *sim, double time) {
+    while (sim->n_points && sim->next_poll <= time) {
+        for (size_t idx = 0; idx < sim->n_points; idx++) {
+            mode_transact(sim, sim->next_poll, 8, mode_read_length(sim->points[idx].function, 1), NULL);
+        }
+        // a round is skipped when the previous one is still running
+        sim->next_poll = sim->next_poll + sim->poll_us > sim->bus_free ? sim->next_poll + sim->poll_us : sim->bus_free;
+    }
+}
+
+typedef struct {
+    double bus_us;
+    double wall_us;
+    uint64_t frames;
+    double max_stall_us;
+} mode_result_t;
+
+// Runs the scenario in the given mode, step_us is optional and receives the longest stall of each step.
+static void mode_run(const sim_config_t *config, const scenario_t *scenario, sim_mode_t mode, mode_result_t *result, double *step_us) {
+    mode_sim_t sim = { .config = config, .bus_free = -1e9, .poll_us = config->poll_ms > 0.0 ? config->poll_ms * 1000.0 : 50000.0 };
+    double time = 0.0, stall = 0.0;
+    size_t idx = 0, repeat_from = 0, repeats = 0;
+
+    memset(result, 0, sizeof(mode_result_t));
+
+    if (mode == Mode_Cached) {
+        for (size_t idx = 0; idx < scenario->count && sim.n_points < MAX_SOURCES; idx++) {
+            const step_t *step = &scenario->steps[idx];
+            if (step->type == Step_Read || step->type == Step_Wait) {
+                sim.points[sim.n_points++] = *step;
+            }
+        }
+    }
+
+    while (idx < scenario->count) {
+        const step_t *step = &scenario->steps[idx];
+        double start = time, sampled, changed;
+        size_t next = idx + 1;
+
+        if (mode == Mode_Cached) {
+            mode_poll(&sim, time);
+        }
+
+        switch (step->type) {
+
+            case Step_Write:
+                if (mode == Mode_Blocking) {
+                    mode_drain(&sim, INFINITY, mode);
+                    time = mode_transact(&sim, time, 8, 8, NULL);
+                }
+                else {
+                    mode_drain(&sim, time, mode);
+                    if (sim.n_queued == MAX_SOURCES) {
+                        // the driver queue is full, the G-code waits for a free slot
+                        time = loop_time(config, mode_drain(&sim, INFINITY, mode));
+                        mode_drain(&sim, time, mode);
+                    }
+                    sim.queued_at[sim.n_queued] = time;
+                    sim.queued[sim.n_queued++] = *step;
+                    mode_drain(&sim, time, mode);
+                }
+                break;
+
+            case Step_Read:
+                if (mode == Mode_Cached) {
+                    break;
+                }
+                mode_drain(&sim, INFINITY, mode);
+                if (mode == Mode_Batched) {
+                    size_t count = 1;
+
+                    while (idx + count < scenario->count && scenario->steps[idx + count].type == Step_Read && scenario->steps[idx + count].device == step->device
+                            && scenario->steps[idx + count].function == step->function && scenario->steps[idx + count].address == step->address + count) {
+                        count++;
+                    }
+                    time = mode_transact(&sim, time, 8, mode_read_length(step->function, count), NULL);
+                    next = idx + count;
+                }
+                else {
+                    time = mode_transact(&sim, time, 8, mode_read_length(step->function, 1), NULL);
+                }
+                break;
+
+            case Step_Wait:
+                changed = time + step->ms * 1000.0;
+                if (mode == Mode_Cached) {
+                    // the image poll runs on, the wait ends on the first poll sampled after the change
+                    while (sim.next_poll < changed) {
+                        mode_poll(&sim, sim.next_poll);
+                    }
+                    mode_poll(&sim, sim.next_poll);
+                    time = loop_time(config, sim.bus_free);
+                }
+                else {
+                    mode_drain(&sim, INFINITY, mode);
+                    do {
+                        time = mode_transact(&sim, time, 8, mode_read_length(2, 1), &sampled);
+                        if (sampled < changed) {
+                            time += WAIT_STEP_MS * 1000.0;
+                        }
+                    } while (sampled < changed);
+                }
+                break;
+
+            case Step_Motion:
+                time += step->ms * 1000.0;
+                mode_drain(&sim, time, mode);
+                break;
+
+            case Step_Repeat:
+                if (++repeats < (size_t)step->ms) {
+                    next = repeat_from;
+                }
+                else {
+                    repeats = 0;
+                    repeat_from = next;
+                }
+                break;
+        }
+
+        if (step->type != Step_Motion && time - start > stall) {
+            stall = time - start;
+        }
+        if (step_us && time - start > step_us[idx]) {
+            step_us[idx] = time - start;
+        }
+        idx = next;
+    }
+
+    mode_drain(&sim, INFINITY, mode);
+    if (mode == Mode_Cached) {
+        mode_poll(&sim, time);
+    }
+
+    result->bus_us = sim.bus_us;
+    result->wall_us = time > sim.bus_free ? time : sim.bus_free;
+    result->frames = sim.frames;
+    result->max_stall_us = stall;
+}
+
+// With bench set the results are printed as [MBIOBENCH:<job>_<mode>_<baud>_p<poll>,<frames>,<bus us>,<wall us>,<max stall us>,us].
+static void mode_compare(const sim_config_t *config, bool header, bool bench) {
+    if (header && !bench) {
+        printf("%7s %8s %-10s %-9s %10s %10s %8s %12s\n", "baud", "poll ms", "scenario", "mode", "bus ms", "wall ms", "frames", "max stall ms");
+    }
+
+    for (size_t idx = 0; idx < sizeof(scenarios) / sizeof(scenario_t); idx++) {
+        for (sim_mode_t mode = Mode_Blocking; mode < Mode_N; mode++) {
+            mode_result_t result;
+
+            mode_run(config, &scenarios[idx], mode, &result, NULL);
+            if (bench) {
+                printf("[MBIOBENCH:%s_%s_%u_p%g,%llu,%.0f,%.0f,%.0f,us]\n", scenarios[idx].name, mode_name[mode], config->baud, config->poll_ms,
+                        (unsigned long long)result.frames, result.bus_us, result.wall_us, result.max_stall_us);
+                continue;
+            }
+            printf("%7u %8.1f %-10s %-9s %10.1f %10.1f %8llu %12.2f\n", config->baud, config->poll_ms, scenarios[idx].name, mode_name[mode],
+                    result.bus_us / 1000.0, result.wall_us / 1000.0, (unsigned long long)result.frames, result.max_stall_us / 1000.0);
+        }
+    }
+}
+
+/*
+ * Latency budget check of G-code macros, e.g. the tool change macros of a machine. The M101 and M102 blocks are
+ * validated and executed by the plugin itself on the simulated bus of mbio_bus.h, M101 with the R word goes to the
+ * write-behind and is not waited for. G4 dwells run the realtime loop, other blocks are ignored.
+ */
+
+#define MAX_MACRO_STEPS 1024
+
+typedef struct {
+    unsigned line;
+    char block[128];
+    double dwell_ms;            // G4 P, the block is a M-code when 0
+} macro_step_t;
+
+typedef struct {
+    const char *path;
+    const sim_config_t *config;
+    const double *bauds;
+    double change_ms;           // time from the start of a M102 until its input changes
+    double total_ms;
+    double step_ms;
+    macro_step_t steps[MAX_MACRO_STEPS];
+    size_t count;
+} macro_t;
+
+// The input a M102 waits for, the slave reads it as the other value until it changes.
+static struct {
+    double change_at;           // us
+    bool value;
+} macro_input;
+
+// Inputs and coils read as the input of the last M102, registers as 0, writes are echoed.
+static bool macro_slave(modbus_message_t *msg, double now) {
+    switch (msg->adu[1]) {
+
+        case ModBus_ReadCoils:
+        case ModBus_ReadDiscreteInputs:
+            msg->adu[2] = 1;
+            msg->adu[3] = now >= macro_input.change_at ? macro_input.value : !macro_input.value;
+            msg->rx_length = 6;
+            break;
+
+        case ModBus_ReadHoldingRegisters:
+        case ModBus_ReadInputRegisters:
+            msg->adu[2] = 2;
+            msg->adu[3] = msg->adu[4] = 0;
+            msg->rx_length = 7;
+            break;
+
+        default:
+            msg->rx_length = 8;
+            break;
+    }
+
+    return true;
+}
+
+static bool macro_load(const char *path, macro_t *macro) {
+    FILE *in;
+    char line[256];
+    unsigned number = 0;
+
+    if ((in = fopen(path, "r")) == NULL) {
+        perror(path);
+        return false;
+    }
+
+    while (fgets(line, sizeof(line), in)) {
+        macro_step_t *step = &macro->steps[macro->count];
+        double m, g, p;
+
+        number++;
+        mbio_bus_block(line, step->block, sizeof(step->block));
+        m = mbio_bus_word(step->block, 'M');
+        g = mbio_bus_word(step->block, 'G');
+        p = mbio_bus_word(step->block, 'P');
+
+        if (m == 101.0 || m == 102.0) {
+            step->dwell_ms = 0.0;
+        }
+        else if (g == 4.0 && !isnan(p) && p > 0.0) {
+            step->dwell_ms = p * 1000.0;
+        }
+        else {
+            continue;
+        }
+
+        if (macro->count == MAX_MACRO_STEPS) {
+            fprintf(stderr, "%s: more than %d steps\n", path, MAX_MACRO_STEPS);
+            fclose(in);
+            return false;
+        }
+
+        step->line = number;
+        macro->count++;
+    }
+
+    fclose(in);
+
+    return macro->count;
+}
+
+// Runs the macro at the baud rate bauds[idx] in a child process, the exit code is 2 when a block is rejected,
+// a budget is exceeded or a M102 times out.
+static int macro_run(size_t idx, void *arg) {
+    const macro_t *macro = arg;
+    const sim_config_t *config = macro->config;
+    mbio_bus_config_t bus_config = {
+        .baud = (uint32_t)macro->bauds[idx],
+        .bits = config->bits,
+        .turnaround_us = config->turnaround_us,
+        .loop_us = config->loop_us,
+        .timeout_ms = config->timeout_ms,
+        .error_rate = config->error_rate,
+        .seed = config->seed,
+        .slave = macro_slave
+    };
+    static double step_us[MAX_MACRO_STEPS];
+    static status_code_t status[MAX_MACRO_STEPS];
+    static bool timeout[MAX_MACRO_STEPS];
+    bool ok = true, over;
+
+    mbio_bus_start(&bus_config);
+
+    for (size_t step = 0; step < macro->count; step++) {
+        const macro_step_t *s = &macro->steps[step];
+        double start = bus.now;
+
+        if (s->dwell_ms > 0.0) {
+            mbio_bus_run(bus.now + s->dwell_ms * 1000.0);
+            continue;
+        }
+
+        if (mbio_bus_word(s->block, 'M') == 102.0) {
+            macro_input.value = mbio_bus_word(s->block, 'Q') == 1.0;
+            macro_input.change_at = bus.now + macro->change_ms * 1000.0;
+        }
+
+        core_alarm = Alarm_None;
+        status[step] = mbio_bus_mcode(s->block);
+        timeout[step] = core_alarm == (alarm_code_t)Status_GCodeTimeout;
+        step_us[step] = bus.now - start;
+    }
+
+    // the G-code is done, the writes it queued still go out
+    while (bus.busy || bus.count) {
+        mbio_bus_realtime();
+    }
+
+    over = macro->total_ms > 0.0 && bus.now > macro->total_ms * 1000.0;
+    printf("%s at %u baud: %.1f ms total, %llu frames, %.1f ms on the bus%s\n", macro->path, bus_config.baud, bus.now / 1000.0,
+            (unsigned long long)bus.frames, bus.busy_us / 1000.0, over ? "  OVER BUDGET" : "");
+    ok = !over;
+
+    for (size_t step = 0; step < macro->count; step++) {
+        const macro_step_t *s = &macro->steps[step];
+
+        if (s->dwell_ms > 0.0) {
+            continue;
+        }
+        if (status[step] != Status_OK) {
+            printf("  line %u: %s rejected, status %d\n", s->line, s->block, (int)status[step]);
+            ok = false;
+            continue;
+        }
+
+        over = macro->step_ms > 0.0 && step_us[step] > macro->step_ms * 1000.0;
+        if (over || timeout[step]) {
+            printf("  line %u: %s took %.1f ms%s\n", s->line, s->block, step_us[step] / 1000.0, timeout[step] ? ", M102 times out" : "  OVER BUDGET");
+            ok = false;
+        }
+    }
+
+    return ok ? EXIT_SUCCESS : 2;
+}
+
+// Runs the macro at every baud rate, returns false when a block is rejected, a budget is exceeded or a M102 times out.
+static bool macro_budget(const sim_config_t *config, const double *bauds, size_t n_bauds, const char *path, double change_ms, double total_ms, double step_ms) {
+    static macro_t macro;
+
+    macro.path = path;
+    macro.config = config;
+    macro.bauds = bauds;
+    macro.change_ms = change_ms;
+    macro.total_ms = total_ms;
+    macro.step_ms = step_ms;
+
+    if (!macro_load(path, &macro)) {
+        return false;
+    }
+
+    // one after the other, the reports come out in the order of the baud rates
+    return mbio_bus_fork(n_bauds, 1, macro_run, &macro);
+}
+
+static void print_header(void) {
+    printf("%7s %4s %8s %8s %9s %6s %6s", "baud", "devs", "poll ms", "machines", "frames/s", "util%", "max%");
+    for (uint_fast8_t cls = 0; cls < Class_N; cls++) {
+        printf(" %7s p50 %5s p99 %5s max", class_name[cls], "", "");
+    }
+    printf(" %8s %8s %9s\n", "errors", "overruns", "speedup");
+}
+
+static void print_result(const sim_config_t *config, const sim_result_t *result) {
+    printf("%7u %4u %8.1f %8u %9.1f %6.1f %6.1f", config->baud, (unsigned)config->devices, config->poll_ms, (unsigned)result->machines,
+            result->frames * 1000000.0 / result->duration_us, result->busy_us * 100.0 / result->duration_us, result->util_max);
+    for (uint_fast8_t cls = 0; cls < Class_N; cls++) {
+        const mbio_hist_t *h = &result->latency[cls];
+        printf(" %11.2f %9.2f %9.2f", mbio_hist_percentile(h, 50.0) / 1000.0, mbio_hist_percentile(h, 99.0) / 1000.0, h->max / 1000.0);
+    }
+    printf(" %8llu %8llu %8.0fx\n", (unsigned long long)result->errors, (unsigned long long)result->overruns,
+            result->wall_s > 0.0 ? result->duration_us / 1000000.0 / result->wall_s : 0.0);
+}
+
+// Prints the latencies as [MBIOBENCH:<class>_<baud>_d<devices>_p<poll>,<count>,<p50>,<mean>,<p99>,us] for mbio_perfcmp.
+static void print_bench(const sim_config_t *config, const sim_result_t *result) {
+    for (uint_fast8_t cls = 0; cls < Class_N; cls++) {
+        const mbio_hist_t *h = &result->latency[cls];
+
+        if (h->count) {
+            printf("[MBIOBENCH:%s_%u_d%u_p%g,%llu,%u,%llu,%u,us]\n", class_name[cls], config->baud, (unsigned)config->devices, config->poll_ms,
+                    (unsigned long long)h->count, mbio_hist_percentile(h, 50.0), (unsigned long long)(h->sum / h->count), mbio_hist_percentile(h, 99.0));
+        }
+    }
+}
+
+static void usage(FILE *out, const char *name) {
+    fprintf(out, "usage: %s [options]\n"
+        "  -b <baud,...>       baud rates to sweep (19200)\n"
+        "  -d <devices,...>    device counts to sweep (1)\n"
+        "  -p <ms,...>         input poll periods per device to sweep, 0 for none (50)\n"
+        "  -a <ms>             sampler period, 0 for none (0)\n"
+        "  -m <ms>             period of blocking M101 writes, 0 for none (0)\n"
+        "  -T <us>             mean slave turnaround (1000)\n"
+        "  -j <us>             slave turnaround jitter (200)\n"
+        "  -l <us>             controller realtime loop period (100)\n"
+        "  -o <ms>             response timeout (50)\n"
+        "  -e <rate>           probability of a lost response (0)\n"
+        "  -P <n|e|o>          parity (n)\n"
+        "  -t <s>              virtual time to simulate per configuration (60)\n"
+        "  -s <seed>           random seed (1)\n"
+        "  -n <machines>       independent machines simulated per configuration (1)\n"
+        "  -J <jobs>           number of threads (number of CPUs)\n"
+        "  -S <hours>          soak test of the plugin for the given virtual time, polls every MBIO_SCAN_INTERVAL ms\n"
+        "  -R <min>            soak: mean time between controller resets, 0 for none (30)\n"
+        "  -B <rate>           soak: probability of a lost response during error bursts, 0 for none (0.5)\n"
+        "  -D <%%>              soak: max p50 latency drift between the first and last hour (25)\n"
+        "  -M                  compare blocking, async, cached and batched modes on the job scenarios\n"
+        "  -A <file>           check the latency budget of a G-code macro at every baud rate\n"
+        "  -L <ms>             macro: total time budget, 0 for none (0)\n"
+        "  -K <ms>             macro: budget per M101/M102 block, 0 for none (0)\n"
+        "  -w <ms>             macro: time from the start of a M102 until its input changes (0)\n"
+        "  -c                  print the results as [MBIOBENCH:...] lines for mbio_perfcmp\n"
+        "  -h                  print this help\n", name);
+}
+
+// Prints the soak test summary, returns false when a check failed.
+static bool print_soak(const sim_result_t *result, double max_drift) {
+    bool ok = result->leaks == 0 && result->stuck == 0 && result->tick_errors == 0;
+
+    printf("\nsoak: %.1f h on %u machine(s), %llu resets, %llu error bursts, %llu tick wraps, max driver queue %zu\n",
+            result->duration_us / 3600000000.0 / result->machines, (unsigned)result->machines, (unsigned long long)result->resets,
+            (unsigned long long)result->bursts, (unsigned long long)result->wraps, result->max_queue);
+    printf("queue leaks %llu, stuck requests %llu, tick errors %llu\n",
+            (unsigned long long)result->leaks, (unsigned long long)result->stuck, (unsigned long long)result->tick_errors);
+
+    for (uint_fast8_t cls = 0; cls < Class_N; cls++) {
+        const mbio_hist_t *first = &result->first[cls], *last = &result->last[cls];
+
+        if (first->count && last->count) {
+            double p50_first = mbio_hist_percentile(first, 50.0), p50_last = mbio_hist_percentile(last, 50.0);
+            double drift = p50_first > 0.0 ? (p50_last - p50_first) * 100.0 / p50_first : 0.0;
+            bool drifted = fabs(drift) > max_drift;
+
+            printf("%-6s p50 %8.2f -> %8.2f ms (%+.1f %%), p99 %8.2f -> %8.2f ms%s\n", class_name[cls], p50_first / 1000.0, p50_last / 1000.0, drift,
+                    mbio_hist_percentile(first, 99.0) / 1000.0, mbio_hist_percentile(last, 99.0) / 1000.0, drifted ? "  DRIFT" : "");
+            ok = ok && !drifted;
+        }
+    }
+
+    printf("%s\n", ok ? "PASS" : "FAIL");
+
+    return ok;
+}
+
+int main(int argc, char **argv) {
+    int opt;
+    double bauds[MAX_LIST] = { 19200 }, devices[MAX_LIST] = { 1 }, polls[MAX_LIST] = { 50 };
+    size_t n_bauds = 1, n_devices = 1, n_polls = 1;
+    char parity = 'n';
+    long jobs = sysconf(_SC_NPROCESSORS_ONLN), machines = 1;
+    double max_drift = 25.0;
+    bool modes = false, bench = false;
+    const char *macro = NULL;
+    double total_ms = 0.0, step_ms = 0.0, change_ms = 0.0;
+    sim_config_t config = {
+        .sample_ms = 0.0,
+        .mcode_ms = 0.0,
+        .turnaround_us = 1000.0,
+        .jitter_us = 200.0,
+        .loop_us = 100.0,
+        .timeout_ms = 50.0,
+        .error_rate = 0.0,
+        .duration_s = 60.0,
+        .seed = 1,
+        .reset_min = 30.0,
+        .burst_rate = 0.5
+    };
+
+    while ((opt = getopt(argc, argv, "b:d:p:a:m:T:j:l:o:e:P:t:s:n:J:S:R:B:D:MA:L:K:w:ch")) != -1) {
+        switch (opt) {
+            case 'b': n_bauds = parse_list(optarg, bauds); break;
+            case 'd': n_devices = parse_list(optarg, devices); break;
+            case 'p': n_polls = parse_list(optarg, polls); break;
+            case 'a': config.sample_ms = strtod(optarg, NULL); break;
+            case 'm': config.mcode_ms = strtod(optarg, NULL); break;
+            case 'T': config.turnaround_us = strtod(optarg, NULL); break;
+            case 'j': config.jitter_us = strtod(optarg, NULL); break;
+            case 'l': config.loop_us = strtod(optarg, NULL); break;
+            case 'o': config.timeout_ms = strtod(optarg, NULL); break;
+            case 'e': config.error_rate = strtod(optarg, NULL); break;
+            case 'P': parity = optarg[0]; break;
+            case 't': config.duration_s = strtod(optarg, NULL); break;
+            case 's': config.seed = (uint32_t)strtoul(optarg, NULL, 10); break;
+            case 'n': machines = strtol(optarg, NULL, 10); break;
+            case 'J': jobs = strtol(optarg, NULL, 10); break;
+            case 'S': config.soak = true; config.duration_s = strtod(optarg, NULL) * 3600.0; break;
+            case 'R': config.reset_min = strtod(optarg, NULL); break;
+            case 'B': config.burst_rate = strtod(optarg, NULL); break;
+            case 'D': max_drift = strtod(optarg, NULL); break;
+            case 'M': modes = true; break;
+            case 'A': macro = optarg; break;
+            case 'L': total_ms = strtod(optarg, NULL); break;
+            case 'K': step_ms = strtod(optarg, NULL); break;
+            case 'w': change_ms = strtod(optarg, NULL); break;
+            case 'c': bench = true; break;
+            case 'h':
+                usage(stdout, argv[0]);
+                return EXIT_SUCCESS;
+            default:
+                usage(stderr, argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
+    config.bits = parity == 'n' ? 10 : 11;
+
+    if (machines < 1) {
+        machines = 1;
+    }
+
+    if (macro) {
+        return macro_budget(&config, bauds, n_bauds, macro, change_ms, total_ms, step_ms) ? EXIT_SUCCESS : 2;
+    }
+
+    if (modes) {
+        for (size_t baud = 0; baud < n_bauds; baud++) {
+            for (size_t poll = 0; poll < n_polls; poll++) {
+                config.baud = (uint32_t)bauds[baud];
+                config.poll_ms = polls[poll];
+                mode_compare(&config, baud == 0 && poll == 0, bench);
+            }
+        }
+
+        return EXIT_SUCCESS;
+    }
+
+    if (config.soak) {
+        n_bauds = n_devices = n_polls = 1;
+    }
+
+    size_t n_configs = n_bauds * n_devices * n_polls, n_tasks = n_configs * machines;
+    bool ok = true;
+    sim_task_t *tasks = calloc(n_tasks, sizeof(sim_task_t));
+    struct timespec t0, t1;
+
+    if (tasks == NULL) {
+        perror("calloc");
+        return EXIT_FAILURE;
+    }
+
+    for (size_t idx = 0; idx < n_tasks; idx++) {
+        size_t cfg = idx / machines;
+
+        tasks[idx].config = config;
+        tasks[idx].config.baud = (uint32_t)bauds[cfg / (n_devices * n_polls)];
+        tasks[idx].config.devices = (uint_fast16_t)devices[(cfg / n_polls) % n_devices];
+        tasks[idx].config.poll_ms = polls[cfg % n_polls];
+        tasks[idx].config.seed = config.seed + (uint32_t)(idx % machines) * 7919;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    if (config.soak) {
+        // the plugin state is static, each machine runs in a process of its own
+        sim_task_t *shared = mbio_bus_shared(n_tasks * sizeof(sim_task_t));
+
+        memcpy(shared, tasks, n_tasks * sizeof(sim_task_t));
+        ok = mbio_bus_fork(n_tasks, jobs, soak_run, shared);
+        memcpy(tasks, shared, n_tasks * sizeof(sim_task_t));
+        munmap(shared, n_tasks * sizeof(sim_task_t));
+    }
+    else {
+        sim_run_all(tasks, n_tasks, jobs);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    if (!bench) {
+        print_header();
+    }
+
+    for (size_t cfg = 0; cfg < n_configs; cfg++) {
+        sim_result_t total = {0};
+
+        for (long machine = 0; machine < machines; machine++) {
+            sim_merge(&total, &tasks[cfg * machines + machine].result);
+        }
+        if (bench) {
+            print_bench(&tasks[cfg * machines].config, &total);
+        }
+        else {
+            print_result(&tasks[cfg * machines].config, &total);
+        }
+        if (config.soak) {
+            ok = print_soak(&total, max_drift) && ok;
+        }
+    }
+
+    double wall = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+
+    fprintf(stderr, "%zu simulations, %.0f s of virtual time in %.2f s on %ld threads\n",
+             n_tasks, n_tasks * config.duration_s, wall, jobs < (long)n_tasks ? jobs : (long)n_tasks);
+
+    free(tasks);
+
+    return ok ? EXIT_SUCCESS : 2;
+}
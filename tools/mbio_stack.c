@@ -0,0 +1,305 @@
+/*
+
+mbio_stack.c - worst case stack depth of the MODBUS I/O plugin entry points
+
+Copyright (c) 2024 Richard Toth
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+Build: cc -O2 -o mbio_stack tools/mbio_stack.c
+Usage: mbio_stack [-e entry,...] [-v] file.ci...
+
+Reads the call graph files written by GCC with -fcallgraph-info=su (configure the firmware with
+-DMBIO_STACK_USAGE=ON) and prints the deepest call chain from each entry point with its stack use.
+Functions without stack information (library code not built with the option, calls through
+function pointers such as the HAL) are listed, the result is a lower bound when there are any.
+Recursion makes the depth unbounded and is reported as such.
+
+*/
+
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+
+#define MAX_NAME 128
+
+// Every function modbus_io.c hands to the core, keep in sync with the plugin. Entries of features not built in are
+// reported as not found.
+static const char *const default_entries = "mbio_init,"
+                                           // user M-code handlers
+                                           "mbio_check,mbio_validate,mbio_execute,"
+                                           // MODBUS driver callbacks
+                                           "mbio_rx_packet,mbio_rx_exception,"
+                                           // core event hooks and foreground tasks
+                                           "mbio_poll_realtime,mbio_poll_delay,mbio_reset,mbio_report_options,mbio_get_commands,mbio_raise_alarm,"
+                                           // HAL coolant and the change input interrupt
+                                           "mbio_coolant_set_state,mbio_coolant_get_state,mbio_notify_irq,"
+                                           // $ commands
+                                           "mbio_cmd_plan,mbio_cmd_rule,mbio_cmd_limit,mbio_cmd_latency,mbio_cmd_trace,mbio_cmd_log,"
+                                           "mbio_cmd_bench,mbio_cmd_profile";
+
+typedef enum {
+    Node_New = 0,
+    Node_Visiting,
+    Node_Done
+} node_state_t;
+
+typedef struct {
+    char title[MAX_NAME];       // static functions are prefixed with the file name
+    char name[MAX_NAME];
+    long stack;                 // bytes, -1 when unknown
+    bool dynamic;
+    size_t *callees;
+    size_t n_callees;
+    // depth search
+    node_state_t state;
+    long depth;                 // worst case including the callees
+    long next;                  // callee on the worst case path, -1 for none
+    bool recursive;
+    bool incomplete;
+} node_t;
+
+static node_t *nodes;
+static size_t n_nodes, size_nodes;
+
+static long find(const char *title) {
+    for (size_t idx = 0; idx < n_nodes; idx++) {
+        if (!strcmp(nodes[idx].title, title)) {
+            return (long)idx;
+        }
+    }
+
+    return -1;
+}
+
+static size_t add(const char *title) {
+    long idx = find(title);
+
+    if (idx >= 0) {
+        return (size_t)idx;
+    }
+
+    if (n_nodes == size_nodes) {
+        size_nodes = size_nodes ? size_nodes * 2 : 256;
+        if ((nodes = realloc(nodes, size_nodes * sizeof(node_t))) == NULL) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    node_t *node = &nodes[n_nodes];
+    const char *colon = strrchr(title, ':');
+
+    memset(node, 0, sizeof(node_t));
+    strncpy(node->title, title, MAX_NAME - 1);
+    strncpy(node->name, colon ? colon + 1 : title, MAX_NAME - 1);
+    node->stack = -1;
+
+    return n_nodes++;
+}
+
+// Copies the quoted value following key into value.
+static bool field(const char *line, const char *key, char *value) {
+    const char *s = strstr(line, key), *end;
+
+    if (s == NULL || (s = strchr(s + strlen(key), '"')) == NULL || (end = strchr(++s, '"')) == NULL || end - s >= MAX_NAME) {
+        return false;
+    }
+
+    memcpy(value, s, end - s);
+    value[end - s] = '\0';
+
+    return true;
+}
+
+static bool load(const char *path) {
+    FILE *in;
+    char line[1024], title[MAX_NAME], target[MAX_NAME];
+
+    if ((in = fopen(path, "r")) == NULL) {
+        perror(path);
+        return false;
+    }
+
+    while (fgets(line, sizeof(line), in)) {
+        if (!strncmp(line, "node:", 5) && field(line, "title:", title)) {
+            size_t idx = add(title);
+            node_t *node = &nodes[idx];
+            const char *label = strstr(line, "label:"), *bytes;
+
+            // label: "name\nfile:line:col\n<n> bytes (static|dynamic|dynamic,bounded)"
+            if (label && (bytes = strstr(label, " bytes (")) != NULL) {
+                const char *number = bytes;
+
+                while (number > label && number[-1] >= '0' && number[-1] <= '9') {
+                    number--;
+                }
+                node->stack = strtol(number, NULL, 10);
+                node->dynamic = !strncmp(bytes + 8, "dynamic", 7) && strncmp(bytes + 8, "dynamic,bounded", 15);
+            }
+        }
+        else if (!strncmp(line, "edge:", 5) && field(line, "sourcename:", title) && field(line, "targetname:", target)) {
+            size_t source = add(title), callee = add(target);
+            node_t *node = &nodes[source];
+
+            if ((node->callees = realloc(node->callees, (node->n_callees + 1) * sizeof(size_t))) == NULL) {
+                perror("realloc");
+                exit(EXIT_FAILURE);
+            }
+            node->callees[node->n_callees++] = callee;
+        }
+    }
+
+    fclose(in);
+
+    return true;
+}
+
+static void depth(size_t idx) {
+    node_t *node = &nodes[idx];
+
+    if (node->state == Node_Done) {
+        return;
+    }
+
+    if (node->state == Node_Visiting) {
+        node->recursive = true;
+        return;
+    }
+
+    node->state = Node_Visiting;
+    node->next = -1;
+    node->incomplete = node->stack < 0 || node->dynamic;
+
+    long deepest = 0;
+
+    for (size_t callee = 0; callee < node->n_callees; callee++) {
+        node_t *target = &nodes[node->callees[callee]];
+
+        depth(node->callees[callee]);
+
+        if (target->state == Node_Visiting || target->recursive) {
+            node->recursive = true;
+        }
+        if (target->incomplete) {
+            node->incomplete = true;
+        }
+        if (target->state == Node_Done && (node->next < 0 || target->depth > deepest)) {
+            deepest = target->depth;
+            node->next = (long)node->callees[callee];
+        }
+    }
+
+    node->depth = (node->stack > 0 ? node->stack : 0) + deepest;
+    node->state = Node_Done;
+}
+
+static void unknown(size_t idx, bool *seen) {
+    node_t *node = &nodes[idx];
+
+    if (seen[idx]) {
+        return;
+    }
+    seen[idx] = true;
+
+    if (node->stack < 0) {
+        printf("    no stack information: %s\n", node->name);
+    }
+    else if (node->dynamic) {
+        printf("    dynamic stack use: %s\n", node->name);
+    }
+
+    for (size_t callee = 0; callee < node->n_callees; callee++) {
+        unknown(node->callees[callee], seen);
+    }
+}
+
+int main(int argc, char **argv) {
+    int opt;
+    char entries[1024] = "";
+    bool verbose = false;
+
+    strncpy(entries, default_entries, sizeof(entries) - 1);
+
+    while ((opt = getopt(argc, argv, "e:v")) != -1) {
+        switch (opt) {
+            case 'e':
+                strncpy(entries, optarg, sizeof(entries) - 1);
+                break;
+            case 'v':
+                verbose = true;
+                break;
+            default:
+                optind = argc;
+                break;
+        }
+    }
+
+    if (optind >= argc) {
+        fprintf(stderr, "usage: %s [-e entry,...] [-v] file.ci...\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    for (int arg = optind; arg < argc; arg++) {
+        if (!load(argv[arg])) {
+            return EXIT_FAILURE;
+        }
+    }
+
+    printf("%-24s %8s %8s  %s\n", "entry point", "frame", "worst", "deepest call chain");
+
+    for (char *entry = strtok(entries, ","); entry; entry = strtok(NULL, ",")) {
+        long idx = -1;
+
+        // static functions are titled file:name
+        for (size_t n = 0; n < n_nodes && idx < 0; n++) {
+            if (!strcmp(nodes[n].title, entry) || !strcmp(nodes[n].name, entry)) {
+                idx = (long)n;
+            }
+        }
+
+        if (idx < 0 || nodes[idx].stack < 0) {
+            printf("%-24s not found\n", entry);
+            continue;
+        }
+
+        depth((size_t)idx);
+
+        node_t *node = &nodes[idx];
+
+        printf("%-24s %8ld %7ld%s ", entry, node->stack, node->depth, node->recursive ? "!" : node->incomplete ? "+" : " ");
+        for (long n = node->next; n >= 0; n = nodes[n].next) {
+            printf(" %s(%ld)", nodes[n].name, nodes[n].stack);
+        }
+        printf("%s\n", node->recursive ? "  RECURSIVE, unbounded" : "");
+
+        if (verbose && node->incomplete) {
+            bool *seen = calloc(n_nodes, sizeof(bool));
+
+            if (seen) {
+                unknown((size_t)idx, seen);
+                free(seen);
+            }
+        }
+    }
+
+    printf("\n+ lower bound, calls without stack information (-v lists them)\n");
+
+    return EXIT_SUCCESS;
+}